@@ -0,0 +1,140 @@
+// Writes the same data through a buffered QFile and through DirectWriter and
+// reports throughput and CPU time for each. Run it on the disk to be tuned:
+//
+//   direct_io_bench <directory> [size in MiB] [chunk in KiB]
+
+#include "core/DirectWriter.h"
+#include <QCoreApplication>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QTextStream>
+#include <ctime>
+
+#if defined(Q_OS_WIN)
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace Witra;
+
+namespace {
+
+struct Result {
+    double seconds = 0;
+    double cpuSeconds = 0;
+    bool ok = false;
+};
+
+bool syncFile(QFile& file)
+{
+    if (!file.flush()) return false;
+#if defined(Q_OS_WIN)
+    return FlushFileBuffers(reinterpret_cast<HANDLE>(_get_osfhandle(file.handle())));
+#else
+    return ::fsync(file.handle()) == 0;
+#endif
+}
+
+Result writeBuffered(const QString& path, const QByteArray& chunk, qint64 total)
+{
+    Result result;
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) return result;
+    
+    QElapsedTimer timer;
+    timer.start();
+    const std::clock_t cpu = std::clock();
+    
+    for (qint64 done = 0; done < total; done += chunk.size()) {
+        if (file.write(chunk) != chunk.size()) return result;
+    }
+    result.ok = syncFile(file);
+    
+    result.cpuSeconds = double(std::clock() - cpu) / CLOCKS_PER_SEC;
+    result.seconds = timer.nsecsElapsed() / 1e9;
+    return result;
+}
+
+// Same steps as a receive: the file is created buffered, the body goes
+// direct and the unaligned tail goes back through the buffered handle
+Result writeDirect(const QString& path, const QByteArray& chunk, qint64 total)
+{
+    Result result;
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) return result;
+    
+    QElapsedTimer timer;
+    timer.start();
+    const std::clock_t cpu = std::clock();
+    
+    DirectWriter writer;
+    if (!writer.open(path)) return result;
+    for (qint64 done = 0; done < total; done += chunk.size()) {
+        if (!writer.write(chunk)) return result;
+    }
+    
+    qint64 tailOffset = 0;
+    const QByteArray tail = writer.close(&tailOffset);
+    if (!tail.isEmpty() && (!file.seek(tailOffset) || file.write(tail) != tail.size())) {
+        return result;
+    }
+    result.ok = syncFile(file);
+    
+    result.cpuSeconds = double(std::clock() - cpu) / CLOCKS_PER_SEC;
+    result.seconds = timer.nsecsElapsed() / 1e9;
+    return result;
+}
+
+void report(QTextStream& out, const char* name, const Result& result, qint64 total)
+{
+    if (!result.ok) {
+        out << name << ": failed\n";
+        return;
+    }
+    out << name << ": " << QString::number(total / 1048576.0 / result.seconds, 'f', 1)
+        << " MiB/s, " << QString::number(result.cpuSeconds, 'f', 2) << " s CPU\n";
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app(argc, argv);
+    QTextStream out(stdout);
+    
+    const QStringList args = app.arguments();
+    if (args.size() < 2) {
+        out << "usage: direct_io_bench <directory> [size in MiB] [chunk in KiB]\n";
+        return 1;
+    }
+    
+    const QString path = QDir(args.at(1)).filePath("witra-direct-io-bench.tmp");
+    const qint64 total = (args.size() > 2 ? args.at(2).toLongLong() : 2048) * 1048576;
+    const int chunkSize = (args.size() > 3 ? args.at(3).toInt() : 64) * 1024;
+    if (total <= 0 || chunkSize <= 0) {
+        out << "size and chunk must be positive\n";
+        return 1;
+    }
+    
+    // Data that no filesystem can compress or dedupe
+    QByteArray chunk(chunkSize, Qt::Uninitialized);
+    quint32 seed = 0x9e3779b9u;
+    for (int i = 0; i < chunk.size(); ++i) {
+        seed = seed * 1664525u + 1013904223u;
+        chunk[i] = static_cast<char>(seed >> 24);
+    }
+    
+    out << "Writing " << total / 1048576 << " MiB in " << chunkSize / 1024
+        << " KiB chunks to " << path << "\n";
+    out.flush();
+    
+    report(out, "buffered", writeBuffered(path, chunk, total), total);
+    out.flush();
+    report(out, "direct  ", writeDirect(path, chunk, total), total);
+    
+    QFile::remove(path);
+    return 0;
+}
@@ -0,0 +1,143 @@
+#include "ContentIndex.h"
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+#if defined(Q_OS_LINUX)
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#elif defined(Q_OS_MACOS)
+#include <sys/clonefile.h>
+#endif
+
+namespace Witra {
+
+ContentIndex::ContentIndex(QObject* parent)
+    : QObject(parent)
+    , m_saveTimer(new QTimer(this))
+{
+    QString dataPath = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
+    QDir().mkpath(dataPath);
+    m_path = QDir(dataPath).filePath("content.json");
+    
+    m_saveTimer->setSingleShot(true);
+    m_saveTimer->setInterval(CONTENT_INDEX_SAVE_DELAY);
+    connect(m_saveTimer, &QTimer::timeout, this, &ContentIndex::save);
+}
+
+ContentIndex::~ContentIndex()
+{
+    if (m_saveTimer->isActive()) {
+        save();
+    }
+}
+
+void ContentIndex::load()
+{
+    QFile file(m_path);
+    if (!file.open(QIODevice::ReadOnly)) return;
+    
+    // Entries are checked against the disk when looked up, not here
+    const QJsonArray entries = QJsonDocument::fromJson(file.readAll()).array();
+    for (const QJsonValue& value : entries) {
+        const QJsonObject obj = value.toObject();
+        
+        Entry entry;
+        entry.localPath = obj["localPath"].toString();
+        entry.size = obj["size"].toVariant().toLongLong();
+        entry.modified = obj["modified"].toVariant().toLongLong();
+        
+        const QByteArray hash = QByteArray::fromHex(obj["hash"].toString().toLatin1());
+        if (!hash.isEmpty() && !entry.localPath.isEmpty()) {
+            m_entries.insert(hash, entry);
+        }
+    }
+}
+
+void ContentIndex::save()
+{
+    m_saveTimer->stop();
+    
+    QJsonArray entries;
+    for (auto it = m_entries.constBegin(); it != m_entries.constEnd(); ++it) {
+        QJsonObject obj;
+        obj["hash"] = QString::fromLatin1(it.key().toHex());
+        obj["localPath"] = it.value().localPath;
+        obj["size"] = it.value().size;
+        obj["modified"] = it.value().modified;
+        entries.append(obj);
+    }
+    
+    QSaveFile file(m_path);
+    if (!file.open(QIODevice::WriteOnly)) return;
+    file.write(QJsonDocument(entries).toJson(QJsonDocument::Compact));
+    file.commit();
+}
+
+void ContentIndex::add(const QByteArray& hash, const QString& localPath)
+{
+    const QFileInfo info(localPath);
+    if (hash.isEmpty() || !info.isFile()) return;
+    
+    Entry entry;
+    entry.localPath = info.absoluteFilePath();
+    entry.size = info.size();
+    entry.modified = info.lastModified().toMSecsSinceEpoch();
+    
+    const Entry known = m_entries.value(hash);
+    if (known.localPath == entry.localPath && known.size == entry.size &&
+        known.modified == entry.modified) {
+        return;
+    }
+    m_entries.insert(hash, entry);
+    
+    m_saveTimer->start();
+}
+
+QString ContentIndex::find(const QByteArray& hash, qint64 size)
+{
+    auto it = m_entries.find(hash);
+    if (it == m_entries.end()) return QString();
+    
+    // Edited, moved or deleted since it arrived
+    const QFileInfo info(it.value().localPath);
+    if (!info.isFile() || info.size() != it.value().size ||
+        info.lastModified().toMSecsSinceEpoch() != it.value().modified) {
+        m_entries.erase(it);
+        m_saveTimer->start();
+        return QString();
+    }
+    
+    return it.value().size == size ? it.value().localPath : QString();
+}
+
+bool ContentIndex::cloneFile(const QString& from, const QString& to)
+{
+    QFile::remove(to);
+    
+#if defined(Q_OS_LINUX)
+    {
+        QFile source(from);
+        QFile target(to);
+        if (source.open(QIODevice::ReadOnly) && target.open(QIODevice::WriteOnly) &&
+            ::ioctl(target.handle(), FICLONE, source.handle()) == 0) {
+            return true;
+        }
+    }
+    QFile::remove(to);
+#elif defined(Q_OS_MACOS)
+    if (::clonefile(QFile::encodeName(from).constData(), QFile::encodeName(to).constData(), 0) == 0) {
+        return true;
+    }
+#endif
+    
+    return QFile::copy(from, to);
+}
+
+} // namespace Witra
@@ -0,0 +1,56 @@
+#ifndef CONTENTINDEX_H
+#define CONTENTINDEX_H
+
+#include <QObject>
+#include <QHash>
+#include <QTimer>
+
+namespace Witra {
+
+// Files smaller than this go without a content hash; hashing them and
+// asking the receiver would cost more than sending them
+constexpr qint64 DEDUPE_MIN_SIZE = 1024 * 1024;
+
+// Delay before index changes are written out, so a folder of files
+// arriving one after another is saved once (ms)
+constexpr int CONTENT_INDEX_SAVE_DELAY = 2000;
+
+// Content hashes of files received into the download directory. A file
+// sent again under another name or into another folder is copied from
+// the copy already here instead of crossing the network.
+class ContentIndex : public QObject {
+    Q_OBJECT
+    
+public:
+    explicit ContentIndex(QObject* parent = nullptr);
+    ~ContentIndex();
+    
+    void load();
+    
+    void add(const QByteArray& hash, const QString& localPath);
+    
+    // A file still holding that content, or empty; entries for files
+    // changed or removed since are dropped on the way
+    QString find(const QByteArray& hash, qint64 size);
+    
+    // Reflinks where the filesystem can share extents, copies otherwise;
+    // call off the GUI thread
+    static bool cloneFile(const QString& from, const QString& to);
+    
+private:
+    struct Entry {
+        QString localPath;
+        qint64 size = 0;
+        qint64 modified = 0; // msecs since epoch
+    };
+    
+    void save();
+    
+    QString m_path;
+    QHash<QByteArray, Entry> m_entries;
+    QTimer* m_saveTimer;
+};
+
+} // namespace Witra
+
+#endif // CONTENTINDEX_H
@@ -0,0 +1,135 @@
+#include "Crc32c.h"
+#include <QtEndian>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define WITRA_CRC_SSE42
+#include <nmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define WITRA_TARGET_SSE42
+#else
+#include <cpuid.h>
+#define WITRA_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+#elif defined(__ARM_FEATURE_CRC32)
+#define WITRA_CRC_ARMV8
+#include <arm_acle.h>
+#endif
+
+namespace Witra {
+
+namespace {
+
+constexpr quint32 POLYNOMIAL = 0x82F63B78; // reflected
+
+using CrcFunction = quint32 (*)(quint32 crc, const uchar* data, qint64 length);
+
+// Slicing-by-8 tables for CPUs without a CRC instruction
+struct Tables {
+    quint32 table[8][256];
+    
+    Tables()
+    {
+        for (quint32 i = 0; i < 256; ++i) {
+            quint32 crc = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (crc >> 1) ^ (crc & 1 ? POLYNOMIAL : 0);
+            }
+            table[0][i] = crc;
+        }
+        for (int k = 1; k < 8; ++k) {
+            for (int i = 0; i < 256; ++i) {
+                table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF];
+            }
+        }
+    }
+};
+
+quint32 crcSoftware(quint32 crc, const uchar* data, qint64 length)
+{
+    static const Tables tables;
+    const auto& t = tables.table;
+    
+    while (length >= 8) {
+        const quint32 low = qFromLittleEndian<quint32>(data) ^ crc;
+        const quint32 high = qFromLittleEndian<quint32>(data + 4);
+        crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^
+              t[4][low >> 24] ^ t[3][high & 0xFF] ^ t[2][(high >> 8) & 0xFF] ^
+              t[1][(high >> 16) & 0xFF] ^ t[0][high >> 24];
+        data += 8;
+        length -= 8;
+    }
+    while (length-- > 0) {
+        crc = t[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(WITRA_CRC_SSE42)
+bool hasSse42()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 20)) != 0;
+#else
+    unsigned int eax, ebx, ecx, edx;
+    return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2);
+#endif
+}
+
+WITRA_TARGET_SSE42 quint32 crcSse42(quint32 crc, const uchar* data, qint64 length)
+{
+    quint64 wide = crc;
+    while (length >= 8) {
+        quint64 word;
+        std::memcpy(&word, data, sizeof(word));
+        wide = _mm_crc32_u64(wide, word);
+        data += 8;
+        length -= 8;
+    }
+    crc = static_cast<quint32>(wide);
+    while (length-- > 0) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+#if defined(WITRA_CRC_ARMV8)
+quint32 crcArmv8(quint32 crc, const uchar* data, qint64 length)
+{
+    while (length >= 8) {
+        quint64 word;
+        std::memcpy(&word, data, sizeof(word));
+        crc = __crc32cd(crc, word);
+        data += 8;
+        length -= 8;
+    }
+    while (length-- > 0) {
+        crc = __crc32cb(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+CrcFunction pickImplementation()
+{
+#if defined(WITRA_CRC_SSE42)
+    if (hasSse42()) return crcSse42;
+#elif defined(WITRA_CRC_ARMV8)
+    return crcArmv8;
+#endif
+    return crcSoftware;
+}
+
+} // namespace
+
+quint32 crc32c(const char* data, qint64 length, quint32 crc)
+{
+    static const CrcFunction implementation = pickImplementation();
+    return ~implementation(~crc, reinterpret_cast<const uchar*>(data), length);
+}
+
+} // namespace Witra
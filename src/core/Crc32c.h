@@ -0,0 +1,19 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <QByteArray>
+
+namespace Witra {
+
+// CRC32C (Castagnoli) of data, continuing from an earlier result. Uses the
+// SSE4.2 or ARMv8 CRC instructions when the CPU has them.
+quint32 crc32c(const char* data, qint64 length, quint32 crc = 0);
+
+inline quint32 crc32c(const QByteArray& data)
+{
+    return crc32c(data.constData(), data.size());
+}
+
+} // namespace Witra
+
+#endif // CRC32C_H
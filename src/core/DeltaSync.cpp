@@ -0,0 +1,277 @@
+#include "DeltaSync.h"
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QFile>
+#include <QThreadPool>
+#include <cmath>
+
+namespace Witra {
+
+namespace {
+
+constexpr qint64 DELTA_READ_SIZE = 1024 * 1024;
+
+quint32 rollChecksum(quint32 checksum, uchar out, uchar in, qint64 length)
+{
+    quint32 a = (checksum & 0xffff) - out + in;
+    quint32 b = (checksum >> 16) - static_cast<quint32>(length) * out + a;
+    return (a & 0xffff) | ((b & 0xffff) << 16);
+}
+
+// Matches [start, end) of the file; a match may run past end
+QList<DeltaOp> matchSegment(const QString& filePath, qint64 start, qint64 end,
+                            const DeltaSignature& base, const QHash<quint32, QList<int>>& table)
+{
+    QList<DeltaOp> ops;
+    QFile file(filePath);
+    if (!file.open(QIODevice::ReadOnly)) return ops;
+    
+    const qint64 fileSize = file.size();
+    const qint64 window = base.blockSize;
+    
+    qint64 pos = start;
+    qint64 literalStart = start;
+    bool fresh = true;
+    quint32 weak = 0;
+    
+    // Sliding buffer over the file; bufferStart is the offset of its first byte
+    QByteArray buffer;
+    qint64 bufferStart = start;
+    auto ensure = [&](qint64 upTo) {
+        if (upTo <= bufferStart + buffer.size()) return true;
+        
+        // Bytes before the window are never looked at again
+        if (pos > bufferStart) {
+            buffer.remove(0, static_cast<int>(pos - bufferStart));
+            bufferStart = pos;
+        }
+        file.seek(bufferStart + buffer.size());
+        buffer.append(file.read(qMax(DELTA_READ_SIZE, upTo - bufferStart - buffer.size())));
+        return upTo <= bufferStart + buffer.size();
+    };
+    auto at = [&](qint64 offset) {
+        return reinterpret_cast<const uchar*>(buffer.constData()) + (offset - bufferStart);
+    };
+    
+    auto addLiteral = [&](qint64 from, qint64 to) {
+        if (to > from) {
+            DeltaOp op;
+            op.offset = from;
+            op.length = to - from;
+            ops.append(op);
+        }
+    };
+    
+    while (pos < end && pos + window <= fileSize) {
+        if (!ensure(qMin(pos + window + 1, fileSize))) break;
+        
+        if (fresh) {
+            weak = DeltaSignature::weakChecksum(at(pos), window);
+            fresh = false;
+        }
+        
+        auto hit = table.constFind(weak);
+        if (hit != table.constEnd()) {
+            const QByteArray strong = DeltaSignature::strongChecksum(at(pos), window);
+            int match = -1;
+            for (int block : *hit) {
+                if (base.strong.at(block) == strong) {
+                    match = block;
+                    break;
+                }
+            }
+            
+            if (match >= 0) {
+                addLiteral(literalStart, pos);
+                
+                DeltaOp op;
+                op.offset = pos;
+                op.length = window;
+                op.block = match;
+                ops.append(op);
+                
+                pos += window;
+                literalStart = pos;
+                fresh = true;
+                continue;
+            }
+        }
+        
+        if (pos + window < fileSize) {
+            weak = rollChecksum(weak, *at(pos), *at(pos + window), window);
+        }
+        ++pos;
+    }
+    
+    addLiteral(literalStart, end);
+    return ops;
+}
+
+} // namespace
+
+qint64 DeltaSignature::blockLength(int index) const
+{
+    return qMin(blockSize, fileSize - index * blockSize);
+}
+
+qint64 DeltaSignature::blockSizeFor(qint64 fileSize)
+{
+    // About the square root of the file, as rsync does, in whole KiB
+    qint64 size = static_cast<qint64>(std::sqrt(static_cast<double>(fileSize)));
+    size = (size + 1023) / 1024 * 1024;
+    size = qMax(size, (fileSize + DELTA_MAX_BLOCKS - 1) / DELTA_MAX_BLOCKS);
+    return qMax(DELTA_MIN_BLOCK, size);
+}
+
+quint32 DeltaSignature::weakChecksum(const uchar* data, qint64 length)
+{
+    quint32 a = 0;
+    quint32 b = 0;
+    for (qint64 i = 0; i < length; ++i) {
+        a += data[i];
+        b += static_cast<quint32>(length - i) * data[i];
+    }
+    return (a & 0xffff) | ((b & 0xffff) << 16);
+}
+
+QByteArray DeltaSignature::strongChecksum(const uchar* data, qint64 length)
+{
+    return QCryptographicHash::hash(
+        QByteArray::fromRawData(reinterpret_cast<const char*>(data), static_cast<int>(length)),
+        QCryptographicHash::Sha256).left(DELTA_STRONG_BYTES);
+}
+
+DeltaSignature DeltaSignature::fromFile(const QString& filePath)
+{
+    DeltaSignature signature;
+    
+    QFile file(filePath);
+    if (!file.open(QIODevice::ReadOnly)) return signature;
+    
+    signature.fileSize = file.size();
+    signature.blockSize = blockSizeFor(signature.fileSize);
+    if (signature.blockSize > DELTA_MAX_BLOCK) return DeltaSignature();
+    
+    while (!file.atEnd()) {
+        const QByteArray block = file.read(signature.blockSize);
+        if (block.isEmpty()) break;
+        
+        const uchar* data = reinterpret_cast<const uchar*>(block.constData());
+        signature.weak.append(weakChecksum(data, block.size()));
+        signature.strong.append(strongChecksum(data, block.size()));
+    }
+    return signature;
+}
+
+QByteArray DeltaSignature::pack() const
+{
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    stream << blockSize << fileSize << static_cast<qint32>(weak.size());
+    for (int i = 0; i < weak.size(); ++i) {
+        stream << weak.at(i);
+        stream.writeRawData(strong.at(i).constData(), DELTA_STRONG_BYTES);
+    }
+    return data;
+}
+
+DeltaSignature DeltaSignature::unpack(const QByteArray& data)
+{
+    DeltaSignature signature;
+    QDataStream stream(data);
+    
+    qint32 count = 0;
+    stream >> signature.blockSize >> signature.fileSize >> count;
+    if (stream.status() != QDataStream::Ok || signature.blockSize < DELTA_MIN_BLOCK ||
+        signature.blockSize > DELTA_MAX_BLOCK || signature.fileSize < 0 || count < 0 || count > DELTA_MAX_BLOCKS ||
+        count != (signature.fileSize + signature.blockSize - 1) / signature.blockSize) {
+        return DeltaSignature();
+    }
+    
+    for (qint32 i = 0; i < count; ++i) {
+        quint32 weak = 0;
+        QByteArray strong(DELTA_STRONG_BYTES, '\0');
+        stream >> weak;
+        if (stream.readRawData(strong.data(), DELTA_STRONG_BYTES) != DELTA_STRONG_BYTES) {
+            return DeltaSignature();
+        }
+        signature.weak.append(weak);
+        signature.strong.append(strong);
+    }
+    return signature;
+}
+
+DeltaPlan DeltaPlan::build(const QString& filePath, const DeltaSignature& base)
+{
+    DeltaPlan plan;
+    
+    QFile file(filePath);
+    if (!file.open(QIODevice::ReadOnly) || base.isEmpty()) return plan;
+    const qint64 fileSize = file.size();
+    
+    // The short last block is never matched; its bytes go as literal data
+    QHash<quint32, QList<int>> table;
+    for (int i = 0; i < base.blockCount(); ++i) {
+        if (base.blockLength(i) == base.blockSize) {
+            table[base.weak.at(i)].append(i);
+        }
+    }
+    
+    // Segments are matched in parallel on a pool of our own, so waiting
+    // here cannot starve the global pool this runs on
+    const int segments = static_cast<int>(
+        qMax<qint64>(1, (fileSize + DELTA_SEGMENT_SIZE - 1) / DELTA_SEGMENT_SIZE));
+    QVector<QList<DeltaOp>> results(segments);
+    QThreadPool pool;
+    
+    for (int i = 0; i < segments; ++i) {
+        const qint64 start = i * DELTA_SEGMENT_SIZE;
+        const qint64 end = qMin(fileSize, start + DELTA_SEGMENT_SIZE);
+        QList<DeltaOp>* out = &results[i];
+        pool.start([out, filePath, start, end, &base, &table]() {
+            *out = matchSegment(filePath, start, end, base, table);
+        });
+    }
+    
+    // The whole-file hash is read alongside
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    pool.start([&hash, filePath]() {
+        QFile source(filePath);
+        if (!source.open(QIODevice::ReadOnly)) return;
+        while (!source.atEnd()) {
+            hash.addData(source.read(DELTA_READ_SIZE));
+        }
+    });
+    pool.waitForDone();
+    
+    // A match running past its segment overlaps the next segment's start
+    qint64 cursor = 0;
+    for (const QList<DeltaOp>& segment : results) {
+        for (DeltaOp op : segment) {
+            const qint64 opEnd = op.offset + op.length;
+            if (opEnd <= cursor) continue;
+            
+            if (op.offset < cursor) {
+                op.length = opEnd - cursor;
+                op.offset = cursor;
+                op.block = -1;
+            }
+            
+            // Literals next to each other are sent as one
+            if (!op.isBlock() && !plan.ops.isEmpty() && !plan.ops.last().isBlock()) {
+                plan.ops.last().length += op.length;
+            } else {
+                plan.ops.append(op);
+            }
+            if (!op.isBlock()) {
+                plan.literalBytes += op.length;
+            }
+            cursor = opEnd;
+        }
+    }
+    
+    plan.checksum = hash.result();
+    return plan;
+}
+
+} // namespace Witra
@@ -0,0 +1,80 @@
+#ifndef DELTASYNC_H
+#define DELTASYNC_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QString>
+#include <QVector>
+
+namespace Witra {
+
+// Changed files smaller than this are simply sent again in full
+constexpr qint64 DELTA_MIN_FILE_SIZE = 1024 * 1024;
+
+// Smallest block a signature is taken over
+constexpr qint64 DELTA_MIN_BLOCK = 2048;
+
+// Blocks grow past the square-root rule to keep signatures this short
+constexpr int DELTA_MAX_BLOCKS = 65536;
+
+// Largest block a signature may use; files that would need more go whole
+constexpr qint64 DELTA_MAX_BLOCK = 16 * 1024 * 1024;
+
+// Most of the old copy one data frame may have the receiver copy, so a
+// mostly unchanged file is rebuilt in steps rather than in one go
+constexpr qint64 DELTA_COPY_MAX = 4 * 1024 * 1024;
+
+// Bytes of the file each worker matches against the signature
+constexpr qint64 DELTA_SEGMENT_SIZE = 64 * 1024 * 1024;
+
+// Bytes of SHA-256 kept per block to confirm a rolling-checksum hit
+constexpr int DELTA_STRONG_BYTES = 16;
+
+// Block checksums of the receiver's existing copy of a file
+struct DeltaSignature {
+    qint64 blockSize = 0;
+    qint64 fileSize = 0;
+    QVector<quint32> weak;
+    QList<QByteArray> strong;
+    
+    bool isEmpty() const { return weak.isEmpty(); }
+    int blockCount() const { return weak.size(); }
+    qint64 blockLength(int index) const;
+    
+    QByteArray pack() const;
+    static DeltaSignature unpack(const QByteArray& data);
+    
+    // Reads the whole file; call off the GUI thread
+    static DeltaSignature fromFile(const QString& filePath);
+    static qint64 blockSizeFor(qint64 fileSize);
+    
+    // rsync's rolling checksum and the strong hash that confirms it
+    static quint32 weakChecksum(const uchar* data, qint64 length);
+    static QByteArray strongChecksum(const uchar* data, qint64 length);
+};
+
+// Either a block of the receiver's copy or a literal range of the new file
+struct DeltaOp {
+    qint64 offset = 0;
+    qint64 length = 0;
+    int block = -1;
+    
+    bool isBlock() const { return block >= 0; }
+};
+
+// How to rebuild a file from the receiver's copy, and the whole-file hash
+// the rebuilt file must match
+struct DeltaPlan {
+    QList<DeltaOp> ops;
+    QByteArray checksum;
+    qint64 literalBytes = 0;
+    
+    // Matches the file against the signature, one segment per worker
+    // thread; call off the GUI thread
+    static DeltaPlan build(const QString& filePath, const DeltaSignature& base);
+};
+
+} // namespace Witra
+
+#endif // DELTASYNC_H
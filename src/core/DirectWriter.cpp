@@ -0,0 +1,213 @@
+#include "DirectWriter.h"
+#include <QFile>
+#include <QMutex>
+#include <QSettings>
+#include <QVector>
+#include <cstring>
+
+#if defined(Q_OS_WIN)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace Witra {
+
+namespace {
+
+// Aligned buffers are costly to allocate and every large file needs one,
+// so they are kept and handed out again
+QMutex poolMutex;
+QVector<char*> freeBuffers;
+
+char* takeBuffer()
+{
+    {
+        QMutexLocker lock(&poolMutex);
+        if (!freeBuffers.isEmpty()) {
+            return freeBuffers.takeLast();
+        }
+    }
+    return static_cast<char*>(qMallocAligned(DIRECT_IO_BUFFER_SIZE, DIRECT_IO_ALIGNMENT));
+}
+
+void returnBuffer(char* buffer)
+{
+    QMutexLocker lock(&poolMutex);
+    if (freeBuffers.size() < DIRECT_IO_POOL_BUFFERS) {
+        freeBuffers.append(buffer);
+    } else {
+        qFreeAligned(buffer);
+    }
+}
+
+} // namespace
+
+DirectWriter::DirectWriter()
+#if defined(Q_OS_WIN)
+    : m_handle(INVALID_HANDLE_VALUE)
+#else
+    : m_fd(-1)
+#endif
+    , m_buffer(nullptr)
+    , m_buffered(0)
+    , m_written(0)
+    , m_failed(false)
+{
+}
+
+DirectWriter::~DirectWriter()
+{
+    discard();
+}
+
+bool DirectWriter::enabled()
+{
+    static const bool on = QSettings().value("transfer/directIo", false).toBool();
+    return on;
+}
+
+bool DirectWriter::open(const QString& filePath, qint64 offset)
+{
+    discard();
+    if (offset % DIRECT_IO_ALIGNMENT != 0) return false;
+    
+#if defined(Q_OS_WIN)
+    m_handle = CreateFileW(reinterpret_cast<const wchar_t*>(filePath.utf16()), GENERIC_WRITE,
+                           FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+                           OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, nullptr);
+    if (m_handle == INVALID_HANDLE_VALUE) return false;
+#elif defined(Q_OS_LINUX)
+    // tmpfs and some network filesystems refuse O_DIRECT here
+    m_fd = ::open(QFile::encodeName(filePath).constData(), O_WRONLY | O_DIRECT | O_CLOEXEC);
+    if (m_fd < 0) return false;
+#elif defined(Q_OS_MACOS)
+    m_fd = ::open(QFile::encodeName(filePath).constData(), O_WRONLY | O_CLOEXEC);
+    if (m_fd < 0) return false;
+    if (::fcntl(m_fd, F_NOCACHE, 1) != 0) {
+        release();
+        return false;
+    }
+#else
+    Q_UNUSED(filePath)
+    return false;
+#endif
+    
+    m_buffer = takeBuffer();
+    if (!m_buffer) {
+        release();
+        return false;
+    }
+    m_buffered = 0;
+    m_written = offset;
+    m_overflow.clear();
+    m_failed = false;
+    return true;
+}
+
+bool DirectWriter::isOpen() const
+{
+    return m_buffer;
+}
+
+bool DirectWriter::write(const char* data, qint64 length)
+{
+    if (m_failed) {
+        m_overflow.append(data, static_cast<int>(length));
+        return false;
+    }
+    
+    while (length > 0) {
+        const qint64 take = qMin(length, DIRECT_IO_BUFFER_SIZE - m_buffered);
+        std::memcpy(m_buffer + m_buffered, data, static_cast<size_t>(take));
+        m_buffered += take;
+        data += take;
+        length -= take;
+        
+        if (m_buffered == DIRECT_IO_BUFFER_SIZE && !flushBuffer()) {
+            m_failed = true;
+            m_overflow.append(data, static_cast<int>(length));
+            return false;
+        }
+    }
+    return true;
+}
+
+bool DirectWriter::flushBuffer()
+{
+    // Only whole blocks go out; a partial one stays at the front
+    const qint64 aligned = m_buffered - m_buffered % DIRECT_IO_ALIGNMENT;
+    if (aligned == 0) return true;
+    
+#if defined(Q_OS_WIN)
+    OVERLAPPED position = {};
+    position.Offset = static_cast<DWORD>(m_written);
+    position.OffsetHigh = static_cast<DWORD>(m_written >> 32);
+    DWORD done = 0;
+    if (!WriteFile(m_handle, m_buffer, static_cast<DWORD>(aligned), &done, &position) ||
+        done != aligned) {
+        return false;
+    }
+#else
+    qint64 done = 0;
+    while (done < aligned) {
+        const ssize_t count = ::pwrite(m_fd, m_buffer + done, static_cast<size_t>(aligned - done),
+                                       m_written + done);
+        if (count <= 0 || count % DIRECT_IO_ALIGNMENT != 0) return false;
+        done += count;
+    }
+#endif
+    
+    m_written += aligned;
+    m_buffered -= aligned;
+    std::memmove(m_buffer, m_buffer + aligned, static_cast<size_t>(m_buffered));
+    return true;
+}
+
+QByteArray DirectWriter::close(qint64* tailOffset)
+{
+    if (!m_failed && m_buffer) {
+        flushBuffer();
+    }
+    
+    *tailOffset = m_written;
+    QByteArray tail;
+    if (m_buffer) {
+        tail = QByteArray(m_buffer, static_cast<int>(m_buffered));
+    }
+    tail.append(m_overflow);
+    
+    release();
+    return tail;
+}
+
+void DirectWriter::discard()
+{
+    release();
+}
+
+void DirectWriter::release()
+{
+#if defined(Q_OS_WIN)
+    if (m_handle != INVALID_HANDLE_VALUE) {
+        CloseHandle(m_handle);
+        m_handle = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (m_fd >= 0) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+#endif
+    
+    if (m_buffer) {
+        returnBuffer(m_buffer);
+        m_buffer = nullptr;
+    }
+    m_buffered = 0;
+    m_overflow.clear();
+    m_failed = false;
+}
+
+} // namespace Witra
@@ -0,0 +1,72 @@
+#ifndef DIRECTWRITER_H
+#define DIRECTWRITER_H
+
+#include <QByteArray>
+#include <QString>
+
+namespace Witra {
+
+// Files at least this large may be written with direct I/O
+constexpr qint64 DIRECT_IO_MIN_FILE_SIZE = 64 * 1024 * 1024;
+
+// Offsets and lengths of direct writes are multiples of this
+constexpr qint64 DIRECT_IO_ALIGNMENT = 4096;
+
+// Bytes gathered before each direct write
+constexpr qint64 DIRECT_IO_BUFFER_SIZE = 1024 * 1024;
+
+// Aligned buffers kept for reuse once their writer is done
+constexpr int DIRECT_IO_POOL_BUFFERS = 8;
+
+// Writes a file sequentially around the page cache: O_DIRECT on Linux,
+// FILE_FLAG_NO_BUFFERING on Windows, F_NOCACHE on macOS. Data is gathered
+// into an aligned buffer from a shared pool and written a full buffer at a
+// time; whatever does not fill a block is handed back by close() for the
+// caller to write through its ordinary buffered handle.
+//
+// A filesystem that refuses direct I/O fails open() or the first write(),
+// and the caller carries on buffered. Nothing is ever lost: close() always
+// returns every byte not yet written.
+class DirectWriter {
+public:
+    DirectWriter();
+    ~DirectWriter();
+    
+    // Whether direct I/O is wanted; the transfer/directIo setting, off by default
+    static bool enabled();
+    
+    // offset is where writing starts, and must be aligned
+    bool open(const QString& filePath, qint64 offset = 0);
+    bool isOpen() const;
+    
+    // False once direct writes are refused; close() then returns the data
+    bool write(const char* data, qint64 length);
+    bool write(const QByteArray& data) { return write(data.constData(), data.size()); }
+    
+    // Bytes known to be on disk, and bytes handed in
+    qint64 written() const { return m_written; }
+    qint64 position() const { return m_written + m_buffered + m_overflow.size(); }
+    
+    // Stops direct writing; returns the bytes still to write and where
+    QByteArray close(qint64* tailOffset);
+    void discard();
+    
+private:
+    bool flushBuffer();
+    void release();
+    
+#if defined(Q_OS_WIN)
+    void* m_handle;
+#else
+    int m_fd;
+#endif
+    char* m_buffer;
+    qint64 m_buffered;
+    qint64 m_written;
+    QByteArray m_overflow; // data a refused write left uncopied
+    bool m_failed;
+};
+
+} // namespace Witra
+
+#endif // DIRECTWRITER_H
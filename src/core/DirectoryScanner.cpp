@@ -0,0 +1,187 @@
+#include "DirectoryScanner.h"
+#include <QDateTime>
+#include <QDir>
+#include <QFileInfo>
+#include <QPointer>
+#include <QThreadPool>
+
+namespace Witra {
+
+DirectoryScanner::DirectoryScanner(const QString& rootPath, QObject* parent)
+    : QObject(parent)
+    , m_rootPath(rootPath)
+    , m_nextId(0)
+    , m_running(0)
+    , m_buffered(0)
+    , m_filesFound(0)
+    , m_bytesFound(0)
+    , m_finished(false)
+    , m_cancelled(std::make_shared<std::atomic<bool>>(false))
+{
+}
+
+DirectoryScanner::~DirectoryScanner()
+{
+    // Listings still running on the pool are thrown away when they finish
+    m_cancelled->store(true);
+    qDeleteAll(m_nodes);
+}
+
+void DirectoryScanner::start()
+{
+    if (!m_nodes.isEmpty() || m_finished) return;
+    
+    quint64 root = addNode(m_rootPath, QDir(m_rootPath).dirName());
+    m_pending.append(root);
+    m_walk.append(root);
+    dispatch();
+}
+
+ScanEntry DirectoryScanner::take()
+{
+    if (m_ready.isEmpty()) return ScanEntry();
+    
+    ScanEntry entry = m_ready.dequeue();
+    if (m_buffered-- == SCAN_MAX_BUFFERED) {
+        dispatch();
+    }
+    return entry;
+}
+
+quint64 DirectoryScanner::addNode(const QString& path, const QString& relativePath)
+{
+    Node* node = new Node;
+    node->path = path;
+    node->relativePath = relativePath;
+    
+    quint64 id = m_nextId++;
+    m_nodes.insert(id, node);
+    return id;
+}
+
+void DirectoryScanner::dispatch()
+{
+    // Over the buffer limit only the directory output is waiting on may be
+    // listed, so the consumer can always make progress
+    if (m_buffered >= SCAN_MAX_BUFFERED) {
+        if (m_walk.isEmpty() || !m_pending.removeOne(m_walk.last())) return;
+        list(m_walk.last());
+        return;
+    }
+    
+    while (m_running < SCAN_MAX_JOBS && !m_pending.isEmpty()) {
+        list(m_pending.takeLast());
+    }
+}
+
+void DirectoryScanner::list(quint64 id)
+{
+    ++m_running;
+    
+    const QString path = m_nodes.value(id)->path;
+    const QString relativePath = m_nodes.value(id)->relativePath;
+    std::shared_ptr<std::atomic<bool>> cancelled = m_cancelled;
+    QPointer<DirectoryScanner> self(this);
+    
+    QThreadPool::globalInstance()->start([self, cancelled, id, path, relativePath]() {
+        if (cancelled->load()) return;
+        
+        // Symlinked directories are not followed, so the walk cannot loop
+        QList<ScanEntry> files;
+        QStringList dirs;
+        const QFileInfoList infos = QDir(path).entryInfoList(
+            QDir::Files | QDir::Dirs | QDir::NoDotAndDotDot, QDir::Name);
+        
+        for (const QFileInfo& info : infos) {
+            if (info.isDir()) {
+                if (!info.isSymLink()) dirs.append(info.fileName());
+                continue;
+            }
+            
+            ScanEntry entry;
+            entry.path = info.filePath();
+            entry.relativePath = relativePath + "/" + info.fileName();
+            entry.size = info.size();
+            entry.modified = info.lastModified().toMSecsSinceEpoch();
+            files.append(entry);
+        }
+        
+        if (cancelled->load() || !self) return;
+        QMetaObject::invokeMethod(self.data(), [self, id, files, dirs]() {
+            if (self) self->onListed(id, files, dirs);
+        }, Qt::QueuedConnection);
+    });
+}
+
+void DirectoryScanner::onListed(quint64 id, const QList<ScanEntry>& files, const QStringList& dirs)
+{
+    --m_running;
+    
+    Node* node = m_nodes.value(id, nullptr);
+    if (!node) return;
+    
+    node->listed = true;
+    node->files = files;
+    m_buffered += files.size();
+    
+    for (const ScanEntry& entry : files) {
+        ++m_filesFound;
+        m_bytesFound += entry.size;
+    }
+    
+    for (const QString& dir : dirs) {
+        node->children.append(addNode(node->path + "/" + dir, node->relativePath + "/" + dir));
+    }
+    
+    // Listed last-first so the walk order is also roughly the listing order
+    for (int i = node->children.size() - 1; i >= 0; --i) {
+        m_pending.append(node->children.at(i));
+    }
+    
+    emit progress(m_filesFound, m_bytesFound);
+    
+    drain();
+    dispatch();
+}
+
+void DirectoryScanner::drain()
+{
+    const int before = m_ready.size();
+    
+    // Output follows the depth-first order and stops at the first directory
+    // that has not been listed yet, whatever was listed after it
+    while (!m_walk.isEmpty()) {
+        const quint64 id = m_walk.last();
+        Node* node = m_nodes.value(id);
+        if (!node->listed) break;
+        
+        if (!node->emitted) {
+            for (const ScanEntry& entry : node->files) {
+                m_ready.enqueue(entry);
+            }
+            node->files.clear();
+            node->emitted = true;
+        }
+        
+        if (node->nextChild < node->children.size()) {
+            m_walk.append(node->children.at(node->nextChild++));
+            continue;
+        }
+        
+        m_walk.removeLast();
+        delete m_nodes.take(id);
+    }
+    
+    if (m_walk.isEmpty()) {
+        m_finished = true;
+    }
+    
+    if (m_ready.size() != before) {
+        emit entriesAvailable();
+    }
+    if (m_finished) {
+        emit finished(m_filesFound, m_bytesFound);
+    }
+}
+
+} // namespace Witra
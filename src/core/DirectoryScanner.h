@@ -0,0 +1,89 @@
+#ifndef DIRECTORYSCANNER_H
+#define DIRECTORYSCANNER_H
+
+#include <QObject>
+#include <QHash>
+#include <QList>
+#include <QQueue>
+#include <atomic>
+#include <memory>
+
+namespace Witra {
+
+// Directories listed at the same time on the thread pool
+constexpr int SCAN_MAX_JOBS = 8;
+
+// Listed files held ahead of the consumer before listing pauses
+constexpr int SCAN_MAX_BUFFERED = 64 * 1024;
+
+// One regular file found under the scanned folder
+struct ScanEntry {
+    QString path;
+    QString relativePath; // starts with the scanned folder's own name
+    qint64 size = 0;
+    qint64 modified = 0;  // msecs since epoch
+    QByteArray hash;      // content hash, when already known
+};
+
+// Walks a folder tree on the thread pool, several directories at a time,
+// and hands its files out in a stable depth-first, name-sorted order as
+// soon as they are known. Totals grow as the walk goes on, so a send can
+// start before the tree has been seen in full.
+class DirectoryScanner : public QObject {
+    Q_OBJECT
+    
+public:
+    explicit DirectoryScanner(const QString& rootPath, QObject* parent = nullptr);
+    ~DirectoryScanner();
+    
+    void start();
+    
+    QString rootPath() const { return m_rootPath; }
+    bool isFinished() const { return m_finished; }
+    qint64 filesFound() const { return m_filesFound; }
+    qint64 bytesFound() const { return m_bytesFound; }
+    
+    // Files ready to be taken, in walk order
+    int available() const { return m_ready.size(); }
+    bool atEnd() const { return m_finished && m_ready.isEmpty(); }
+    ScanEntry take();
+    
+signals:
+    void entriesAvailable();
+    void progress(qint64 files, qint64 bytes);
+    void finished(qint64 files, qint64 bytes);
+    
+private:
+    struct Node {
+        QString path;
+        QString relativePath;
+        bool listed = false;
+        bool emitted = false;
+        QList<ScanEntry> files;
+        QList<quint64> children;
+        int nextChild = 0;
+    };
+    
+    quint64 addNode(const QString& path, const QString& relativePath);
+    void dispatch();
+    void list(quint64 id);
+    void onListed(quint64 id, const QList<ScanEntry>& files, const QStringList& dirs);
+    void drain();
+    
+    QString m_rootPath;
+    QHash<quint64, Node*> m_nodes;
+    quint64 m_nextId;
+    QList<quint64> m_pending; // unlisted directories, next one last
+    QList<quint64> m_walk;    // path from the root to where output stands
+    QQueue<ScanEntry> m_ready;
+    int m_running;
+    qint64 m_buffered;
+    qint64 m_filesFound;
+    qint64 m_bytesFound;
+    bool m_finished;
+    std::shared_ptr<std::atomic<bool>> m_cancelled;
+};
+
+} // namespace Witra
+
+#endif // DIRECTORYSCANNER_H
@@ -0,0 +1,271 @@
+#include "HashCache.h"
+#include "ContentIndex.h"
+#include "DirectoryScanner.h"
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QThreadPool>
+
+#if defined(Q_OS_WIN)
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#endif
+
+namespace Witra {
+
+namespace {
+
+constexpr int KEY_SIZE = 32;
+constexpr int HASH_SIZE = 32;
+constexpr int RECORD_SIZE = KEY_SIZE + HASH_SIZE;
+
+} // namespace
+
+HashCache::HashCache(QObject* parent)
+    : QObject(parent)
+    , m_records(0)
+    , m_flushTimer(new QTimer(this))
+    , m_idleTimer(new QTimer(this))
+    , m_hashing(false)
+{
+    QString dataPath = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
+    QDir().mkpath(dataPath);
+    m_path = QDir(dataPath).filePath("hashes.bin");
+    
+    m_flushTimer->setSingleShot(true);
+    m_flushTimer->setInterval(HASH_CACHE_FLUSH_INTERVAL);
+    connect(m_flushTimer, &QTimer::timeout, this, &HashCache::flush);
+    
+    m_idleTimer->setSingleShot(true);
+    m_idleTimer->setInterval(HASH_IDLE_DELAY);
+    connect(m_idleTimer, &QTimer::timeout, this, &HashCache::refresh);
+}
+
+HashCache::~HashCache()
+{
+    flush();
+}
+
+void HashCache::load()
+{
+    QFile file(m_path);
+    if (!file.open(QIODevice::ReadOnly)) return;
+    
+    const QByteArray data = file.readAll();
+    m_records = data.size() / RECORD_SIZE;
+    
+    // Later records win; reading backwards keeps the newest within the cap
+    for (qint64 i = m_records - 1; i >= 0 && m_entries.size() < HASH_CACHE_MAX_ENTRIES; --i) {
+        const QByteArray key = data.mid(static_cast<int>(i * RECORD_SIZE), KEY_SIZE);
+        if (!m_entries.contains(key)) {
+            m_entries.insert(key, data.mid(static_cast<int>(i * RECORD_SIZE + KEY_SIZE), HASH_SIZE));
+            m_order.prepend(key);
+        }
+    }
+    
+    // A torn last record or mostly superseded ones are rewritten away
+    if (data.size() % RECORD_SIZE != 0 || m_records > 2 * m_entries.size() + 1024) {
+        compact();
+    }
+}
+
+void HashCache::compact()
+{
+    QSaveFile file(m_path);
+    if (!file.open(QIODevice::WriteOnly)) return;
+    
+    // Oldest first, so the next load keeps the same ones under the cap
+    for (const QByteArray& key : m_order) {
+        file.write(key);
+        file.write(m_entries.value(key));
+    }
+    if (file.commit()) {
+        m_records = m_entries.size();
+        m_pending.clear();
+    }
+}
+
+void HashCache::flush()
+{
+    m_flushTimer->stop();
+    if (m_pending.isEmpty()) return;
+    
+    QFile file(m_path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Append)) return;
+    file.write(m_pending);
+    m_records += m_pending.size() / RECORD_SIZE;
+    m_pending.clear();
+}
+
+QByteArray HashCache::cached(const QString& filePath) const
+{
+    const QByteArray key = keyOf(filePath);
+    return key.isEmpty() ? QByteArray() : m_entries.value(key);
+}
+
+void HashCache::insert(const QByteArray& key, const QByteArray& hash)
+{
+    if (key.size() != KEY_SIZE || hash.size() != HASH_SIZE) return;
+    if (m_entries.value(key) == hash) return;
+    
+    if (!m_entries.contains(key)) {
+        m_order.enqueue(key);
+    }
+    m_entries.insert(key, hash);
+    m_pending.append(key);
+    m_pending.append(hash);
+    
+    // The oldest are forgotten here too, not only when the log is loaded
+    while (m_entries.size() > HASH_CACHE_MAX_ENTRIES) {
+        m_entries.remove(m_order.dequeue());
+    }
+    
+    if (!m_flushTimer->isActive()) {
+        m_flushTimer->start();
+    }
+}
+
+void HashCache::insert(const QString& filePath, const QByteArray& hash)
+{
+    insert(keyOf(filePath), hash);
+}
+
+void HashCache::noteActivity()
+{
+    // The hash already running finishes; the walk starts over next time
+    if (m_scanner) {
+        m_scanner->deleteLater();
+        m_scanner = nullptr;
+    }
+    if (!m_refreshPath.isEmpty()) {
+        m_idleTimer->start();
+    }
+}
+
+void HashCache::setRefreshPath(const QString& path)
+{
+    m_refreshPath = path;
+    noteActivity();
+}
+
+void HashCache::refresh()
+{
+    if (m_refreshPath.isEmpty() || m_scanner) return;
+    
+    m_scanner = new DirectoryScanner(m_refreshPath, this);
+    connect(m_scanner, &DirectoryScanner::entriesAvailable, this, &HashCache::hashNext);
+    connect(m_scanner, &DirectoryScanner::finished, this, &HashCache::hashNext);
+    m_scanner->start();
+}
+
+void HashCache::hashNext()
+{
+    if (m_hashing || !m_scanner) return;
+    
+    while (m_scanner->available() > 0) {
+        const ScanEntry entry = m_scanner->take();
+        if (entry.size < DEDUPE_MIN_SIZE) continue;
+        
+        const QByteArray known = cached(entry.path);
+        if (!known.isEmpty()) {
+            emit fileHashed(entry.path, known);
+            continue;
+        }
+        
+        // One file at a time, so an idle refresh never competes for the disk
+        m_hashing = true;
+        const QString filePath = entry.path;
+        QPointer<HashCache> self(this);
+        
+        QThreadPool::globalInstance()->start([self, filePath]() {
+            QByteArray key;
+            const QByteArray hash = hashFile(filePath, &key);
+            if (!self) return;
+            QMetaObject::invokeMethod(self.data(), [self, filePath, key, hash]() {
+                if (!self) return;
+                self->m_hashing = false;
+                if (!key.isEmpty() && !hash.isEmpty()) {
+                    self->insert(key, hash);
+                    emit self->fileHashed(filePath, hash);
+                }
+                self->hashNext();
+            }, Qt::QueuedConnection);
+        });
+        return;
+    }
+    
+    if (m_scanner->atEnd()) {
+        m_scanner->deleteLater();
+        m_scanner = nullptr;
+    }
+}
+
+QByteArray HashCache::keyOf(const QString& filePath)
+{
+    quint64 device = 0;
+    quint64 inode = 0;
+    qint64 size = 0;
+    qint64 modified = 0;
+    
+#if defined(Q_OS_WIN)
+    HANDLE handle = CreateFileW(reinterpret_cast<const wchar_t*>(filePath.utf16()), 0,
+                                FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (handle == INVALID_HANDLE_VALUE) return QByteArray();
+    
+    BY_HANDLE_FILE_INFORMATION info;
+    const bool ok = GetFileInformationByHandle(handle, &info) &&
+                    !(info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY);
+    CloseHandle(handle);
+    if (!ok) return QByteArray();
+    
+    device = info.dwVolumeSerialNumber;
+    inode = (static_cast<quint64>(info.nFileIndexHigh) << 32) | info.nFileIndexLow;
+    size = (static_cast<qint64>(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+    modified = (static_cast<qint64>(info.ftLastWriteTime.dwHighDateTime) << 32) |
+               info.ftLastWriteTime.dwLowDateTime;
+#else
+    struct stat info;
+    if (::stat(QFile::encodeName(filePath).constData(), &info) != 0 || !S_ISREG(info.st_mode)) {
+        return QByteArray();
+    }
+    
+    device = static_cast<quint64>(info.st_dev);
+    inode = static_cast<quint64>(info.st_ino);
+    size = static_cast<qint64>(info.st_size);
+#if defined(Q_OS_MACOS)
+    modified = static_cast<qint64>(info.st_mtimespec.tv_sec) * 1000000000 + info.st_mtimespec.tv_nsec;
+#else
+    modified = static_cast<qint64>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+#endif
+    
+    QByteArray key;
+    QDataStream stream(&key, QIODevice::WriteOnly);
+    stream << device << inode << size << modified;
+    return key;
+}
+
+QByteArray HashCache::hashFile(const QString& filePath, QByteArray* key)
+{
+    const QByteArray before = keyOf(filePath);
+    
+    QFile file(filePath);
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    if (before.isEmpty() || !file.open(QIODevice::ReadOnly) || !hash.addData(&file)) {
+        if (key) key->clear();
+        return QByteArray();
+    }
+    
+    // A file written to while it was read has no trustworthy hash to keep
+    if (key) {
+        *key = keyOf(filePath) == before ? before : QByteArray();
+    }
+    return hash.result();
+}
+
+} // namespace Witra
@@ -0,0 +1,83 @@
+#ifndef HASHCACHE_H
+#define HASHCACHE_H
+
+#include <QObject>
+#include <QHash>
+#include <QPointer>
+#include <QQueue>
+#include <QTimer>
+
+namespace Witra {
+
+class DirectoryScanner;
+
+// Most files the cache remembers; the oldest are forgotten past this
+constexpr int HASH_CACHE_MAX_ENTRIES = 1024 * 1024;
+
+// Delay before new cache entries are appended to disk (ms)
+constexpr int HASH_CACHE_FLUSH_INTERVAL = 5000;
+
+// Quiet time after the last transfer activity before the download folder
+// is hashed in the background (ms)
+constexpr int HASH_IDLE_DELAY = 60000;
+
+// Content hashes of files, keyed by device, inode, size and mtime, so a
+// file that has not changed is never read again to hash it. Entries are
+// appended to a compact binary log and compacted when loaded. While no
+// transfer is running, files in the download folder not yet known are
+// hashed one at a time in the background.
+//
+// Lookups stat the file and read nothing; hashing itself is done by
+// hashFile() on a worker thread, and the result handed back to insert().
+class HashCache : public QObject {
+    Q_OBJECT
+    
+public:
+    explicit HashCache(QObject* parent = nullptr);
+    ~HashCache();
+    
+    void load();
+    
+    // Hash of the file as it is now, or empty when not known
+    QByteArray cached(const QString& filePath) const;
+    
+    void insert(const QByteArray& key, const QByteArray& hash);
+    void insert(const QString& filePath, const QByteArray& hash);
+    
+    // Transfers pause the background refresh and push it back
+    void noteActivity();
+    void setRefreshPath(const QString& path);
+    
+    // Identity of the file as it is now, or empty when it is not a file
+    static QByteArray keyOf(const QString& filePath);
+    
+    // Reads the whole file; call off the GUI thread. key receives the
+    // file's identity, or empty when it changed while being read.
+    static QByteArray hashFile(const QString& filePath, QByteArray* key = nullptr);
+    
+signals:
+    // A download folder file hashed, or found cached, by the refresh
+    void fileHashed(const QString& filePath, const QByteArray& hash);
+    
+private:
+    void flush();
+    void compact();
+    void refresh();
+    void hashNext();
+    
+    QString m_path;
+    QHash<QByteArray, QByteArray> m_entries; // key -> SHA-256
+    QQueue<QByteArray> m_order; // keys, oldest first
+    QByteArray m_pending; // records not yet appended
+    qint64 m_records;     // records in the file, live or not
+    QTimer* m_flushTimer;
+    
+    QString m_refreshPath;
+    QTimer* m_idleTimer;
+    QPointer<DirectoryScanner> m_scanner;
+    bool m_hashing;
+};
+
+} // namespace Witra
+
+#endif // HASHCACHE_H
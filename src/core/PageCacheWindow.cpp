@@ -0,0 +1,129 @@
+#include "PageCacheWindow.h"
+#include <QFile>
+#include <QMutex>
+#include <QPair>
+#include <QQueue>
+#include <QSettings>
+#include <QThreadPool>
+
+#if defined(Q_OS_LINUX) || defined(Q_OS_MACOS)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace Witra {
+
+// Windows waiting to be flushed out and dropped, one pool task at a time.
+// The descriptor is a duplicate, so the file may close while it runs.
+struct PageCacheWindow::Writeback {
+    QMutex mutex;
+    QQueue<QPair<qint64, qint64>> ranges; // offset, length
+    bool running = false;
+    int fd = -1;
+    
+    ~Writeback()
+    {
+#if defined(Q_OS_LINUX)
+        if (fd >= 0) ::close(fd);
+#endif
+    }
+};
+
+PageCacheWindow::PageCacheWindow()
+    : m_file(nullptr)
+    , m_mode(Mode::Read)
+    , m_windowStart(0)
+    , m_previousStart(0)
+    , m_previousEnd(0)
+{
+}
+
+bool PageCacheWindow::enabled()
+{
+    static const bool on = QSettings().value("transfer/streamingIo", true).toBool();
+    return on;
+}
+
+void PageCacheWindow::attach(QFile* file, Mode mode)
+{
+    m_file = file;
+    m_mode = mode;
+    m_windowStart = file->pos();
+    m_previousStart = m_previousEnd = m_windowStart;
+    m_writeback.reset();
+    
+#if defined(Q_OS_LINUX)
+    if (mode == Mode::Read) {
+        ::posix_fadvise(file->handle(), 0, 0, POSIX_FADV_SEQUENTIAL);
+    } else {
+        m_writeback = std::make_shared<Writeback>();
+        m_writeback->fd = ::dup(file->handle());
+    }
+#elif defined(Q_OS_MACOS)
+    // No per-range advice here; data simply bypasses the cache
+    ::fcntl(file->handle(), F_NOCACHE, 1);
+#endif
+}
+
+void PageCacheWindow::detach()
+{
+    // A task still waiting on a window finishes on its own copy
+    m_file = nullptr;
+    m_writeback.reset();
+}
+
+void PageCacheWindow::advance(qint64 position)
+{
+    if (!m_file) return;
+    
+    // A seek back, for a resume or a repair, starts the window over
+    if (position < m_windowStart) {
+        m_windowStart = m_previousStart = m_previousEnd = position;
+        return;
+    }
+    if (position - m_windowStart < PAGE_CACHE_WINDOW) return;
+    
+#if defined(Q_OS_LINUX)
+    const int fd = m_file->handle();
+    if (m_mode == Mode::Read) {
+        ::posix_fadvise(fd, m_windowStart, position - m_windowStart, POSIX_FADV_DONTNEED);
+    } else {
+        // Only starts writeback; whatever our own write buffer still holds
+        // goes out with the next window
+        ::sync_file_range(fd, m_windowStart, position - m_windowStart, SYNC_FILE_RANGE_WRITE);
+        
+        // The window before has had a whole window's time to reach the disk
+        if (m_previousEnd > m_previousStart && m_writeback && m_writeback->fd >= 0) {
+            QMutexLocker lock(&m_writeback->mutex);
+            m_writeback->ranges.enqueue(qMakePair(m_previousStart, m_previousEnd - m_previousStart));
+            if (!m_writeback->running) {
+                m_writeback->running = true;
+                std::shared_ptr<Writeback> writeback = m_writeback;
+                QThreadPool::globalInstance()->start([writeback]() {
+                    for (;;) {
+                        QPair<qint64, qint64> range;
+                        {
+                            QMutexLocker lock(&writeback->mutex);
+                            if (writeback->ranges.isEmpty()) {
+                                writeback->running = false;
+                                return;
+                            }
+                            range = writeback->ranges.dequeue();
+                        }
+                        ::sync_file_range(writeback->fd, range.first, range.second,
+                                          SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                                          SYNC_FILE_RANGE_WAIT_AFTER);
+                        ::posix_fadvise(writeback->fd, range.first, range.second, POSIX_FADV_DONTNEED);
+                    }
+                });
+            }
+        }
+        m_previousStart = m_windowStart;
+        m_previousEnd = position;
+    }
+#endif
+    
+    m_windowStart = position;
+}
+
+} // namespace Witra
@@ -0,0 +1,57 @@
+#ifndef PAGECACHEWINDOW_H
+#define PAGECACHEWINDOW_H
+
+#include <QtGlobal>
+#include <memory>
+
+class QFile;
+
+namespace Witra {
+
+// Files at least this large are streamed without filling the page cache
+constexpr qint64 PAGE_CACHE_MIN_FILE_SIZE = 256 * 1024 * 1024;
+
+// Bytes read or written between cache trims
+constexpr qint64 PAGE_CACHE_WINDOW = 8 * 1024 * 1024;
+
+// Keeps a long sequential read or write from filling the page cache and
+// pushing out everyone else's working set. Reads declare sequential access
+// and drop each window once consumed. Writes start writeback as each window
+// fills, wait for the one before, and drop it once it is on disk, so only
+// a few windows are ever dirty or cached. The waiting is done on the
+// thread pool, on a descriptor of its own, never on the caller's thread.
+//
+// Does nothing where the platform offers no such advice.
+class PageCacheWindow {
+public:
+    enum class Mode {
+        Read,
+        Write
+    };
+    
+    PageCacheWindow();
+    
+    // Whether the streaming I/O mode is on; the transfer/streamingIo setting
+    static bool enabled();
+    
+    void attach(QFile* file, Mode mode);
+    void detach();
+    bool isAttached() const { return m_file; }
+    
+    // Called with the file position after each read or write
+    void advance(qint64 position);
+    
+private:
+    struct Writeback;
+    
+    QFile* m_file;
+    Mode m_mode;
+    qint64 m_windowStart;
+    qint64 m_previousStart; // window being written back, Write only
+    qint64 m_previousEnd;
+    std::shared_ptr<Writeback> m_writeback; // Write only
+};
+
+} // namespace Witra
+
+#endif // PAGECACHEWINDOW_H
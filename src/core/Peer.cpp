@@ -7,6 +7,7 @@ Peer::Peer(QObject* parent)
     , m_port(0)
     , m_state(ConnectionState::Discovered)
     , m_lastSeen(QDateTime::currentDateTime())
+    , m_expectedRate(0)
 {
 }
 
@@ -19,6 +20,7 @@ Peer::Peer(const QString& id, const QString& displayName, const QHostAddress& ad
     , m_port(port)
     , m_state(ConnectionState::Discovered)
     , m_lastSeen(QDateTime::currentDateTime())
+    , m_expectedRate(0)
 {
 }
 
@@ -30,6 +32,14 @@ void Peer::setState(ConnectionState state)
     }
 }
 
+void Peer::setExpectedRate(qint64 rate)
+{
+    if (m_expectedRate != rate) {
+        m_expectedRate = rate;
+        emit expectedRateChanged();
+    }
+}
+
 void Peer::updateLastSeen()
 {
     m_lastSeen = QDateTime::currentDateTime();
@@ -33,6 +33,7 @@ public:
     quint16 port() const { return m_port; }
     ConnectionState state() const { return m_state; }
     QDateTime lastSeen() const { return m_lastSeen; }
+    qint64 expectedRate() const { return m_expectedRate; } // bytes per second sending to it, 0 unknown
     
     // Setters
     void setDisplayName(const QString& name) { m_displayName = name; }
@@ -41,6 +42,7 @@ public:
     void setPort(quint16 port) { m_port = port; }
     void setState(ConnectionState state);
     void updateLastSeen();
+    void setExpectedRate(qint64 rate);
     
     // State helpers
     bool isConnected() const { return m_state == ConnectionState::Connected; }
@@ -51,6 +53,7 @@ public:
     
 signals:
     void stateChanged(ConnectionState newState);
+    void expectedRateChanged();
     
 private:
     QString m_id;
@@ -60,6 +63,7 @@ private:
     quint16 m_port;
     ConnectionState m_state;
     QDateTime m_lastSeen;
+    qint64 m_expectedRate;
 };
 
 } // namespace Witra
@@ -7,11 +7,17 @@ PeerManager::PeerManager(QObject* parent)
     : QObject(parent)
     , m_discovery(new NetworkDiscovery(this))
     , m_cleanupTimer(new QTimer(this))
-    , m_peerId(generateUniqueId())
     , m_running(false)
 {
-    // Load or generate display name
+    // Peer identity survives restarts so resumed transfers can find their peer
     QSettings settings;
+    m_peerId = settings.value("user/peerId").toString();
+    if (m_peerId.isEmpty()) {
+        m_peerId = generateUniqueId();
+        settings.setValue("user/peerId", m_peerId);
+    }
+    
+    // Load or generate display name
     m_displayName = settings.value("user/displayName", 
                                    QSysInfo::machineHostName()).toString();
     
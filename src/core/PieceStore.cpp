@@ -0,0 +1,291 @@
+#include "PieceStore.h"
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+namespace Witra {
+
+qint64 PieceManifest::pieceLength(int index) const
+{
+    return qMin(pieceSize, fileSize - pieceOffset(index));
+}
+
+bool PieceManifest::isValid() const
+{
+    // Every swarm uses the one piece size, so no piece is larger than it
+    if (contentId.isEmpty() || pieceSize != SWARM_PIECE_SIZE || fileSize < 0) return false;
+    if (hashes.size() != (fileSize + pieceSize - 1) / pieceSize) return false;
+    
+    // The content id must match the hashes it names
+    QCryptographicHash content(QCryptographicHash::Sha256);
+    for (const QByteArray& hash : hashes) {
+        content.addData(hash);
+    }
+    return contentId == QString::fromLatin1(content.result().toHex());
+}
+
+QJsonObject PieceManifest::toJson() const
+{
+    QJsonArray pieceHashes;
+    for (const QByteArray& hash : hashes) {
+        pieceHashes.append(QString::fromLatin1(hash.toHex()));
+    }
+    
+    QJsonObject obj;
+    obj["contentId"] = contentId;
+    obj["fileName"] = fileName;
+    obj["fileSize"] = fileSize;
+    obj["pieceSize"] = pieceSize;
+    obj["hashes"] = pieceHashes;
+    if (!swarm.isEmpty()) {
+        obj["swarm"] = QJsonArray::fromStringList(swarm);
+    }
+    return obj;
+}
+
+PieceManifest PieceManifest::fromJson(const QJsonObject& obj)
+{
+    PieceManifest manifest;
+    manifest.contentId = obj["contentId"].toString();
+    manifest.fileName = QFileInfo(obj["fileName"].toString()).fileName();
+    manifest.fileSize = obj["fileSize"].toVariant().toLongLong();
+    manifest.pieceSize = obj["pieceSize"].toVariant().toLongLong();
+    for (const QJsonValue& value : obj["hashes"].toArray()) {
+        manifest.hashes.append(QByteArray::fromHex(value.toString().toLatin1()));
+    }
+    for (const QJsonValue& value : obj["swarm"].toArray()) {
+        manifest.swarm.append(value.toString());
+    }
+    return manifest;
+}
+
+PieceManifest PieceManifest::fromFile(const QString& filePath, qint64 pieceSize)
+{
+    PieceManifest manifest;
+    manifest.pieceSize = pieceSize;
+    
+    QFile file(filePath);
+    if (!file.open(QIODevice::ReadOnly)) return manifest;
+    
+    manifest.fileName = QFileInfo(filePath).fileName();
+    manifest.fileSize = file.size();
+    
+    QCryptographicHash content(QCryptographicHash::Sha256);
+    while (!file.atEnd()) {
+        QByteArray hash = hashPiece(file.read(pieceSize));
+        manifest.hashes.append(hash);
+        content.addData(hash);
+    }
+    
+    manifest.contentId = QString::fromLatin1(content.result().toHex());
+    return manifest;
+}
+
+QByteArray PieceManifest::hashPiece(const QByteArray& data)
+{
+    return QCryptographicHash::hash(data, QCryptographicHash::Sha256);
+}
+
+PieceStore::PieceStore(QObject* parent)
+    : QObject(parent)
+{
+    QString dataPath = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
+    QDir().mkpath(dataPath);
+    m_path = QDir(dataPath).filePath("pieces.json");
+}
+
+void PieceStore::load()
+{
+    QFile file(m_path);
+    if (!file.open(QIODevice::ReadOnly)) return;
+    
+    const QJsonArray entries = QJsonDocument::fromJson(file.readAll()).array();
+    bool dropped = false;
+    
+    for (const QJsonValue& value : entries) {
+        const QJsonObject obj = value.toObject();
+        
+        Entry entry;
+        entry.manifest = PieceManifest::fromJson(obj["manifest"].toObject());
+        entry.localPath = obj["localPath"].toString();
+        entry.modified = obj["modified"].toVariant().toLongLong();
+        
+        // A file edited or moved since it was hashed no longer matches its pieces
+        if (!entry.manifest.isValid() || QFileInfo(entry.localPath).size() != entry.manifest.fileSize ||
+            modifiedTime(entry.localPath) != entry.modified) {
+            dropped = true;
+            continue;
+        }
+        
+        entry.have = QBitArray(entry.manifest.pieceCount(), true);
+        m_entries.insert(entry.manifest.contentId, entry);
+    }
+    
+    if (dropped) {
+        save();
+    }
+}
+
+void PieceStore::save() const
+{
+    QJsonArray entries;
+    for (const Entry& entry : m_entries) {
+        if (entry.modified == 0) continue;
+        
+        QJsonObject obj;
+        obj["manifest"] = entry.manifest.toJson();
+        obj["localPath"] = entry.localPath;
+        obj["modified"] = entry.modified;
+        entries.append(obj);
+    }
+    
+    QSaveFile file(m_path);
+    if (!file.open(QIODevice::WriteOnly)) return;
+    file.write(QJsonDocument(entries).toJson(QJsonDocument::Compact));
+    file.commit();
+}
+
+qint64 PieceStore::modifiedTime(const QString& localPath)
+{
+    return QFileInfo(localPath).lastModified().toMSecsSinceEpoch();
+}
+
+void PieceStore::addComplete(const PieceManifest& manifest, const QString& localPath)
+{
+    Entry entry;
+    entry.manifest = manifest;
+    entry.manifest.swarm.clear();
+    entry.localPath = localPath;
+    entry.have = QBitArray(manifest.pieceCount(), true);
+    entry.modified = modifiedTime(localPath);
+    m_entries[manifest.contentId] = entry;
+    save();
+}
+
+bool PieceStore::addPartial(const PieceManifest& manifest, const QString& localPath)
+{
+    // Preallocate so pieces can land in any order
+    QFile file(localPath);
+    if (!file.open(QIODevice::ReadWrite) || !file.resize(manifest.fileSize)) {
+        return false;
+    }
+    
+    Entry entry;
+    entry.manifest = manifest;
+    entry.localPath = localPath;
+    entry.have = QBitArray(manifest.pieceCount());
+    m_entries[manifest.contentId] = entry;
+    return true;
+}
+
+void PieceStore::remove(const QString& contentId)
+{
+    auto it = m_entries.find(contentId);
+    if (it == m_entries.end()) return;
+    
+    const bool persisted = it->modified != 0;
+    m_entries.erase(it);
+    if (persisted) {
+        save();
+    }
+}
+
+PieceManifest PieceStore::manifest(const QString& contentId) const
+{
+    return m_entries.value(contentId).manifest;
+}
+
+QString PieceStore::localPath(const QString& contentId) const
+{
+    return m_entries.value(contentId).localPath;
+}
+
+QBitArray PieceStore::pieces(const QString& contentId) const
+{
+    return m_entries.value(contentId).have;
+}
+
+bool PieceStore::hasPiece(const QString& contentId, int index) const
+{
+    auto it = m_entries.constFind(contentId);
+    if (it == m_entries.constEnd() || index < 0 || index >= it->have.size()) return false;
+    return it->have.testBit(index);
+}
+
+bool PieceStore::isComplete(const QString& contentId) const
+{
+    auto it = m_entries.constFind(contentId);
+    return it != m_entries.constEnd() && it->have.count(true) == it->have.size();
+}
+
+QByteArray PieceStore::readPiece(const QString& contentId, int index) const
+{
+    if (!hasPiece(contentId, index)) return QByteArray();
+    
+    const Entry& entry = m_entries[contentId];
+    QFile file(entry.localPath);
+    if (!file.open(QIODevice::ReadOnly) || !file.seek(entry.manifest.pieceOffset(index))) {
+        return QByteArray();
+    }
+    return file.read(entry.manifest.pieceLength(index));
+}
+
+bool PieceStore::writePiece(const QString& contentId, int index, const QByteArray& data)
+{
+    auto it = m_entries.find(contentId);
+    if (it == m_entries.end() || index < 0 || index >= it->have.size()) return false;
+    if (it->have.testBit(index)) return true;
+    
+    const PieceManifest& manifest = it->manifest;
+    if (data.size() != manifest.pieceLength(index) ||
+        PieceManifest::hashPiece(data) != manifest.hashes.at(index)) {
+        return false;
+    }
+    
+    QFile file(it->localPath);
+    if (!file.open(QIODevice::ReadWrite) || !file.seek(manifest.pieceOffset(index)) ||
+        file.write(data) != data.size()) {
+        return false;
+    }
+    
+    file.close();
+    it->have.setBit(index);
+    
+    if (it->have.count(true) == it->have.size()) {
+        it->modified = modifiedTime(it->localPath);
+        save();
+    }
+    
+    emit pieceAdded(contentId, index);
+    return true;
+}
+
+QByteArray PieceStore::packBits(const QBitArray& bits)
+{
+    QByteArray packed((bits.size() + 7) / 8, '\0');
+    for (int i = 0; i < bits.size(); ++i) {
+        if (bits.testBit(i)) {
+            packed[i / 8] = static_cast<char>(packed.at(i / 8) | (0x80 >> (i % 8)));
+        }
+    }
+    return packed;
+}
+
+QBitArray PieceStore::unpackBits(const QByteArray& packed, int count)
+{
+    QBitArray bits(count);
+    for (int i = 0; i < count && i / 8 < packed.size(); ++i) {
+        if (static_cast<quint8>(packed.at(i / 8)) & (0x80 >> (i % 8))) {
+            bits.setBit(i);
+        }
+    }
+    return bits;
+}
+
+} // namespace Witra
@@ -0,0 +1,90 @@
+#ifndef PIECESTORE_H
+#define PIECESTORE_H
+
+#include <QObject>
+#include <QBitArray>
+#include <QHash>
+#include <QJsonObject>
+#include <QStringList>
+
+namespace Witra {
+
+// Size of one hash-identified piece of a swarmed file
+constexpr qint64 SWARM_PIECE_SIZE = 1024 * 1024;
+
+// Piece layout and hashes of one file; the content id is the hash of the
+// piece hashes, so identical files share it whatever their names
+struct PieceManifest {
+    QString contentId;
+    QString fileName;
+    qint64 fileSize = 0;
+    qint64 pieceSize = SWARM_PIECE_SIZE;
+    QList<QByteArray> hashes;
+    QStringList swarm; // peer ids taking part
+    
+    int pieceCount() const { return hashes.size(); }
+    qint64 pieceOffset(int index) const { return index * pieceSize; }
+    qint64 pieceLength(int index) const;
+    bool isValid() const;
+    
+    QJsonObject toJson() const;
+    static PieceManifest fromJson(const QJsonObject& obj);
+    
+    // Reads and hashes the whole file; call off the GUI thread
+    static PieceManifest fromFile(const QString& filePath, qint64 pieceSize = SWARM_PIECE_SIZE);
+    static QByteArray hashPiece(const QByteArray& data);
+};
+
+// Files this device can serve pieces of, complete or still downloading.
+// Complete files are remembered across restarts so they stay available as
+// sources for later downloads of the same content.
+class PieceStore : public QObject {
+    Q_OBJECT
+    
+public:
+    explicit PieceStore(QObject* parent = nullptr);
+    
+    // Restores complete files that are still unchanged on disk
+    void load();
+    
+    void addComplete(const PieceManifest& manifest, const QString& localPath);
+    bool addPartial(const PieceManifest& manifest, const QString& localPath);
+    void remove(const QString& contentId);
+    
+    bool contains(const QString& contentId) const { return m_entries.contains(contentId); }
+    PieceManifest manifest(const QString& contentId) const;
+    QString localPath(const QString& contentId) const;
+    QBitArray pieces(const QString& contentId) const;
+    bool hasPiece(const QString& contentId, int index) const;
+    bool isComplete(const QString& contentId) const;
+    
+    QByteArray readPiece(const QString& contentId, int index) const;
+    
+    // Verifies the piece against its hash before it is written
+    bool writePiece(const QString& contentId, int index, const QByteArray& data);
+    
+    // Piece bitfields travel packed, eight pieces per byte
+    static QByteArray packBits(const QBitArray& bits);
+    static QBitArray unpackBits(const QByteArray& packed, int count);
+    
+signals:
+    void pieceAdded(const QString& contentId, int index);
+    
+private:
+    struct Entry {
+        PieceManifest manifest;
+        QString localPath;
+        QBitArray have;
+        qint64 modified = 0; // msecs since epoch, for complete files
+    };
+    
+    void save() const;
+    static qint64 modifiedTime(const QString& localPath);
+    
+    QString m_path;
+    QHash<QString, Entry> m_entries;
+};
+
+} // namespace Witra
+
+#endif // PIECESTORE_H
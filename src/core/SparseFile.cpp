@@ -0,0 +1,143 @@
+#include "SparseFile.h"
+#include <QFile>
+
+#if defined(Q_OS_WIN)
+#include <windows.h>
+#include <winioctl.h>
+#include <io.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace Witra {
+
+namespace {
+
+// Holes too short to be worth a jump are folded into the data around them
+void addExtent(QList<FileExtent>& extents, qint64 offset, qint64 end)
+{
+    if (!extents.isEmpty() && offset - extents.last().end() < SPARSE_MIN_HOLE) {
+        extents.last().length = end - extents.last().offset;
+        return;
+    }
+    
+    FileExtent extent;
+    extent.offset = offset < SPARSE_MIN_HOLE ? 0 : offset;
+    extent.length = end - extent.offset;
+    extents.append(extent);
+}
+
+bool hasHoles(QList<FileExtent>& extents, qint64 size)
+{
+    if (!extents.isEmpty() && size - extents.last().end() < SPARSE_MIN_HOLE) {
+        extents.last().length = size - extents.last().offset;
+    }
+    
+    qint64 data = 0;
+    for (const FileExtent& extent : extents) {
+        data += extent.length;
+    }
+    return data < size;
+}
+
+} // namespace
+
+QList<FileExtent> dataExtents(const QString& filePath, bool* isSparse)
+{
+    *isSparse = false;
+    QList<FileExtent> extents;
+    bool complete = false;
+    qint64 size = 0;
+    
+#if defined(Q_OS_WIN)
+    HANDLE handle = CreateFileW(reinterpret_cast<const wchar_t*>(filePath.utf16()), GENERIC_READ,
+                                FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (handle == INVALID_HANDLE_VALUE) return extents;
+    
+    // Only files marked sparse can have unallocated ranges
+    BY_HANDLE_FILE_INFORMATION info;
+    if (GetFileInformationByHandle(handle, &info) &&
+        (info.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE)) {
+        size = (static_cast<qint64>(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+        
+        FILE_ALLOCATED_RANGE_BUFFER query;
+        query.FileOffset.QuadPart = 0;
+        query.Length.QuadPart = size;
+        FILE_ALLOCATED_RANGE_BUFFER ranges[512];
+        
+        while (size >= SPARSE_MIN_FILE_SIZE && extents.size() <= SPARSE_MAX_EXTENTS) {
+            DWORD bytes = 0;
+            const BOOL done = DeviceIoControl(handle, FSCTL_QUERY_ALLOCATED_RANGES,
+                                              &query, sizeof(query), ranges, sizeof(ranges),
+                                              &bytes, nullptr);
+            if (!done && GetLastError() != ERROR_MORE_DATA) break;
+            
+            const int count = static_cast<int>(bytes / sizeof(FILE_ALLOCATED_RANGE_BUFFER));
+            for (int i = 0; i < count; ++i) {
+                addExtent(extents, ranges[i].FileOffset.QuadPart,
+                          ranges[i].FileOffset.QuadPart + ranges[i].Length.QuadPart);
+            }
+            if (done || count == 0) {
+                complete = done;
+                break;
+            }
+            
+            query.FileOffset.QuadPart = ranges[count - 1].FileOffset.QuadPart +
+                                        ranges[count - 1].Length.QuadPart;
+            query.Length.QuadPart = size - query.FileOffset.QuadPart;
+        }
+    }
+    CloseHandle(handle);
+#elif defined(SEEK_DATA) && defined(SEEK_HOLE)
+    const int fd = ::open(QFile::encodeName(filePath).constData(), O_RDONLY);
+    if (fd < 0) return extents;
+    
+    // Filesystems without holes report the whole file as one extent
+    size = ::lseek(fd, 0, SEEK_END);
+    qint64 position = 0;
+    while (size >= SPARSE_MIN_FILE_SIZE && extents.size() <= SPARSE_MAX_EXTENTS) {
+        if (position >= size) {
+            complete = true;
+            break;
+        }
+        
+        const qint64 data = ::lseek(fd, position, SEEK_DATA);
+        if (data < 0) {
+            // Nothing but a hole from here to the end
+            complete = errno == ENXIO;
+            break;
+        }
+        const qint64 hole = ::lseek(fd, data, SEEK_HOLE);
+        if (hole < 0) break;
+        
+        addExtent(extents, data, hole);
+        position = hole;
+    }
+    ::close(fd);
+#endif
+    
+    if (!complete || extents.size() > SPARSE_MAX_EXTENTS || !hasHoles(extents, size)) {
+        extents.clear();
+        return extents;
+    }
+    
+    *isSparse = true;
+    return extents;
+}
+
+bool markSparse(QFile* file)
+{
+#if defined(Q_OS_WIN)
+    HANDLE handle = reinterpret_cast<HANDLE>(_get_osfhandle(file->handle()));
+    DWORD bytes = 0;
+    return DeviceIoControl(handle, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &bytes, nullptr);
+#else
+    Q_UNUSED(file)
+    return true;
+#endif
+}
+
+} // namespace Witra
@@ -0,0 +1,38 @@
+#ifndef SPARSEFILE_H
+#define SPARSEFILE_H
+
+#include <QList>
+#include <QString>
+
+class QFile;
+
+namespace Witra {
+
+// Files smaller than this are always sent dense
+constexpr qint64 SPARSE_MIN_FILE_SIZE = 1024 * 1024;
+
+// Holes shorter than this are sent as data, so extents stay few and long
+constexpr qint64 SPARSE_MIN_HOLE = 64 * 1024;
+
+// Files fragmented into more extents than this are sent dense
+constexpr int SPARSE_MAX_EXTENTS = 65536;
+
+struct FileExtent {
+    qint64 offset = 0;
+    qint64 length = 0;
+    
+    qint64 end() const { return offset + length; }
+};
+
+// Data extents of a file, in order, when it has holes worth skipping; an
+// empty list when it is dense or the platform cannot tell. isSparse says
+// which, since a file may be nothing but a hole.
+QList<FileExtent> dataExtents(const QString& filePath, bool* isSparse);
+
+// Lets ranges never written stay unallocated. Only Windows needs asking;
+// elsewhere seeking past them is enough.
+bool markSparse(QFile* file);
+
+} // namespace Witra
+
+#endif // SPARSEFILE_H
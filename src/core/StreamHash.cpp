@@ -0,0 +1,217 @@
+#include "StreamHash.h"
+#include "network/ChunkPool.h"
+#include <QPointer>
+#include <QThreadPool>
+#include <QtEndian>
+#include <cstring>
+
+namespace Witra {
+
+namespace {
+
+constexpr quint64 PRIME1 = 0x9E3779B185EBCA87ULL;
+constexpr quint64 PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr quint64 PRIME3 = 0x165667B19E3779F9ULL;
+constexpr quint64 PRIME4 = 0x85EBCA77C2B2AE63ULL;
+constexpr quint64 PRIME5 = 0x27D4EB2F165667C5ULL;
+
+inline quint64 rotl(quint64 value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+inline quint64 mixLane(quint64 lane, quint64 input)
+{
+    lane += input * PRIME2;
+    lane = rotl(lane, 31);
+    return lane * PRIME1;
+}
+
+inline quint64 mergeRound(quint64 hash, quint64 lane)
+{
+    hash ^= mixLane(0, lane);
+    return hash * PRIME1 + PRIME4;
+}
+
+inline quint64 read64(const uchar* data)
+{
+    return qFromLittleEndian<quint64>(data);
+}
+
+inline quint32 read32(const uchar* data)
+{
+    return qFromLittleEndian<quint32>(data);
+}
+
+} // namespace
+
+void Xxh64::reset(quint64 seed)
+{
+    m_seed = seed;
+    m_lanes[0] = seed + PRIME1 + PRIME2;
+    m_lanes[1] = seed + PRIME2;
+    m_lanes[2] = seed;
+    m_lanes[3] = seed - PRIME1;
+    m_length = 0;
+    m_buffered = 0;
+}
+
+void Xxh64::addData(const char* data, qint64 length)
+{
+    const uchar* input = reinterpret_cast<const uchar*>(data);
+    const uchar* end = input + length;
+    m_length += static_cast<quint64>(length);
+    
+    // Top up a partial stripe left by the previous call first
+    if (m_buffered + length < 32) {
+        std::memcpy(m_buffer + m_buffered, input, static_cast<size_t>(length));
+        m_buffered += static_cast<int>(length);
+        return;
+    }
+    if (m_buffered > 0) {
+        const int fill = 32 - m_buffered;
+        std::memcpy(m_buffer + m_buffered, input, static_cast<size_t>(fill));
+        for (int i = 0; i < 4; ++i) {
+            m_lanes[i] = mixLane(m_lanes[i], read64(m_buffer + 8 * i));
+        }
+        input += fill;
+        m_buffered = 0;
+    }
+    
+    while (end - input >= 32) {
+        m_lanes[0] = mixLane(m_lanes[0], read64(input));
+        m_lanes[1] = mixLane(m_lanes[1], read64(input + 8));
+        m_lanes[2] = mixLane(m_lanes[2], read64(input + 16));
+        m_lanes[3] = mixLane(m_lanes[3], read64(input + 24));
+        input += 32;
+    }
+    
+    m_buffered = static_cast<int>(end - input);
+    std::memcpy(m_buffer, input, static_cast<size_t>(m_buffered));
+}
+
+QByteArray Xxh64::result() const
+{
+    quint64 hash;
+    if (m_length >= 32) {
+        hash = rotl(m_lanes[0], 1) + rotl(m_lanes[1], 7) + rotl(m_lanes[2], 12) + rotl(m_lanes[3], 18);
+        for (int i = 0; i < 4; ++i) {
+            hash = mergeRound(hash, m_lanes[i]);
+        }
+    } else {
+        hash = m_seed + PRIME5;
+    }
+    hash += m_length;
+    
+    const uchar* input = m_buffer;
+    const uchar* end = m_buffer + m_buffered;
+    while (end - input >= 8) {
+        hash ^= mixLane(0, read64(input));
+        hash = rotl(hash, 27) * PRIME1 + PRIME4;
+        input += 8;
+    }
+    if (end - input >= 4) {
+        hash ^= static_cast<quint64>(read32(input)) * PRIME1;
+        hash = rotl(hash, 23) * PRIME2 + PRIME3;
+        input += 4;
+    }
+    while (input < end) {
+        hash ^= *input * PRIME5;
+        hash = rotl(hash, 11) * PRIME1;
+        ++input;
+    }
+    
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    hash ^= hash >> 32;
+    
+    QByteArray digest(8, '\0');
+    qToBigEndian(hash, digest.data());
+    return digest;
+}
+
+StreamVerifier::StreamVerifier(QObject* parent)
+    : QObject(parent)
+    , m_active(false)
+{
+}
+
+void StreamVerifier::start(bool contentHash)
+{
+    // A task still draining the old state finishes on its own copy
+    m_state = std::make_shared<State>();
+    if (contentHash) {
+        m_state->content = std::make_unique<QCryptographicHash>(QCryptographicHash::Sha256);
+    }
+    m_active = true;
+}
+
+void StreamVerifier::stop()
+{
+    m_state.reset();
+    m_active = false;
+}
+
+void StreamVerifier::addData(const QByteArray& data)
+{
+    if (!m_active) return;
+    
+    QMutexLocker lock(&m_state->mutex);
+    m_state->queue.enqueue(data);
+    if (!m_state->running) {
+        schedule();
+    }
+}
+
+void StreamVerifier::finish()
+{
+    if (!m_active) return;
+    
+    QMutexLocker lock(&m_state->mutex);
+    m_state->finishing = true;
+    if (!m_state->running) {
+        schedule();
+    }
+}
+
+void StreamVerifier::schedule()
+{
+    // Called with the state locked; one task at a time keeps the order
+    m_state->running = true;
+    
+    std::shared_ptr<State> state = m_state;
+    QPointer<StreamVerifier> self(this);
+    
+    QThreadPool::globalInstance()->start([self, state]() {
+        for (;;) {
+            QByteArray chunk;
+            {
+                QMutexLocker lock(&state->mutex);
+                if (state->queue.isEmpty()) {
+                    state->running = false;
+                    if (!state->finishing) return;
+                    state->finishing = false;
+                    break;
+                }
+                chunk = state->queue.dequeue();
+            }
+            state->hash.addData(chunk);
+            if (state->content) state->content->addData(chunk);
+            ChunkPool::instance().release(chunk);
+        }
+        
+        const QByteArray digest = state->hash.result();
+        const QByteArray contentHash = state->content ? state->content->result() : QByteArray();
+        if (!self) return;
+        QMetaObject::invokeMethod(self.data(), [self, state, digest, contentHash]() {
+            if (self && self->m_state == state) {
+                self->m_active = false;
+                emit self->finished(digest, contentHash);
+            }
+        }, Qt::QueuedConnection);
+    });
+}
+
+} // namespace Witra
@@ -0,0 +1,73 @@
+#ifndef STREAMHASH_H
+#define STREAMHASH_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QCryptographicHash>
+#include <QMutex>
+#include <QQueue>
+#include <memory>
+
+namespace Witra {
+
+// XXH64, fed a piece at a time. Four independent lanes keep the CPU's
+// multipliers busy, so it hashes far faster than any link delivers data.
+class Xxh64 {
+public:
+    explicit Xxh64(quint64 seed = 0) { reset(seed); }
+    
+    void reset(quint64 seed = 0);
+    void addData(const char* data, qint64 length);
+    void addData(const QByteArray& data) { addData(data.constData(), data.size()); }
+    
+    // Eight bytes, big-endian
+    QByteArray result() const;
+    
+private:
+    quint64 m_lanes[4];
+    quint64 m_seed;
+    quint64 m_length;
+    uchar m_buffer[32];
+    int m_buffered;
+};
+
+// Hashes a received file on the thread pool as its data arrives, in
+// order, and reports the digest once finish() has been called and every
+// byte before it has been hashed. Asked to, it also takes the file's
+// SHA-256, the content hash our own indexes record.
+class StreamVerifier : public QObject {
+    Q_OBJECT
+    
+public:
+    explicit StreamVerifier(QObject* parent = nullptr);
+    
+    // Begins a new file; anything still hashing for the last one is dropped
+    void start(bool contentHash = false);
+    void stop();
+    bool isActive() const { return m_active; }
+    
+    void addData(const QByteArray& data);
+    void finish();
+    
+signals:
+    void finished(const QByteArray& digest, const QByteArray& contentHash);
+    
+private:
+    struct State {
+        QMutex mutex;
+        QQueue<QByteArray> queue;
+        bool running = false;
+        bool finishing = false;
+        Xxh64 hash;
+        std::unique_ptr<QCryptographicHash> content;
+    };
+    
+    void schedule();
+    
+    std::shared_ptr<State> m_state;
+    bool m_active;
+};
+
+} // namespace Witra
+
+#endif // STREAMHASH_H
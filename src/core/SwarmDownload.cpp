@@ -0,0 +1,281 @@
+#include "SwarmDownload.h"
+#include <algorithm>
+#include <cmath>
+
+namespace Witra {
+
+SwarmDownload::SwarmDownload(const QString& transferId, const PieceManifest& manifest,
+                             PieceStore* store, QObject* parent)
+    : QObject(parent)
+    , m_transferId(transferId)
+    , m_manifest(manifest)
+    , m_store(store)
+    , m_requested(manifest.pieceCount())
+    , m_expiryTimer(new QTimer(this))
+{
+    m_clock.start();
+    
+    connect(m_expiryTimer, &QTimer::timeout, this, &SwarmDownload::expireRequests);
+    m_expiryTimer->start(SWARM_REQUEST_TIMEOUT / 3);
+}
+
+bool SwarmDownload::isComplete() const
+{
+    return m_store->isComplete(m_manifest.contentId);
+}
+
+qint64 SwarmDownload::bytesDone() const
+{
+    const QBitArray have = m_store->pieces(m_manifest.contentId);
+    qint64 done = 0;
+    for (int i = 0; i < have.size(); ++i) {
+        if (have.testBit(i)) done += m_manifest.pieceLength(i);
+    }
+    return done;
+}
+
+void SwarmDownload::addSource(TransferSession* session)
+{
+    if (!session || m_sources.contains(session)) return;
+    
+    Source source;
+    source.session = session;
+    source.have = QBitArray(m_manifest.pieceCount());
+    m_sources.insert(session, source);
+    
+    // Tell the new source what we already hold so it can fetch from us too
+    session->advertisePieces(m_manifest.contentId,
+                             PieceStore::packBits(m_store->pieces(m_manifest.contentId)));
+}
+
+void SwarmDownload::removeSource(TransferSession* session)
+{
+    auto it = m_sources.find(session);
+    if (it == m_sources.end()) return;
+    
+    const QList<int> inflight = it->inflight.keys();
+    m_sources.erase(it);
+    for (int index : inflight) {
+        releasePiece(index);
+    }
+    
+    schedule();
+}
+
+bool SwarmDownload::hasSource(const QString& peerId) const
+{
+    for (const Source& source : m_sources) {
+        if (source.session && source.session->peerId() == peerId) return true;
+    }
+    return false;
+}
+
+bool SwarmDownload::markQueried(const QString& peerId)
+{
+    if (m_queried.contains(peerId)) return false;
+    m_queried.insert(peerId);
+    return true;
+}
+
+void SwarmDownload::updateSource(TransferSession* session, const QByteArray& bitfield,
+                                 const QList<int>& added)
+{
+    auto it = m_sources.find(session);
+    if (it == m_sources.end()) return;
+    
+    if (!bitfield.isEmpty()) {
+        it->have = PieceStore::unpackBits(bitfield, m_manifest.pieceCount());
+    }
+    for (int index : added) {
+        if (index >= 0 && index < it->have.size()) {
+            it->have.setBit(index);
+        }
+    }
+    
+    schedule();
+}
+
+void SwarmDownload::receivePiece(TransferSession* session, int index, const QByteArray& data)
+{
+    if (index < 0 || index >= m_requested.size()) return;
+    
+    auto it = m_sources.find(session);
+    if (it != m_sources.end()) {
+        measure(*it, index, data.size());
+        it->inflight.remove(index);
+    }
+    
+    // The slower copy of a re-requested piece
+    if (m_store->hasPiece(m_manifest.contentId, index)) {
+        schedule();
+        return;
+    }
+    releasePiece(index);
+    
+    // A piece that fails its hash is simply fetched again, possibly elsewhere
+    if (m_store->writePiece(m_manifest.contentId, index, data)) {
+        for (const Source& source : m_sources) {
+            if (source.session) {
+                source.session->announcePiece(m_manifest.contentId, index);
+            }
+        }
+        
+        emit progress(m_transferId, bytesDone(), m_manifest.fileSize);
+        
+        if (isComplete()) {
+            m_expiryTimer->stop();
+            emit completed(m_transferId);
+            return;
+        }
+    } else if (it != m_sources.end()) {
+        it->have.clearBit(index);
+    }
+    
+    schedule();
+}
+
+void SwarmDownload::expireRequests()
+{
+    const qint64 now = m_clock.elapsed();
+    bool expired = false;
+    
+    for (Source& source : m_sources) {
+        for (auto it = source.inflight.begin(); it != source.inflight.end();) {
+            if (now - it.value() > SWARM_REQUEST_TIMEOUT) {
+                const int index = it.key();
+                it = source.inflight.erase(it);
+                releasePiece(index);
+                expired = true;
+            } else {
+                ++it;
+            }
+        }
+    }
+    
+    if (expired) {
+        schedule();
+    }
+}
+
+void SwarmDownload::schedule()
+{
+    if (isComplete()) return;
+    
+    for (Source& source : m_sources) {
+        if (!source.session) continue;
+        
+        QList<int> batch;
+        const int limit = depth(source);
+        while (source.inflight.size() < limit) {
+            int index = pickPiece(source);
+            if (index < 0) index = stealPiece(source);
+            if (index < 0) break;
+            
+            m_requested.setBit(index);
+            source.inflight.insert(index, m_clock.elapsed());
+            batch.append(index);
+        }
+        
+        if (!batch.isEmpty()) {
+            source.session->requestPieces(m_manifest.contentId, batch);
+        }
+    }
+}
+
+int SwarmDownload::pickPiece(const Source& source) const
+{
+    // Rarest first, so pieces only the original sender holds spread early
+    int best = -1;
+    int bestCount = 0;
+    
+    for (int i = 0; i < m_manifest.pieceCount(); ++i) {
+        if (!source.have.testBit(i) || m_requested.testBit(i) ||
+            m_store->hasPiece(m_manifest.contentId, i)) {
+            continue;
+        }
+        
+        int count = 0;
+        for (const Source& other : m_sources) {
+            if (other.have.testBit(i)) ++count;
+        }
+        
+        if (best < 0 || count < bestCount) {
+            best = i;
+            bestCount = count;
+            if (count == 1) break;
+        }
+    }
+    
+    return best;
+}
+
+int SwarmDownload::stealPiece(const Source& thief) const
+{
+    // Nothing left to hand out: take over the piece that would otherwise
+    // arrive last, if this source would clearly deliver it sooner. The
+    // first copy to arrive is kept.
+    if (thief.rate <= 0) return -1;
+    
+    int best = -1;
+    double bestFinish = 0;
+    const double thiefFinish = (thief.inflight.size() + 1) * m_manifest.pieceSize / thief.rate;
+    
+    for (const Source& holder : m_sources) {
+        if (&holder == &thief) continue;
+        
+        // Pieces are served in request order
+        QList<qint64> times = holder.inflight.values();
+        std::sort(times.begin(), times.end());
+        
+        for (auto it = holder.inflight.constBegin(); it != holder.inflight.constEnd(); ++it) {
+            if (!thief.have.testBit(it.key()) || thief.inflight.contains(it.key())) continue;
+            
+            // An unmeasured holder is assumed to be no faster than the thief
+            const int queued = times.indexOf(it.value()) + 1;
+            const double rate = holder.rate > 0 ? holder.rate : thief.rate;
+            const double finish = queued * m_manifest.pieceSize / rate;
+            
+            if (finish > 2 * thiefFinish && finish > bestFinish) {
+                best = it.key();
+                bestFinish = finish;
+            }
+        }
+    }
+    
+    return best;
+}
+
+int SwarmDownload::depth(const Source& source) const
+{
+    if (source.rate <= 0) return SWARM_REQUESTS_PER_SOURCE;
+    
+    const double pieces = source.rate * SWARM_PIPELINE_TIME / m_manifest.pieceSize;
+    return qBound(2, static_cast<int>(std::ceil(pieces)), SWARM_MAX_REQUESTS_PER_SOURCE);
+}
+
+void SwarmDownload::measure(Source& source, int index, qint64 bytes)
+{
+    auto it = source.inflight.constFind(index);
+    if (it == source.inflight.constEnd()) return;
+    
+    // Time this source spent on the piece: since it was asked for it, or
+    // since its previous piece arrived if it was still busy with that
+    const qint64 now = m_clock.elapsed();
+    const qint64 started = qMax(it.value(), source.lastArrival);
+    const double sample = static_cast<double>(bytes) / qMax<qint64>(1, now - started);
+    
+    source.rate = source.rate <= 0 ? sample
+        : (1 - SWARM_RATE_SMOOTHING) * source.rate + SWARM_RATE_SMOOTHING * sample;
+    source.lastArrival = now;
+}
+
+void SwarmDownload::releasePiece(int index)
+{
+    // A re-requested piece stays claimed while another copy is on its way
+    for (const Source& source : m_sources) {
+        if (source.inflight.contains(index)) return;
+    }
+    m_requested.clearBit(index);
+}
+
+} // namespace Witra
@@ -0,0 +1,97 @@
+#ifndef SWARMDOWNLOAD_H
+#define SWARMDOWNLOAD_H
+
+#include <QObject>
+#include <QBitArray>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QPointer>
+#include <QSet>
+#include <QTimer>
+#include "PieceStore.h"
+#include "network/TransferSession.h"
+
+namespace Witra {
+
+// Pieces requested from a source before its rate is known
+constexpr int SWARM_REQUESTS_PER_SOURCE = 4;
+
+// Upper bound on pieces outstanding at one source, however fast it is
+constexpr int SWARM_MAX_REQUESTS_PER_SOURCE = 32;
+
+// Each source is kept this far ahead of its measured rate (ms)
+constexpr int SWARM_PIPELINE_TIME = 2000;
+
+// Weight of the newest sample in a source's smoothed rate
+constexpr double SWARM_RATE_SMOOTHING = 0.3;
+
+// Requests unanswered for this long go back to the pool (ms)
+constexpr int SWARM_REQUEST_TIMEOUT = 15000;
+
+// Fetches a content-identified file piece by piece from every session that
+// holds pieces of it, rarest first, and announces each verified piece so the
+// other receivers can fetch it from us instead of the original sender. Each
+// source gets requests in proportion to its measured rate, and pieces stuck
+// behind a slow source are re-requested from a faster idle one.
+class SwarmDownload : public QObject {
+    Q_OBJECT
+    
+public:
+    SwarmDownload(const QString& transferId, const PieceManifest& manifest,
+                  PieceStore* store, QObject* parent = nullptr);
+    
+    QString transferId() const { return m_transferId; }
+    QString contentId() const { return m_manifest.contentId; }
+    PieceManifest manifest() const { return m_manifest; }
+    bool isComplete() const;
+    qint64 bytesDone() const;
+    
+    void addSource(TransferSession* session);
+    void removeSource(TransferSession* session);
+    bool hasSource(const QString& peerId) const;
+    int sourceCount() const { return m_sources.size(); }
+    
+    // True the first time a peer is asked for this content
+    bool markQueried(const QString& peerId);
+    
+    // PIECE_HAVE from a source: a full bitfield or newly held pieces
+    void updateSource(TransferSession* session, const QByteArray& bitfield,
+                      const QList<int>& added);
+    void receivePiece(TransferSession* session, int index, const QByteArray& data);
+    
+signals:
+    void progress(const QString& transferId, qint64 bytesDone, qint64 totalBytes);
+    void completed(const QString& transferId);
+    
+private slots:
+    void expireRequests();
+    
+private:
+    struct Source {
+        QPointer<TransferSession> session;
+        QBitArray have;
+        QHash<int, qint64> inflight; // piece -> request time
+        double rate = 0;             // bytes per ms, smoothed; 0 until measured
+        qint64 lastArrival = -1;
+    };
+    
+    void schedule();
+    int pickPiece(const Source& source) const;
+    int stealPiece(const Source& thief) const;
+    int depth(const Source& source) const;
+    void measure(Source& source, int index, qint64 bytes);
+    void releasePiece(int index);
+    
+    QString m_transferId;
+    PieceManifest m_manifest;
+    PieceStore* m_store;
+    QHash<TransferSession*, Source> m_sources;
+    QBitArray m_requested;
+    QSet<QString> m_queried;
+    QElapsedTimer m_clock;
+    QTimer* m_expiryTimer;
+};
+
+} // namespace Witra
+
+#endif // SWARMDOWNLOAD_H
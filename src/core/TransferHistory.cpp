@@ -0,0 +1,205 @@
+#include "TransferHistory.h"
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSettings>
+#include <QStandardPaths>
+
+namespace Witra {
+
+namespace {
+
+constexpr qint64 ARCHIVE_READ_BLOCK = 64 * 1024;
+
+QString rotatedPath(const QString& path)
+{
+    return path + ".1";
+}
+
+// Walk a log file from its end, yielding complete lines newest-first until
+// enough records have been collected.
+void readRecordsBackwards(const QString& path, int& skip, int& remaining,
+                          QList<TransferRecord>& out)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) return;
+    
+    qint64 pos = file.size();
+    QByteArray carry;
+    
+    while (pos > 0 && remaining > 0) {
+        qint64 blockSize = qMin(ARCHIVE_READ_BLOCK, pos);
+        pos -= blockSize;
+        file.seek(pos);
+        QByteArray block = file.read(blockSize) + carry;
+        
+        int end = block.size();
+        while (end > 0 && remaining > 0) {
+            int newline = block.lastIndexOf('\n', end - 1);
+            if (newline < 0 && pos > 0) break; // Line continues in previous block
+            
+            QByteArray line = block.mid(newline + 1, end - newline - 1);
+            end = newline < 0 ? 0 : newline;
+            
+            TransferRecord record = TransferRecord::fromJson(line);
+            if (!record.isValid()) continue;
+            
+            if (skip > 0) {
+                --skip;
+                continue;
+            }
+            
+            out.append(record);
+            --remaining;
+        }
+        
+        carry = block.left(end);
+    }
+}
+
+int countLines(const QString& path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) return 0;
+    
+    int lines = 0;
+    while (!file.atEnd()) {
+        lines += file.read(ARCHIVE_READ_BLOCK).count('\n');
+    }
+    return lines;
+}
+
+} // namespace
+
+QByteArray TransferRecord::toJson() const
+{
+    QJsonObject obj;
+    obj["id"] = id;
+    obj["fileName"] = fileName;
+    obj["filePath"] = filePath;
+    obj["totalSize"] = totalSize;
+    obj["transferred"] = transferredSize;
+    obj["direction"] = static_cast<int>(direction);
+    obj["status"] = static_cast<int>(status);
+    obj["peerId"] = peerId;
+    obj["peerName"] = peerName;
+    obj["totalFiles"] = totalFiles;
+    if (!errorMessage.isEmpty()) {
+        obj["error"] = errorMessage;
+    }
+    obj["started"] = startTime.toMSecsSinceEpoch();
+    obj["finished"] = finishTime.toMSecsSinceEpoch();
+    return QJsonDocument(obj).toJson(QJsonDocument::Compact);
+}
+
+TransferRecord TransferRecord::fromJson(const QByteArray& data)
+{
+    TransferRecord record;
+    QJsonDocument doc = QJsonDocument::fromJson(data);
+    if (doc.isObject()) {
+        QJsonObject obj = doc.object();
+        record.id = obj["id"].toString();
+        record.fileName = obj["fileName"].toString();
+        record.filePath = obj["filePath"].toString();
+        record.totalSize = obj["totalSize"].toVariant().toLongLong();
+        record.transferredSize = obj["transferred"].toVariant().toLongLong();
+        record.direction = static_cast<TransferItem::Direction>(obj["direction"].toInt());
+        record.status = static_cast<TransferItem::Status>(obj["status"].toInt());
+        record.peerId = obj["peerId"].toString();
+        record.peerName = obj["peerName"].toString();
+        record.totalFiles = obj["totalFiles"].toVariant().toLongLong();
+        record.errorMessage = obj["error"].toString();
+        record.startTime = QDateTime::fromMSecsSinceEpoch(obj["started"].toVariant().toLongLong());
+        record.finishTime = QDateTime::fromMSecsSinceEpoch(obj["finished"].toVariant().toLongLong());
+    }
+    return record;
+}
+
+TransferRecord TransferRecord::fromItem(const TransferItem* item)
+{
+    TransferRecord record;
+    record.id = item->id();
+    record.fileName = item->fileName();
+    record.filePath = item->filePath();
+    record.totalSize = item->totalSize();
+    record.transferredSize = item->transferredSize();
+    record.direction = item->direction();
+    record.status = item->status();
+    record.peerId = item->peerId();
+    record.peerName = item->peerName();
+    record.totalFiles = item->totalFiles();
+    record.errorMessage = item->errorMessage();
+    record.startTime = item->startTime();
+    record.finishTime = QDateTime::currentDateTime();
+    return record;
+}
+
+TransferHistory::TransferHistory(QObject* parent)
+    : QObject(parent)
+    , m_window(DEFAULT_HISTORY_WINDOW)
+{
+    QString dataPath = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
+    QDir().mkpath(dataPath);
+    m_archivePath = dataPath + "/history.log";
+    
+    QSettings settings;
+    m_window = qMax(1, settings.value("history/window", DEFAULT_HISTORY_WINDOW).toInt());
+}
+
+void TransferHistory::setWindow(int window)
+{
+    m_window = qMax(1, window);
+    
+    QSettings settings;
+    settings.setValue("history/window", m_window);
+}
+
+void TransferHistory::append(const TransferRecord& record)
+{
+    rotateIfNeeded();
+    
+    QFile file(m_archivePath);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Append)) return;
+    
+    file.write(record.toJson() + '\n');
+    file.close();
+}
+
+QList<TransferRecord> TransferHistory::records(int offset, int count) const
+{
+    QList<TransferRecord> result;
+    int skip = qMax(0, offset);
+    int remaining = count;
+    
+    readRecordsBackwards(m_archivePath, skip, remaining, result);
+    if (remaining > 0) {
+        readRecordsBackwards(rotatedPath(m_archivePath), skip, remaining, result);
+    }
+    
+    return result;
+}
+
+int TransferHistory::archivedCount() const
+{
+    return countLines(m_archivePath) + countLines(rotatedPath(m_archivePath));
+}
+
+void TransferHistory::clear()
+{
+    QFile::remove(m_archivePath);
+    QFile::remove(rotatedPath(m_archivePath));
+}
+
+void TransferHistory::rotateIfNeeded()
+{
+    QFileInfo info(m_archivePath);
+    if (!info.exists() || info.size() < HISTORY_ARCHIVE_MAX_BYTES) return;
+    
+    // Keep exactly one previous generation so disk usage stays bounded too
+    QFile::remove(rotatedPath(m_archivePath));
+    QFile::rename(m_archivePath, rotatedPath(m_archivePath));
+}
+
+} // namespace Witra
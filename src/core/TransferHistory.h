@@ -0,0 +1,73 @@
+#ifndef TRANSFERHISTORY_H
+#define TRANSFERHISTORY_H
+
+#include <QObject>
+#include <QString>
+#include <QDateTime>
+#include <QList>
+#include "TransferItem.h"
+
+namespace Witra {
+
+// Number of finished transfers kept in memory before older ones are archived
+constexpr int DEFAULT_HISTORY_WINDOW = 100;
+
+// Archive log is rotated once it grows past this size
+constexpr qint64 HISTORY_ARCHIVE_MAX_BYTES = 16 * 1024 * 1024;
+
+// Snapshot of a finished transfer, as stored in the on-disk archive
+struct TransferRecord {
+    QString id;
+    QString fileName;
+    QString filePath;
+    qint64 totalSize = 0;
+    qint64 transferredSize = 0;
+    TransferItem::Direction direction = TransferItem::Direction::Incoming;
+    TransferItem::Status status = TransferItem::Status::Completed;
+    QString peerId;
+    QString peerName;
+    qint64 totalFiles = 1;
+    QString errorMessage;
+    QDateTime startTime;
+    QDateTime finishTime;
+    
+    QByteArray toJson() const;
+    static TransferRecord fromJson(const QByteArray& data);
+    static TransferRecord fromItem(const TransferItem* item);
+    
+    bool isValid() const { return !id.isEmpty(); }
+};
+
+// Append-only archive of finished transfers. Records are written as one
+// compact JSON object per line and read back newest-first on demand, so
+// nothing but the file handle is kept in memory.
+class TransferHistory : public QObject {
+    Q_OBJECT
+    
+public:
+    explicit TransferHistory(QObject* parent = nullptr);
+    
+    // In-memory window size used by TransferManager
+    int window() const { return m_window; }
+    void setWindow(int window);
+    
+    QString archivePath() const { return m_archivePath; }
+    
+    void append(const TransferRecord& record);
+    
+    // Newest-first page of archived records; offset 0 is the latest record
+    QList<TransferRecord> records(int offset, int count) const;
+    int archivedCount() const;
+    
+    void clear();
+    
+private:
+    void rotateIfNeeded();
+    
+    QString m_archivePath;
+    int m_window;
+};
+
+} // namespace Witra
+
+#endif // TRANSFERHISTORY_H
@@ -12,6 +12,8 @@ TransferItem::TransferItem(QObject* parent)
     , m_startTime(QDateTime::currentDateTime())
     , m_totalFiles(1)
     , m_currentFile(1)
+    , m_verifiedFiles(0)
+    , m_uncheckedFiles(0)
     , m_lastSpeedBytes(0)
     , m_lastSpeedTime(QDateTime::currentDateTime())
     , m_currentSpeed(0)
@@ -31,6 +33,8 @@ TransferItem::TransferItem(const QString& id, const QString& fileName, qint64 to
     , m_startTime(QDateTime::currentDateTime())
     , m_totalFiles(1)
     , m_currentFile(1)
+    , m_verifiedFiles(0)
+    , m_uncheckedFiles(0)
     , m_lastSpeedBytes(0)
     , m_lastSpeedTime(QDateTime::currentDateTime())
     , m_currentSpeed(0)
@@ -64,7 +68,7 @@ QString TransferItem::statusString() const
     switch (m_status) {
         case Status::Pending: return tr("Waiting");
         case Status::InProgress: return tr("Transferring");
-        case Status::Completed: return tr("Completed");
+        case Status::Completed: return isVerified() ? tr("Verified") : tr("Completed");
         case Status::Failed: return tr("Failed");
         case Status::Cancelled: return tr("Cancelled");
         default: return tr("Unknown");
@@ -79,6 +83,15 @@ void TransferItem::setStatus(Status status)
     }
 }
 
+void TransferItem::addCheckedFile(bool verified)
+{
+    if (verified) {
+        ++m_verifiedFiles;
+    } else {
+        ++m_uncheckedFiles;
+    }
+}
+
 void TransferItem::setTransferredSize(qint64 size)
 {
     m_transferredSize = size;
@@ -93,6 +106,58 @@ void TransferItem::addTransferredBytes(qint64 bytes)
     emit progressChanged(progress());
 }
 
+int TransferItem::finishedTargets() const
+{
+    int finished = 0;
+    for (const Target& target : m_targets) {
+        if (target.status != Status::InProgress && target.status != Status::Pending) {
+            ++finished;
+        }
+    }
+    return finished;
+}
+
+void TransferItem::addTarget(const QString& peerId, const QString& peerName)
+{
+    if (hasTarget(peerId)) return;
+    
+    Target target;
+    target.peerId = peerId;
+    target.peerName = peerName;
+    m_targets.append(target);
+}
+
+void TransferItem::setTargetProgress(const QString& peerId, qint64 transferred)
+{
+    int index = targetIndex(peerId);
+    if (index < 0) return;
+    
+    m_targets[index].transferredSize = transferred;
+    
+    qint64 sum = 0;
+    for (const Target& target : m_targets) {
+        sum += target.transferredSize;
+    }
+    setTransferredSize(sum / m_targets.size());
+}
+
+void TransferItem::setTargetStatus(const QString& peerId, Status status, const QString& error)
+{
+    int index = targetIndex(peerId);
+    if (index < 0) return;
+    
+    m_targets[index].status = status;
+    m_targets[index].errorMessage = error;
+}
+
+int TransferItem::targetIndex(const QString& peerId) const
+{
+    for (int i = 0; i < m_targets.size(); ++i) {
+        if (m_targets.at(i).peerId == peerId) return i;
+    }
+    return -1;
+}
+
 void TransferItem::updateSpeed()
 {
     QDateTime now = QDateTime::currentDateTime();
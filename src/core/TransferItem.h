@@ -4,6 +4,7 @@
 #include <QObject>
 #include <QString>
 #include <QDateTime>
+#include <QList>
 
 namespace Witra {
 
@@ -26,6 +27,15 @@ public:
     };
     Q_ENUM(Status)
     
+    // One receiving peer of a fan-out send
+    struct Target {
+        QString peerId;
+        QString peerName;
+        qint64 transferredSize = 0;
+        Status status = Status::InProgress;
+        QString errorMessage;
+    };
+    
     explicit TransferItem(QObject* parent = nullptr);
     TransferItem(const QString& id, const QString& fileName, qint64 totalSize,
                  Direction direction, const QString& peerId, QObject* parent = nullptr);
@@ -53,12 +63,26 @@ public:
     void setStatus(Status status);
     void setTransferredSize(qint64 size);
     void addTransferredBytes(qint64 bytes);
+    void setTotalSize(qint64 size) { m_totalSize = size; }
     void setTotalFiles(qint64 total) { m_totalFiles = total; }
     void setCurrentFile(qint64 current) { m_currentFile = current; }
     void setErrorMessage(const QString& error) { m_errorMessage = error; }
     
     QString errorMessage() const { return m_errorMessage; }
     
+    // Received files whose content was checked against the sender's hash
+    void addCheckedFile(bool verified);
+    bool isVerified() const { return m_verifiedFiles > 0 && m_uncheckedFiles == 0; }
+    
+    // Fan-out sends track every target; overall progress is their average
+    bool isFanOut() const { return !m_targets.isEmpty(); }
+    QList<Target> targets() const { return m_targets; }
+    bool hasTarget(const QString& peerId) const { return targetIndex(peerId) >= 0; }
+    int finishedTargets() const;
+    void addTarget(const QString& peerId, const QString& peerName);
+    void setTargetProgress(const QString& peerId, qint64 transferred);
+    void setTargetStatus(const QString& peerId, Status status, const QString& error = QString());
+    
 signals:
     void progressChanged(double progress);
     void statusChanged(Status status);
@@ -66,6 +90,7 @@ signals:
     
 private:
     void updateSpeed();
+    int targetIndex(const QString& peerId) const;
     
     QString m_id;
     QString m_fileName;
@@ -80,6 +105,9 @@ private:
     qint64 m_totalFiles;
     qint64 m_currentFile;
     QString m_errorMessage;
+    QList<Target> m_targets;
+    qint64 m_verifiedFiles;
+    qint64 m_uncheckedFiles;
     
     // Speed calculation
     qint64 m_lastSpeedBytes;
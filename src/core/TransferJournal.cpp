@@ -0,0 +1,358 @@
+#include "TransferJournal.h"
+#include <QDir>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+#ifdef Q_OS_WIN
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace Witra {
+
+TransferJournal::TransferJournal(QObject* parent)
+    : QObject(parent)
+    , m_flushTimer(new QTimer(this))
+{
+    QString dataPath = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
+    QDir().mkpath(dataPath);
+    m_path = dataPath + "/transfers.journal";
+    
+    m_flushTimer->setSingleShot(true);
+    m_flushTimer->setInterval(JOURNAL_FLUSH_INTERVAL);
+    connect(m_flushTimer, &QTimer::timeout, this, &TransferJournal::flush);
+}
+
+TransferJournal::~TransferJournal()
+{
+    flush();
+}
+
+void TransferJournal::load()
+{
+    m_entries.clear();
+    
+    QFile file(m_path);
+    if (file.open(QIODevice::ReadOnly)) {
+        while (!file.atEnd()) {
+            // A torn last line from a crash simply fails to parse
+            QJsonDocument doc = QJsonDocument::fromJson(file.readLine());
+            if (doc.isObject()) {
+                applyRecord(doc.object());
+            }
+        }
+        file.close();
+    }
+    
+    compact();
+}
+
+void TransferJournal::flush()
+{
+    m_flushTimer->stop();
+    if (m_pending.isEmpty()) return;
+    
+    if (!m_file.isOpen() && !openForAppend()) return;
+    
+    m_file.write(m_pending);
+    syncToDisk(&m_file);
+    m_pending.clear();
+    
+    if (m_file.size() > JOURNAL_COMPACT_BYTES) {
+        compact();
+    }
+}
+
+JournalFile TransferJournal::partialFile(const QString& transferId,
+                                         const QString& relativePath) const
+{
+    auto it = m_entries.constFind(transferId);
+    if (it == m_entries.constEnd()) return JournalFile();
+    return it->files.value(relativePath);
+}
+
+void TransferJournal::recordOutgoing(const QString& transferId, const QString& peerId,
+                                     const QString& peerName, const QString& sourcePath,
+                                     bool isFolder, qint64 totalSize, qint64 totalFiles)
+{
+    QJsonObject record;
+    record["op"] = "out";
+    record["id"] = transferId;
+    record["peer"] = peerId;
+    record["peerName"] = peerName;
+    record["name"] = QFileInfo(sourcePath).fileName();
+    record["size"] = totalSize;
+    record["files"] = totalFiles;
+    record["src"] = sourcePath;
+    record["folder"] = isFolder;
+    
+    applyRecord(record);
+    appendRecord(record, true);
+}
+
+void TransferJournal::recordFileSent(const QString& transferId, const QString& relativePath)
+{
+    if (!m_entries.contains(transferId)) return;
+    
+    QJsonObject record;
+    record["op"] = "sent";
+    record["id"] = transferId;
+    record["rel"] = relativePath;
+    
+    applyRecord(record);
+    appendRecord(record, false);
+}
+
+void TransferJournal::recordTotals(const QString& transferId, qint64 totalSize, qint64 totalFiles)
+{
+    if (!m_entries.contains(transferId)) return;
+    
+    QJsonObject record;
+    record["op"] = "totals";
+    record["id"] = transferId;
+    record["size"] = totalSize;
+    record["files"] = totalFiles;
+    
+    applyRecord(record);
+    appendRecord(record, false);
+}
+
+void TransferJournal::recordMirror(const QString& transferId, bool propagateDeletes)
+{
+    if (!m_entries.contains(transferId)) return;
+    
+    QJsonObject record;
+    record["op"] = "mirror";
+    record["id"] = transferId;
+    record["deletes"] = propagateDeletes;
+    
+    applyRecord(record);
+    appendRecord(record, true);
+}
+
+void TransferJournal::recordIncoming(const QString& transferId, const QString& peerId,
+                                     const QString& peerName, const QString& name,
+                                     qint64 totalSize, qint64 totalFiles)
+{
+    QJsonObject record;
+    record["op"] = "in";
+    record["id"] = transferId;
+    record["peer"] = peerId;
+    record["peerName"] = peerName;
+    record["name"] = name;
+    record["size"] = totalSize;
+    record["files"] = totalFiles;
+    
+    applyRecord(record);
+    appendRecord(record, true);
+}
+
+void TransferJournal::recordFileStarted(const QString& transferId, const QString& relativePath,
+                                        const QString& localPath, qint64 size)
+{
+    if (!m_entries.contains(transferId)) return;
+    
+    QJsonObject record;
+    record["op"] = "file";
+    record["id"] = transferId;
+    record["rel"] = relativePath;
+    record["path"] = localPath;
+    record["size"] = size;
+    
+    applyRecord(record);
+    appendRecord(record, false);
+}
+
+void TransferJournal::recordFileProgress(const QString& transferId, const QString& relativePath,
+                                         qint64 offset)
+{
+    if (!m_entries.contains(transferId)) return;
+    
+    QJsonObject record;
+    record["op"] = "at";
+    record["id"] = transferId;
+    record["rel"] = relativePath;
+    record["off"] = offset;
+    
+    applyRecord(record);
+    appendRecord(record, false);
+}
+
+void TransferJournal::recordFileDone(const QString& transferId, const QString& relativePath)
+{
+    if (!m_entries.contains(transferId)) return;
+    
+    QJsonObject record;
+    record["op"] = "fileDone";
+    record["id"] = transferId;
+    record["rel"] = relativePath;
+    
+    applyRecord(record);
+    appendRecord(record, false);
+}
+
+void TransferJournal::recordFinished(const QString& transferId)
+{
+    if (!m_entries.contains(transferId)) return;
+    
+    QJsonObject record;
+    record["op"] = "end";
+    record["id"] = transferId;
+    
+    applyRecord(record);
+    appendRecord(record, true);
+}
+
+bool TransferJournal::syncToDisk(QFileDevice* file)
+{
+    if (!file || !file->isOpen() || !file->flush()) return false;
+    
+    const int fd = file->handle();
+    if (fd < 0) return false;
+    
+#if defined(Q_OS_WIN)
+    return _commit(fd) == 0;
+#elif defined(Q_OS_LINUX)
+    return ::fdatasync(fd) == 0;
+#else
+    return ::fsync(fd) == 0;
+#endif
+}
+
+void TransferJournal::appendRecord(const QJsonObject& record, bool durable)
+{
+    m_pending.append(QJsonDocument(record).toJson(QJsonDocument::Compact));
+    m_pending.append('\n');
+    
+    if (durable || m_pending.size() >= JOURNAL_FLUSH_BYTES) {
+        flush();
+    } else if (!m_flushTimer->isActive()) {
+        m_flushTimer->start();
+    }
+}
+
+void TransferJournal::applyRecord(const QJsonObject& record)
+{
+    const QString op = record["op"].toString();
+    const QString id = record["id"].toString();
+    if (id.isEmpty()) return;
+    
+    if (op == "out" || op == "in") {
+        JournalEntry entry;
+        entry.id = id;
+        entry.outgoing = (op == "out");
+        entry.peerId = record["peer"].toString();
+        entry.peerName = record["peerName"].toString();
+        entry.name = record["name"].toString();
+        entry.totalSize = record["size"].toVariant().toLongLong();
+        entry.totalFiles = record["files"].toVariant().toLongLong();
+        entry.sourcePath = record["src"].toString();
+        entry.isFolder = record["folder"].toBool();
+        m_entries[id] = entry;
+        return;
+    }
+    
+    auto it = m_entries.find(id);
+    if (it == m_entries.end()) return;
+    
+    const QString relativePath = record["rel"].toString();
+    
+    if (op == "file") {
+        JournalFile file;
+        file.localPath = record["path"].toString();
+        file.size = record["size"].toVariant().toLongLong();
+        file.offset = record["off"].toVariant().toLongLong();
+        file.done = record["done"].toBool();
+        it->files[relativePath] = file;
+    } else if (op == "at") {
+        if (it->files.contains(relativePath)) {
+            it->files[relativePath].offset = record["off"].toVariant().toLongLong();
+        }
+    } else if (op == "fileDone") {
+        if (it->files.contains(relativePath)) {
+            JournalFile& file = it->files[relativePath];
+            file.offset = file.size;
+            file.done = true;
+        }
+    } else if (op == "sent") {
+        it->sentFiles.insert(relativePath);
+    } else if (op == "mirror") {
+        it->mirror = true;
+        it->mirrorDeletes = record["deletes"].toBool();
+    } else if (op == "totals") {
+        it->totalSize = record["size"].toVariant().toLongLong();
+        it->totalFiles = record["files"].toVariant().toLongLong();
+    } else if (op == "end") {
+        m_entries.erase(it);
+    }
+}
+
+void TransferJournal::compact()
+{
+    m_pending.clear();
+    m_file.close();
+    
+    // Snapshot of live state only, swapped in atomically
+    QSaveFile snapshot(m_path);
+    if (!snapshot.open(QIODevice::WriteOnly)) return;
+    
+    for (const JournalEntry& entry : m_entries) {
+        QJsonObject intent;
+        intent["op"] = entry.outgoing ? "out" : "in";
+        intent["id"] = entry.id;
+        intent["peer"] = entry.peerId;
+        intent["peerName"] = entry.peerName;
+        intent["name"] = entry.name;
+        intent["size"] = entry.totalSize;
+        intent["files"] = entry.totalFiles;
+        if (entry.outgoing) {
+            intent["src"] = entry.sourcePath;
+            intent["folder"] = entry.isFolder;
+        }
+        snapshot.write(QJsonDocument(intent).toJson(QJsonDocument::Compact) + '\n');
+        
+        for (const QString& relativePath : entry.sentFiles) {
+            QJsonObject sent;
+            sent["op"] = "sent";
+            sent["id"] = entry.id;
+            sent["rel"] = relativePath;
+            snapshot.write(QJsonDocument(sent).toJson(QJsonDocument::Compact) + '\n');
+        }
+        
+        if (entry.mirror) {
+            QJsonObject mirror;
+            mirror["op"] = "mirror";
+            mirror["id"] = entry.id;
+            mirror["deletes"] = entry.mirrorDeletes;
+            snapshot.write(QJsonDocument(mirror).toJson(QJsonDocument::Compact) + '\n');
+        }
+        
+        for (auto it = entry.files.constBegin(); it != entry.files.constEnd(); ++it) {
+            QJsonObject file;
+            file["op"] = "file";
+            file["id"] = entry.id;
+            file["rel"] = it.key();
+            file["path"] = it->localPath;
+            file["size"] = it->size;
+            file["off"] = it->offset;
+            file["done"] = it->done;
+            snapshot.write(QJsonDocument(file).toJson(QJsonDocument::Compact) + '\n');
+        }
+    }
+    
+    syncToDisk(&snapshot);
+    snapshot.commit();
+    
+    openForAppend();
+}
+
+bool TransferJournal::openForAppend()
+{
+    m_file.setFileName(m_path);
+    return m_file.open(QIODevice::WriteOnly | QIODevice::Append);
+}
+
+} // namespace Witra
@@ -0,0 +1,110 @@
+#ifndef TRANSFERJOURNAL_H
+#define TRANSFERJOURNAL_H
+
+#include <QObject>
+#include <QFile>
+#include <QHash>
+#include <QJsonObject>
+#include <QSet>
+#include <QTimer>
+
+namespace Witra {
+
+// Pending journal records are written and fsynced at least this often (ms)
+constexpr int JOURNAL_FLUSH_INTERVAL = 250;
+
+// Receivers checkpoint their write offset at most this often (ms)
+constexpr int JOURNAL_CHECKPOINT_INTERVAL = 1000;
+
+// Pending bytes that force an early flush
+constexpr int JOURNAL_FLUSH_BYTES = 64 * 1024;
+
+// Journal is rewritten with only live entries once it grows past this size
+constexpr qint64 JOURNAL_COMPACT_BYTES = 8 * 1024 * 1024;
+
+// Receive-side state of one file inside an unfinished transfer
+struct JournalFile {
+    QString localPath;
+    qint64 size = 0;
+    qint64 offset = 0;
+    bool done = false;
+};
+
+// Everything needed to pick an unfinished transfer back up after a restart
+struct JournalEntry {
+    QString id;
+    bool outgoing = false;
+    QString peerId;
+    QString peerName;
+    QString name;
+    qint64 totalSize = 0;
+    qint64 totalFiles = 1;
+    
+    // Outgoing only
+    QString sourcePath;
+    bool isFolder = false;
+    bool mirror = false;
+    bool mirrorDeletes = false;
+    QSet<QString> sentFiles; // relative paths
+    
+    // Incoming only, keyed by relative path
+    QHash<QString, JournalFile> files;
+};
+
+// Write-ahead journal of transfer intents, per-file offsets and completions.
+// Intents and completions are made durable immediately; progress records are
+// batched and fsynced on a short timer so they never sit on the data path.
+class TransferJournal : public QObject {
+    Q_OBJECT
+    
+public:
+    explicit TransferJournal(QObject* parent = nullptr);
+    ~TransferJournal();
+    
+    // Replays the journal from disk and compacts it
+    void load();
+    void flush();
+    
+    QString path() const { return m_path; }
+    bool contains(const QString& transferId) const { return m_entries.contains(transferId); }
+    JournalEntry entry(const QString& transferId) const { return m_entries.value(transferId); }
+    QList<JournalEntry> unfinished() const { return m_entries.values(); }
+    JournalFile partialFile(const QString& transferId, const QString& relativePath) const;
+    
+    // Sender side
+    void recordOutgoing(const QString& transferId, const QString& peerId, const QString& peerName,
+                        const QString& sourcePath, bool isFolder, qint64 totalSize, qint64 totalFiles);
+    void recordFileSent(const QString& transferId, const QString& relativePath);
+    void recordTotals(const QString& transferId, qint64 totalSize, qint64 totalFiles);
+    void recordMirror(const QString& transferId, bool propagateDeletes);
+    
+    // Receiver side
+    void recordIncoming(const QString& transferId, const QString& peerId, const QString& peerName,
+                        const QString& name, qint64 totalSize, qint64 totalFiles);
+    void recordFileStarted(const QString& transferId, const QString& relativePath,
+                           const QString& localPath, qint64 size);
+    void recordFileProgress(const QString& transferId, const QString& relativePath, qint64 offset);
+    void recordFileDone(const QString& transferId, const QString& relativePath);
+    
+    // Both sides; drops the entry once the transfer can no longer resume
+    void recordFinished(const QString& transferId);
+    
+    // Flushes a data file all the way to stable storage
+    static bool syncToDisk(QFileDevice* file);
+    
+private:
+    void appendRecord(const QJsonObject& record, bool durable);
+    void applyRecord(const QJsonObject& record);
+    void compact();
+    bool openForAppend();
+    
+    QString m_path;
+    QFile m_file;
+    QByteArray m_pending;
+    QTimer* m_flushTimer;
+    QHash<QString, JournalEntry> m_entries;
+};
+
+} // namespace Witra
+
+#endif // TRANSFERJOURNAL_H
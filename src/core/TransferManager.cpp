@@ -1,9 +1,12 @@
 #include "TransferManager.h"
 #include <QDir>
-#include <QDirIterator>
 #include <QFileInfo>
+#include <QLocale>
 #include <QSettings>
 #include <QStandardPaths>
+#include <QStorageInfo>
+#include <QThreadPool>
+#include <QTimer>
 
 namespace Witra {
 
@@ -12,6 +15,13 @@ TransferManager::TransferManager(PeerManager* peerManager, QObject* parent)
     , m_peerManager(peerManager)
     , m_server(new FileTransferServer(this))
     , m_client(new FileTransferClient(this))
+    , m_pool(new SessionPool(this))
+    , m_history(new TransferHistory(this))
+    , m_journal(new TransferJournal(this))
+    , m_trust(new TrustedPeers(this))
+    , m_pieceStore(new PieceStore(this))
+    , m_contentIndex(new ContentIndex(this))
+    , m_hashCache(new HashCache(this))
     , m_running(false)
 {
     // Load download path from settings (set by installer or user)
@@ -26,6 +36,32 @@ TransferManager::TransferManager(PeerManager* peerManager, QObject* parent)
     
     QDir().mkpath(m_downloadPath);
     
+    // Sessions checkpoint per-file progress into the journal
+    m_server->setJournal(m_journal);
+    m_client->setJournal(m_journal);
+    m_server->setPieceStore(m_pieceStore);
+    m_client->setPieceStore(m_pieceStore);
+    m_pieceStore->load();
+    m_server->setContentIndex(m_contentIndex);
+    m_client->setContentIndex(m_contentIndex);
+    m_contentIndex->load();
+    m_server->setHashCache(m_hashCache);
+    m_client->setHashCache(m_hashCache);
+    m_hashCache->load();
+    
+    // Files already in the download folder are hashed while idle, so they
+    // too can stand in for a file sent again
+    connect(m_hashCache, &HashCache::fileHashed, this,
+            [this](const QString& filePath, const QByteArray& hash) {
+        m_contentIndex->add(hash, filePath);
+    });
+    m_hashCache->setRefreshPath(m_downloadPath);
+    restoreJournaledTransfers();
+    
+    // Resume journaled transfers once their peer shows up again
+    connect(m_peerManager, &PeerManager::peerAdded,
+            this, &TransferManager::onPeerAdded);
+    
     // Server signals
     connect(m_server, &FileTransferServer::connectionRequestReceived,
             this, &TransferManager::onConnectionRequestReceived);
@@ -77,6 +113,20 @@ void TransferManager::setDownloadPath(const QString& path)
     QDir().mkpath(m_downloadPath);
     m_server->setDownloadPath(path);
     m_client->setDownloadPath(path);
+    m_hashCache->setRefreshPath(path);
+}
+
+QList<TransferRecord> TransferManager::archivedTransfers(int offset, int count) const
+{
+    return m_history->records(offset, count);
+}
+
+void TransferManager::clearFinished()
+{
+    const QStringList finished = m_finishedOrder;
+    for (const QString& transferId : finished) {
+        archiveTransfer(transferId);
+    }
 }
 
 void TransferManager::sendConnectionRequest(Peer* peer)
@@ -92,20 +142,35 @@ void TransferManager::sendConnectionRequest(Peer* peer)
     }
 }
 
-void TransferManager::acceptConnectionRequest(TransferSession* session)
+void TransferManager::acceptConnectionRequest(TransferSession* session, bool trust)
 {
     if (!session) return;
     
-    session->sendConnectionAccept();
+    // Trusting the device hands it a token to reconnect with later
+    QString token = trust ? m_trust->trust(session->peerId(), session->peerName()) : QString();
     
-    // Find and update peer
-    Peer* peer = m_peerManager->peer(session->peerId());
-    if (peer) {
-        peer->setState(Peer::ConnectionState::Connected);
-        emit connectionAccepted(peer);
+    // A piece-only connection stays out of the pool and the peer's state
+    if (!session->swarmContent().isEmpty()) {
+        session->sendConnectionAccept(token);
+        attachSwarmSession(session);
+        return;
     }
     
+    // A newly connected peer gets the secret its further pooled sessions
+    // must show, since its peer id alone is public
+    Peer* peer = m_peerManager->peer(session->peerId());
+    QString poolSecret;
+    if (!peer || !peer->isConnected()) {
+        poolSecret = TrustedPeers::newToken();
+        m_poolSecrets.insert(session->peerId(), poolSecret);
+    }
+    session->sendConnectionAccept(token, poolSecret);
     setupSessionConnections(session);
+    
+    // Find and update peer; extra pooled connections leave it as it is
+    if (peer && !peer->isConnected()) {
+        onPeerConnected(peer);
+    }
 }
 
 void TransferManager::rejectConnectionRequest(TransferSession* session)
@@ -113,6 +178,7 @@ void TransferManager::rejectConnectionRequest(TransferSession* session)
     if (!session) return;
     
     session->sendConnectionReject();
+    if (!session->swarmContent().isEmpty()) return;
     
     // Find and update peer
     Peer* peer = m_peerManager->peer(session->peerId());
@@ -157,6 +223,10 @@ void TransferManager::disconnectFromPeer(Peer* peer)
 
 bool TransferManager::hasActiveTransfersWithPeer(const QString& peerId) const
 {
+    for (const FanOutLeg& leg : m_fanOutLegs) {
+        if (leg.peerId == peerId) return true;
+    }
+    
     for (TransferItem* item : m_transfers.values()) {
         if (item->peerId() == peerId) {
             TransferItem::Status status = item->status();
@@ -173,9 +243,6 @@ void TransferManager::sendFiles(Peer* peer, const QStringList& filePaths)
 {
     if (!peer || !peer->isConnected()) return;
     
-    TransferSession* session = getOrCreateSession(peer);
-    if (!session) return;
-    
     for (int i = 0; i < filePaths.size(); ++i) {
         const QString& filePath = filePaths[i];
         QFileInfo fileInfo(filePath);
@@ -186,7 +253,10 @@ void TransferManager::sendFiles(Peer* peer, const QStringList& filePaths)
             // Send as folder
             sendFolder(peer, filePath);
         } else {
-            // Send as file
+            // Send as file, spread over the peer's pooled sessions
+            TransferSession* session = getOrCreateSession(peer);
+            if (!session) return;
+            
             QString transferId = generateUniqueId();
             
             TransferItem* item = new TransferItem(
@@ -200,13 +270,27 @@ void TransferManager::sendFiles(Peer* peer, const QStringList& filePaths)
             m_transfers[transferId] = item;
             emit transferAdded(item);
             
-            session->sendFile(filePath, transferId, QString(), 
-                             filePaths.size(), i + 1);
+            m_journal->recordOutgoing(transferId, peer->id(), peer->displayName(),
+                                      filePath, false, fileInfo.size(), 1);
+            
+            // Each file is its own transfer, so it completes on its own
+            session->sendFile(filePath, transferId);
         }
     }
 }
 
 void TransferManager::sendFolder(Peer* peer, const QString& folderPath)
+{
+    queueFolder(peer, folderPath, false, false);
+}
+
+void TransferManager::mirrorFolder(Peer* peer, const QString& folderPath, bool propagateDeletes)
+{
+    queueFolder(peer, folderPath, true, propagateDeletes);
+}
+
+void TransferManager::queueFolder(Peer* peer, const QString& folderPath, bool mirror,
+                                  bool propagateDeletes)
 {
     if (!peer || !peer->isConnected()) return;
     
@@ -218,29 +302,27 @@ void TransferManager::sendFolder(Peer* peer, const QString& folderPath)
     
     QString transferId = generateUniqueId();
     
-    // Calculate total size
-    qint64 totalSize = 0;
-    qint64 fileCount = 0;
-    QDirIterator it(folderPath, QDir::Files, QDirIterator::Subdirectories);
-    while (it.hasNext()) {
-        it.next();
-        totalSize += it.fileInfo().size();
-        fileCount++;
-    }
-    
+    // Totals fill in from the session's background scan as files go out
     TransferItem* item = new TransferItem(
-        transferId, dir.dirName(), totalSize,
+        transferId, dir.dirName(), 0,
         TransferItem::Direction::Outgoing, peer->id(), this
     );
     item->setFilePath(folderPath);
     item->setPeerName(peer->displayName());
-    item->setTotalFiles(fileCount);
     item->setStatus(TransferItem::Status::InProgress);
     
     m_transfers[transferId] = item;
     emit transferAdded(item);
     
-    session->sendFolder(folderPath, transferId);
+    m_journal->recordOutgoing(transferId, peer->id(), peer->displayName(),
+                              folderPath, true, 0, 0);
+    
+    if (mirror) {
+        m_journal->recordMirror(transferId, propagateDeletes);
+        session->mirrorFolder(folderPath, transferId, propagateDeletes);
+    } else {
+        session->sendFolder(folderPath, transferId);
+    }
 }
 
 void TransferManager::cancelTransfer(const QString& transferId)
@@ -251,13 +333,411 @@ void TransferManager::cancelTransfer(const QString& transferId)
     item->setStatus(TransferItem::Status::Cancelled);
     emit transferUpdated(item);
     
+    // A fan-out runs as one leg per peer
+    QStringList ids(transferId);
+    for (auto it = m_fanOutLegs.begin(); it != m_fanOutLegs.end();) {
+        if (it->itemId == transferId) {
+            ids.append(it.key());
+            it = m_fanOutLegs.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    
     // Find session and cancel
-    for (TransferSession* session : m_server->sessions()) {
-        session->cancelTransfer();
+    QList<TransferSession*> sessions = m_server->sessions() + m_client->sessions();
+    for (TransferSession* session : sessions) {
+        for (const QString& id : ids) {
+            if (session->handlesTransfer(id)) {
+                session->cancelTransfer(id);
+            }
+        }
     }
-    for (TransferSession* session : m_client->sessions()) {
-        session->cancelTransfer();
+    
+    if (SharedChunkStream* stream = m_fanOutStreams.take(transferId)) {
+        stream->deleteLater();
     }
+    
+    // Swarms stop serving and fetching pieces
+    for (auto it = m_swarmSeeds.begin(); it != m_swarmSeeds.end(); ++it) {
+        if (it->itemId == transferId) {
+            m_pieceStore->remove(it.key());
+            m_swarmSeeds.erase(it);
+            break;
+        }
+    }
+    for (SwarmDownload* download : m_swarmDownloads) {
+        if (download->transferId() == transferId) {
+            m_swarmDownloads.remove(download->contentId());
+            m_pieceStore->remove(download->contentId());
+            QFile::remove(item->filePath());
+            download->deleteLater();
+            break;
+        }
+    }
+    
+    markFinished(item);
+}
+
+void TransferManager::sendFilesToPeers(const QList<Peer*>& peers, const QStringList& filePaths)
+{
+    QList<Peer*> targets;
+    for (Peer* peer : peers) {
+        if (peer && peer->isConnected()) {
+            targets.append(peer);
+        }
+    }
+    
+    if (targets.isEmpty()) return;
+    if (targets.size() == 1) {
+        sendFiles(targets.first(), filePaths);
+        return;
+    }
+    
+    for (const QString& filePath : filePaths) {
+        QFileInfo fileInfo(filePath);
+        if (!fileInfo.exists()) continue;
+        
+        // Folders go to each peer on their own
+        if (fileInfo.isDir()) {
+            for (Peer* peer : targets) {
+                sendFolder(peer, filePath);
+            }
+            continue;
+        }
+        
+        SharedChunkStream* stream = new SharedChunkStream(filePath, this);
+        if (!stream->open()) {
+            delete stream;
+            emit error(tr("Cannot open file: %1").arg(filePath));
+            continue;
+        }
+        
+        QString transferId = generateUniqueId();
+        
+        TransferItem* item = new TransferItem(
+            transferId, fileInfo.fileName(), fileInfo.size(),
+            TransferItem::Direction::Outgoing, QString(), this
+        );
+        item->setFilePath(filePath);
+        item->setPeerName(tr("%1 devices").arg(targets.size()));
+        item->setStatus(TransferItem::Status::InProgress);
+        
+        // Every leg reads from the same stream, so the file is read once
+        for (Peer* peer : targets) {
+            TransferSession* session = getOrCreateSession(peer);
+            if (!session) continue;
+            
+            QString legId = generateUniqueId();
+            item->addTarget(peer->id(), peer->displayName());
+            m_fanOutLegs[legId] = FanOutLeg{transferId, peer->id()};
+            session->sendShared(stream, legId);
+        }
+        
+        if (!item->isFanOut()) {
+            item->setStatus(TransferItem::Status::Failed);
+            item->setErrorMessage(tr("No connection to any device"));
+        }
+        
+        m_transfers[transferId] = item;
+        m_fanOutStreams[transferId] = stream;
+        emit transferAdded(item);
+        
+        if (!item->isFanOut()) {
+            m_fanOutStreams.remove(transferId);
+            stream->deleteLater();
+            markFinished(item);
+        }
+    }
+}
+
+void TransferManager::sendSwarm(const QList<Peer*>& peers, const QString& filePath)
+{
+    QFileInfo fileInfo(filePath);
+    if (!fileInfo.isFile()) return;
+    
+    QString transferId = generateUniqueId();
+    
+    TransferItem* item = new TransferItem(
+        transferId, fileInfo.fileName(), fileInfo.size(),
+        TransferItem::Direction::Outgoing, QString(), this
+    );
+    item->setFilePath(filePath);
+    
+    for (Peer* peer : peers) {
+        if (peer && peer->isConnected()) {
+            item->addTarget(peer->id(), peer->displayName());
+        }
+    }
+    if (!item->isFanOut()) {
+        delete item;
+        return;
+    }
+    
+    item->setPeerName(tr("%1 devices").arg(item->targets().size()));
+    m_transfers[transferId] = item;
+    emit transferAdded(item);
+    
+    // Hashing every piece reads the whole file; keep it off the GUI thread
+    QPointer<TransferManager> self(this);
+    QThreadPool::globalInstance()->start([self, transferId, filePath]() {
+        PieceManifest manifest = PieceManifest::fromFile(filePath);
+        if (!self) return;
+        QMetaObject::invokeMethod(self.data(), [self, transferId, manifest]() {
+            if (self) self->startSwarm(transferId, manifest);
+        }, Qt::QueuedConnection);
+    });
+}
+
+void TransferManager::startSwarm(const QString& transferId, PieceManifest manifest)
+{
+    TransferItem* item = m_transfers.value(transferId, nullptr);
+    if (!item || item->status() != TransferItem::Status::Pending) return;
+    
+    if (!manifest.isValid()) {
+        item->setStatus(TransferItem::Status::Failed);
+        item->setErrorMessage(tr("Cannot read file: %1").arg(item->filePath()));
+        emit transferUpdated(item);
+        markFinished(item);
+        return;
+    }
+    
+    manifest.swarm.append(m_peerManager->peerId());
+    for (const TransferItem::Target& target : item->targets()) {
+        manifest.swarm.append(target.peerId);
+    }
+    
+    m_pieceStore->addComplete(manifest, item->filePath());
+    m_swarmSeeds[manifest.contentId].itemId = transferId;
+    
+    item->setStatus(TransferItem::Status::InProgress);
+    emit transferUpdated(item);
+    
+    // Receivers pull pieces from us and from each other; we only offer
+    for (const TransferItem::Target& target : item->targets()) {
+        Peer* peer = m_peerManager->peer(target.peerId);
+        TransferSession* session = (peer && peer->isConnected()) ? getOrCreateSession(peer) : nullptr;
+        if (!session) {
+            item->setTargetStatus(target.peerId, TransferItem::Status::Failed, tr("Not connected"));
+            continue;
+        }
+        
+        session->sendSwarmManifest(transferId, manifest.toJson());
+        session->advertisePieces(manifest.contentId,
+                                 PieceStore::packBits(m_pieceStore->pieces(manifest.contentId)));
+    }
+    
+    updateSwarmTarget(manifest.contentId, QString(), QByteArray(), QList<int>());
+}
+
+void TransferManager::onSwarmOffered(const QString& transferId, const QJsonObject& json)
+{
+    TransferSession* session = qobject_cast<TransferSession*>(sender());
+    if (!session) return;
+    
+    PieceManifest manifest = PieceManifest::fromJson(json);
+    if (!manifest.isValid()) return;
+    
+    // Already held in full from an earlier transfer: nothing to fetch, and
+    // telling the sender lets it count us done
+    if (m_pieceStore->isComplete(manifest.contentId)) {
+        session->advertisePieces(manifest.contentId,
+                                 PieceStore::packBits(m_pieceStore->pieces(manifest.contentId)));
+        return;
+    }
+    if (m_pieceStore->contains(manifest.contentId)) return;
+    
+    // The file is laid out at full size up front, so it must fit first
+    const QStorageInfo storage(QDir(m_downloadPath).exists() ? m_downloadPath : QDir::homePath());
+    if (storage.isValid() && manifest.fileSize > storage.bytesAvailable()) {
+        emit error(tr("Not enough free space for %1: %2 needed, %3 available")
+                       .arg(manifest.fileName)
+                       .arg(QLocale().formattedDataSize(manifest.fileSize))
+                       .arg(QLocale().formattedDataSize(storage.bytesAvailable())));
+        return;
+    }
+    
+    QString filePath = uniqueDownloadPath(manifest.fileName);
+    if (!m_pieceStore->addPartial(manifest, filePath)) {
+        emit error(tr("Cannot create file: %1").arg(filePath));
+        return;
+    }
+    
+    TransferItem* item = new TransferItem(
+        transferId, manifest.fileName, manifest.fileSize,
+        TransferItem::Direction::Incoming, session->peerId(), this
+    );
+    item->setFilePath(filePath);
+    item->setPeerName(session->peerName());
+    item->setStatus(TransferItem::Status::InProgress);
+    
+    m_transfers[transferId] = item;
+    emit transferAdded(item);
+    
+    SwarmDownload* download = new SwarmDownload(transferId, manifest, m_pieceStore, this);
+    m_swarmDownloads[manifest.contentId] = download;
+    
+    connect(download, &SwarmDownload::progress, this,
+            [this](const QString& id, qint64 done, qint64 total) {
+        onSessionTransferProgress(id, done, total);
+    });
+    connect(download, &SwarmDownload::completed, this, [this, download](const QString& id) {
+        m_swarmDownloads.remove(download->contentId());
+        download->deleteLater();
+        onSessionTransferCompleted(id);
+    });
+    
+    download->markQueried(session->peerId());
+    download->addSource(session);
+    
+    // Besides the other receivers, any device on the network may already
+    // hold the same content and can serve a share of the pieces
+    for (Peer* peer : m_peerManager->peers()) {
+        querySwarmSource(download, peer);
+    }
+}
+
+void TransferManager::querySwarmSource(SwarmDownload* download, Peer* peer)
+{
+    if (!peer || peer->id() == m_peerManager->peerId()) return;
+    
+    // The content id is all it takes to fetch the file, so it is only
+    // shown to devices we already deal with
+    if (!peer->isConnected() && !m_trust->isTrusted(peer->id()) &&
+        !isSwarmMember(download->contentId(), peer->id())) {
+        return;
+    }
+    if (!download->markQueried(peer->id())) return;
+    
+    // A piece-only connection doubles as the lookup: only holders accept it
+    TransferSession* swarmSession = m_client->connectToPeer(peer->address(), peer->port());
+    if (swarmSession) {
+        swarmSession->setPeerId(peer->id());
+        swarmSession->setPeerName(peer->displayName());
+        swarmSession->setSwarmContent(download->contentId());
+    }
+}
+
+bool TransferManager::isSwarmMember(const QString& contentId, const QString& peerId) const
+{
+    return !peerId.isEmpty() && m_pieceStore->contains(contentId) &&
+           m_pieceStore->manifest(contentId).swarm.contains(peerId);
+}
+
+void TransferManager::attachSwarmSession(TransferSession* session)
+{
+    connect(session, &TransferSession::piecesAdvertised,
+            this, &TransferManager::onPiecesAdvertised);
+    connect(session, &TransferSession::pieceReceived,
+            this, &TransferManager::onPieceReceived);
+    connect(session, &TransferSession::disconnected, this, [this, session]() {
+        for (SwarmDownload* download : m_swarmDownloads) {
+            download->removeSource(session);
+        }
+    });
+    
+    const QString contentId = session->swarmContent();
+    if (SwarmDownload* download = m_swarmDownloads.value(contentId, nullptr)) {
+        download->addSource(session);
+    } else {
+        // Finished or seeding: everything is on offer
+        session->advertisePieces(contentId, PieceStore::packBits(m_pieceStore->pieces(contentId)));
+    }
+}
+
+void TransferManager::onPiecesAdvertised(const QString& contentId, const QByteArray& bitfield,
+                                         const QList<int>& added)
+{
+    TransferSession* session = qobject_cast<TransferSession*>(sender());
+    if (!session) return;
+    
+    if (SwarmDownload* download = m_swarmDownloads.value(contentId, nullptr)) {
+        download->updateSource(session, bitfield, added);
+    }
+    
+    // Receivers announce pieces to us too, which is how the seed sees progress
+    if (m_swarmSeeds.contains(contentId)) {
+        updateSwarmTarget(contentId, session->peerId(), bitfield, added);
+    }
+}
+
+void TransferManager::onPieceReceived(const QString& contentId, int index, const QByteArray& data)
+{
+    TransferSession* session = qobject_cast<TransferSession*>(sender());
+    SwarmDownload* download = m_swarmDownloads.value(contentId, nullptr);
+    if (session && download) {
+        download->receivePiece(session, index, data);
+    }
+}
+
+void TransferManager::updateSwarmTarget(const QString& contentId, const QString& peerId,
+                                        const QByteArray& bitfield, const QList<int>& added)
+{
+    SwarmSeed& seed = m_swarmSeeds[contentId];
+    TransferItem* item = m_transfers.value(seed.itemId, nullptr);
+    if (!item) return;
+    
+    if (item->hasTarget(peerId)) {
+        const PieceManifest manifest = m_pieceStore->manifest(contentId);
+        QBitArray& pieces = seed.targetPieces[peerId];
+        if (pieces.size() != manifest.pieceCount()) {
+            pieces = QBitArray(manifest.pieceCount());
+        }
+        
+        if (!bitfield.isEmpty()) {
+            pieces = PieceStore::unpackBits(bitfield, manifest.pieceCount());
+        }
+        for (int index : added) {
+            if (index >= 0 && index < pieces.size()) pieces.setBit(index);
+        }
+        
+        qint64 held = 0;
+        for (int i = 0; i < pieces.size(); ++i) {
+            if (pieces.testBit(i)) held += manifest.pieceLength(i);
+        }
+        item->setTargetProgress(peerId, held);
+        if (held == manifest.fileSize) {
+            item->setTargetStatus(peerId, TransferItem::Status::Completed);
+        }
+    }
+    
+    if (item->finishedTargets() < item->targets().size()) {
+        emit transferUpdated(item);
+        return;
+    }
+    
+    // Every receiver holds the whole file; keep serving late requests
+    int failed = 0;
+    for (const TransferItem::Target& target : item->targets()) {
+        if (target.status != TransferItem::Status::Completed) ++failed;
+    }
+    
+    if (failed == 0) {
+        item->setStatus(TransferItem::Status::Completed);
+    } else {
+        item->setStatus(TransferItem::Status::Failed);
+        item->setErrorMessage(tr("%1 of %2 devices failed").arg(failed).arg(item->targets().size()));
+    }
+    emit transferUpdated(item);
+    markFinished(item);
+    seed.itemId.clear();
+}
+
+QString TransferManager::uniqueDownloadPath(const QString& fileName) const
+{
+    QDir destDir(m_downloadPath);
+    QString filePath = destDir.absoluteFilePath(fileName);
+    
+    QFileInfo fileInfo(filePath);
+    int counter = 1;
+    while (QFile::exists(filePath)) {
+        filePath = destDir.absoluteFilePath(
+            QString("%1 (%2).%3").arg(fileInfo.baseName())
+                                 .arg(counter++)
+                                 .arg(fileInfo.suffix())
+        );
+    }
+    return filePath;
 }
 
 void TransferManager::onConnectionRequestReceived(TransferSession* session, 
@@ -267,6 +747,40 @@ void TransferManager::onConnectionRequestReceived(TransferSession* session,
     QString peerId = session->peerId();
     Peer* peer = m_peerManager->peer(peerId);
     
+    // Piece-only connection for a swarm we hold. A connected or trusted
+    // device proves who it is; a member of the swarm is taken at its word.
+    // Anyone else is asked about like any new device
+    const QString contentId = session->swarmContent();
+    if (!contentId.isEmpty()) {
+        if (!m_pieceStore->contains(contentId)) {
+            session->sendConnectionReject();
+        } else if ((peer && peer->isConnected() &&
+                    TrustedPeers::tokensMatch(m_poolSecrets.value(peerId), session->poolSecret())) ||
+                   m_trust->verify(peerId, session->token()) || isSwarmMember(contentId, peerId)) {
+            session->sendConnectionAccept();
+            attachSwarmSession(session);
+        } else {
+            emit connectionRequestReceived(session, senderName);
+        }
+        return;
+    }
+    
+    // Additional pooled connection from a peer the user already accepted,
+    // showing the secret issued with that accept, or a trusted device
+    // reconnecting with the token we issued it
+    const bool pooled = peer && peer->isConnected() &&
+                        TrustedPeers::tokensMatch(m_poolSecrets.value(peerId), session->poolSecret());
+    if (pooled || m_trust->verify(peerId, session->token())) {
+        acceptConnectionRequest(session);
+        return;
+    }
+    
+    // A token we no longer honour; the device falls back to asking
+    if (!session->token().isEmpty()) {
+        session->sendConnectionReject();
+        return;
+    }
+    
     if (peer) {
         peer->setState(Peer::ConnectionState::RequestReceived);
     }
@@ -276,25 +790,71 @@ void TransferManager::onConnectionRequestReceived(TransferSession* session,
 
 void TransferManager::onOutgoingConnectionReady(TransferSession* session)
 {
-    // Send connection request
-    session->sendConnectionRequest(m_peerManager->displayName(), m_peerManager->peerId());
+    // Piece-only connections stay out of the pool and the peer's state
+    if (!session->swarmContent().isEmpty()) {
+        session->sendConnectionRequest(m_peerManager->displayName(), m_peerManager->peerId(),
+                                       m_trust->reconnectToken(session->peerId()),
+                                       m_poolSecrets.value(session->peerId()));
+        connect(session, &TransferSession::connectionAccepted,
+                this, [this, session]() { attachSwarmSession(session); });
+        connect(session, &TransferSession::connectionRejected,
+                session, &TransferSession::disconnectFromPeer);
+        return;
+    }
     
-    connect(session, &TransferSession::connectionAccepted, this, [this, session]() {
+    // Send connection request, with our token if the peer trusts us
+    const QString token = m_trust->reconnectToken(session->peerId());
+    session->sendConnectionRequest(m_peerManager->displayName(), m_peerManager->peerId(), token,
+                                   m_poolSecrets.value(session->peerId()));
+    
+    auto onAccepted = [this, session]() {
+        setupSessionConnections(session);
         Peer* peer = m_peerManager->peer(session->peerId());
-        if (peer) {
-            peer->setState(Peer::ConnectionState::Connected);
-            emit connectionAccepted(peer);
+        if (peer && !peer->isConnected()) {
+            onPeerConnected(peer);
+        }
+    };
+    
+    if (token.isEmpty()) {
+        connect(session, &TransferSession::connectionAccepted, this, onAccepted);
+    } else {
+        // Trusted reconnect: treat the session as accepted right away so
+        // resumed files go out behind the request without a round trip
+        onAccepted();
+    }
+    
+    connect(session, &TransferSession::connectionAccepted, this, [this, session]() {
+        if (!session->token().isEmpty()) {
+            m_trust->setReconnectToken(session->peerId(), session->peerName(), session->token());
+        }
+        if (!session->poolSecret().isEmpty()) {
+            m_poolSecrets.insert(session->peerId(), session->poolSecret());
         }
-        setupSessionConnections(session);
     });
     
-    connect(session, &TransferSession::connectionRejected, this, [this, session]() {
-        Peer* peer = m_peerManager->peer(session->peerId());
+    connect(session, &TransferSession::connectionRejected, this, [this, session, token]() {
+        QString peerId = session->peerId();
+        Peer* peer = m_peerManager->peer(peerId);
+        m_pendingRequests.remove(peerId);
+        
+        if (!token.isEmpty()) {
+            // Our token was refused; keep what was in flight resumable and
+            // ask again the ordinary way
+            m_trust->forgetReconnectToken(peerId);
+            failSessionTransfers(session, tr("Waiting for the peer to accept again"));
+            session->disconnectFromPeer();
+            
+            if (peer && peer->state() != Peer::ConnectionState::RequestSent) {
+                peer->setState(Peer::ConnectionState::Discovered);
+                sendConnectionRequest(peer);
+            }
+            return;
+        }
+        
         if (peer) {
             peer->setState(Peer::ConnectionState::Discovered);
             emit connectionRejected(peer);
         }
-        m_pendingRequests.remove(session->peerId());
     });
 }
 
@@ -309,12 +869,40 @@ void TransferManager::setupSessionConnections(TransferSession* session)
             this, &TransferManager::onSessionTransferStarted);
     connect(session, &TransferSession::transferProgress,
             this, &TransferManager::onSessionTransferProgress);
+    connect(session, &TransferSession::fileChecked,
+            this, &TransferManager::onSessionFileChecked);
     connect(session, &TransferSession::transferCompleted,
             this, &TransferManager::onSessionTransferCompleted);
     connect(session, &TransferSession::transferFailed,
             this, &TransferManager::onSessionTransferFailed);
+    connect(session, &TransferSession::resumeRequested,
+            this, &TransferManager::onSessionResumeRequested);
+    connect(session, &TransferSession::folderScanProgress,
+            this, &TransferManager::onFolderScanProgress);
+    connect(session, &TransferSession::folderManifestReceived,
+            this, &TransferManager::onFolderManifestReceived);
+    connect(session, &TransferSession::swarmOffered,
+            this, &TransferManager::onSwarmOffered);
+    connect(session, &TransferSession::piecesAdvertised,
+            this, &TransferManager::onPiecesAdvertised);
+    connect(session, &TransferSession::pieceReceived,
+            this, &TransferManager::onPieceReceived);
     connect(session, &TransferSession::disconnected,
             this, [this, session]() { onSessionDisconnected(session); });
+    connect(session, &TransferSession::linkMeasured,
+            this, [this, session]() { onSessionLinkMeasured(session); });
+    
+    m_pool->add(session);
+    onSessionLinkMeasured(session);
+}
+
+void TransferManager::onSessionLinkMeasured(TransferSession* session)
+{
+    Peer* peer = m_peerManager->peer(session->peerId());
+    const qint64 rate = session->linkProfile().sendRate;
+    if (peer && rate > 0) {
+        peer->setExpectedRate(rate);
+    }
 }
 
 void TransferManager::onSessionTransferStarted(const QString& transferId, 
@@ -324,6 +912,24 @@ void TransferManager::onSessionTransferStarted(const QString& transferId,
     TransferSession* session = qobject_cast<TransferSession*>(sender());
     if (!session) return;
     
+    // Every file of a folder announces itself, and resumed transfers come
+    // back from a restored or failed state; reuse the existing item
+    TransferItem* existing = m_transfers.value(transferId, nullptr);
+    if (existing) {
+        if (existing->status() != TransferItem::Status::InProgress) {
+            m_finishedOrder.removeAll(transferId);
+            existing->setErrorMessage(QString());
+            existing->setStatus(TransferItem::Status::InProgress);
+        } else {
+            existing->setCurrentFile(existing->currentFile() + 1);
+        }
+        
+        // A folder still being scanned on the sending side keeps growing
+        existing->setTotalFiles(qMax(existing->totalFiles(), totalFiles));
+        emit transferUpdated(existing);
+        return;
+    }
+    
     TransferItem* item = new TransferItem(
         transferId, fileName, totalSize,
         TransferItem::Direction::Incoming, session->peerId(), this
@@ -336,10 +942,72 @@ void TransferManager::onSessionTransferStarted(const QString& transferId,
     emit transferAdded(item);
 }
 
+void TransferManager::onFolderScanProgress(const QString& transferId, qint64 totalFiles,
+                                           qint64 totalSize, bool complete)
+{
+    if (m_fanOutLegs.contains(transferId)) return;
+    
+    TransferItem* item = m_transfers.value(transferId, nullptr);
+    if (!item) return;
+    
+    item->setTotalFiles(totalFiles);
+    item->setTotalSize(totalSize);
+    emit transferUpdated(item);
+    
+    if (complete) {
+        m_journal->recordTotals(transferId, totalSize, totalFiles);
+    }
+}
+
+void TransferManager::onFolderManifestReceived(const QString& transferId, const QString& folderName,
+                                               qint64 totalFiles, qint64 totalSize, bool complete)
+{
+    Q_UNUSED(complete)
+    
+    TransferSession* session = qobject_cast<TransferSession*>(sender());
+    if (!session) return;
+    
+    TransferItem* item = m_transfers.value(transferId, nullptr);
+    if (item) {
+        item->setTotalFiles(totalFiles);
+        item->setTotalSize(totalSize);
+        emit transferUpdated(item);
+        return;
+    }
+    
+    // The manifest runs ahead of the first file, so the folder shows up
+    // under its own name with its real size
+    item = new TransferItem(
+        transferId, folderName, totalSize,
+        TransferItem::Direction::Incoming, session->peerId(), this
+    );
+    item->setPeerName(session->peerName());
+    item->setTotalFiles(totalFiles);
+    item->setCurrentFile(0);
+    item->setStatus(TransferItem::Status::InProgress);
+    
+    m_transfers[transferId] = item;
+    emit transferAdded(item);
+}
+
 void TransferManager::onSessionTransferProgress(const QString& transferId,
                                                  qint64 received, qint64 total)
 {
     Q_UNUSED(total)
+    
+    // Background hashing keeps off the disk while data is moving
+    m_hashCache->noteActivity();
+    
+    if (m_fanOutLegs.contains(transferId)) {
+        const FanOutLeg leg = m_fanOutLegs.value(transferId);
+        TransferItem* item = m_transfers.value(leg.itemId, nullptr);
+        if (item) {
+            item->setTargetProgress(leg.peerId, received);
+            emit transferUpdated(item);
+        }
+        return;
+    }
+    
     TransferItem* item = m_transfers.value(transferId, nullptr);
     if (item) {
         item->setTransferredSize(received);
@@ -347,41 +1015,89 @@ void TransferManager::onSessionTransferProgress(const QString& transferId,
     }
 }
 
+void TransferManager::onSessionFileChecked(const QString& transferId, bool verified)
+{
+    TransferItem* item = m_transfers.value(transferId, nullptr);
+    if (item) {
+        item->addCheckedFile(verified);
+    }
+}
+
 void TransferManager::onSessionTransferCompleted(const QString& transferId)
 {
+    if (m_fanOutLegs.contains(transferId)) {
+        finishFanOutLeg(transferId, TransferItem::Status::Completed);
+        return;
+    }
+    
     TransferItem* item = m_transfers.value(transferId, nullptr);
     if (item) {
         item->setStatus(TransferItem::Status::Completed);
         emit transferUpdated(item);
+        markFinished(item);
     }
 }
 
 void TransferManager::onSessionTransferFailed(const QString& transferId, 
                                                const QString& error)
 {
+    if (m_fanOutLegs.contains(transferId)) {
+        finishFanOutLeg(transferId, TransferItem::Status::Failed, error);
+        return;
+    }
+    
     TransferItem* item = m_transfers.value(transferId, nullptr);
     if (item) {
         item->setStatus(TransferItem::Status::Failed);
         item->setErrorMessage(error);
         emit transferUpdated(item);
+        markFinished(item);
     }
 }
 
 TransferSession* TransferManager::getOrCreateSession(Peer* peer)
 {
-    // Check if we already have a session
-    TransferSession* session = m_client->sessionByPeerId(peer->id());
-    if (session) return session;
+    // Reuse an established connection so the first byte needs no handshake
+    TransferSession* session = m_pool->acquire(peer->id());
+    if (session) {
+        prewarmSessions(peer);
+        return session;
+    }
     
-    // Check server sessions
-    for (TransferSession* s : m_server->sessions()) {
-        if (s->peerId() == peer->id()) {
-            return s;
-        }
+    // Nothing pooled yet; files queue on the new session until it is accepted
+    return openSession(peer);
+}
+
+TransferSession* TransferManager::openSession(Peer* peer)
+{
+    TransferSession* session = m_client->connectToPeer(peer->address(), peer->port());
+    if (session) {
+        session->setPeerId(peer->id());
+        session->setPeerName(peer->displayName());
+        m_pool->addPending(peer->id(), session);
     }
+    return session;
+}
+
+void TransferManager::prewarmSessions(Peer* peer)
+{
+    while (peer->isConnected() && m_pool->needsWarmSession(peer->id())) {
+        if (!openSession(peer)) break;
+    }
+}
+
+void TransferManager::onPeerConnected(Peer* peer)
+{
+    peer->setState(Peer::ConnectionState::Connected);
+    emit connectionAccepted(peer);
+    
+    resumeTransfersWithPeer(peer);
+    prewarmSessions(peer);
     
-    // Create new connection
-    return m_client->connectToPeer(peer->address(), peer->port());
+    // Now one we deal with, it may hold pieces of what we are fetching
+    for (SwarmDownload* download : m_swarmDownloads) {
+        querySwarmSource(download, peer);
+    }
 }
 
 void TransferManager::onSessionDisconnected(TransferSession* session)
@@ -396,17 +1112,248 @@ void TransferManager::onSessionDisconnected(TransferSession* session)
     // Remove from pending requests
     m_pendingRequests.remove(peerId);
     
-    // Mark any active transfers with this peer as failed
+    // Pieces requested from it go back to the other sources; a download
+    // left with none cannot finish
+    const QList<SwarmDownload*> downloads = m_swarmDownloads.values();
+    for (SwarmDownload* download : downloads) {
+        const int sources = download->sourceCount();
+        download->removeSource(session);
+        if (sources > 0 && download->sourceCount() == 0) {
+            m_swarmDownloads.remove(download->contentId());
+            m_pieceStore->remove(download->contentId());
+            download->deleteLater();
+            onSessionTransferFailed(download->transferId(), tr("No sources left"));
+        }
+    }
+    
+    // A receiver gone altogether will not report more pieces to a swarm we seed
+    Peer* peer = m_peerManager->peer(peerId);
+    if (!peerId.isEmpty() && !(peer && peer->isConnected())) {
+        const QStringList seeds = m_swarmSeeds.keys();
+        for (const QString& contentId : seeds) {
+            TransferItem* item = m_transfers.value(m_swarmSeeds.value(contentId).itemId, nullptr);
+            if (!item || item->status() != TransferItem::Status::InProgress) continue;
+            
+            for (const TransferItem::Target& target : item->targets()) {
+                if (target.peerId == peerId && target.status == TransferItem::Status::InProgress) {
+                    item->setTargetStatus(peerId, TransferItem::Status::Failed, tr("Connection lost"));
+                    updateSwarmTarget(contentId, QString(), QByteArray(), QList<int>());
+                }
+            }
+        }
+    }
+    
+    // Mark the transfers this session carried as failed
+    int interrupted = failSessionTransfers(session, tr("Connection lost"));
+    
+    // A trusted link that dropped mid-transfer comes back on its own
+    if (interrupted > 0 && !m_trust->reconnectToken(peerId).isEmpty()) {
+        QTimer::singleShot(TRUSTED_RECONNECT_DELAY, this, [this, peerId]() {
+            Peer* peer = m_peerManager->peer(peerId);
+            if (peer && shouldReconnect(peerId)) {
+                sendConnectionRequest(peer);
+            }
+        });
+    }
+}
+
+int TransferManager::failSessionTransfers(TransferSession* session, const QString& error)
+{
+    int failed = 0;
+    
+    // Fan-out legs are not resumable; the other targets carry on
+    for (const QString& legId : m_fanOutLegs.keys()) {
+        if (session->handlesTransfer(legId)) {
+            finishFanOutLeg(legId, TransferItem::Status::Failed, error);
+        }
+    }
+    
     for (TransferItem* item : m_transfers.values()) {
-        if (item->peerId() == peerId) {
+        if (item->peerId() == session->peerId() && session->handlesTransfer(item->id())) {
             if (item->status() == TransferItem::Status::InProgress ||
                 item->status() == TransferItem::Status::Pending) {
                 item->setStatus(TransferItem::Status::Failed);
-                item->setErrorMessage(tr("Connection lost"));
+                item->setErrorMessage(error);
                 emit transferUpdated(item);
+                markFinished(item, true);
+                ++failed;
             }
         }
     }
+    
+    return failed;
+}
+
+void TransferManager::finishFanOutLeg(const QString& legId, TransferItem::Status status,
+                                      const QString& error)
+{
+    const FanOutLeg leg = m_fanOutLegs.take(legId);
+    TransferItem* item = m_transfers.value(leg.itemId, nullptr);
+    if (!item) return;
+    
+    item->setTargetStatus(leg.peerId, status, error);
+    
+    const QList<TransferItem::Target> targets = item->targets();
+    if (item->finishedTargets() < targets.size()) {
+        emit transferUpdated(item);
+        return;
+    }
+    
+    // Last leg done; the shared source is no longer needed
+    if (SharedChunkStream* stream = m_fanOutStreams.take(leg.itemId)) {
+        stream->deleteLater();
+    }
+    
+    int failed = 0;
+    for (const TransferItem::Target& target : targets) {
+        if (target.status != TransferItem::Status::Completed) ++failed;
+    }
+    
+    if (failed == 0) {
+        item->setStatus(TransferItem::Status::Completed);
+    } else {
+        item->setStatus(TransferItem::Status::Failed);
+        item->setErrorMessage(tr("%1 of %2 devices failed").arg(failed).arg(targets.size()));
+    }
+    emit transferUpdated(item);
+    markFinished(item);
+}
+
+bool TransferManager::shouldReconnect(const QString& peerId) const
+{
+    // The sending side reconnects; a receiver can too once the sender trusts it
+    bool trusted = !m_trust->reconnectToken(peerId).isEmpty();
+    
+    for (const JournalEntry& entry : m_journal->unfinished()) {
+        if (entry.peerId == peerId && (entry.outgoing || trusted)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void TransferManager::markFinished(TransferItem* item, bool resumable)
+{
+    // Interrupted transfers stay journaled so they can resume later
+    if (!resumable) {
+        m_journal->recordFinished(item->id());
+    }
+    
+    if (!m_finishedOrder.contains(item->id())) {
+        m_finishedOrder.append(item->id());
+    }
+    
+    // Only the most recent finished transfers stay in memory
+    while (m_finishedOrder.size() > m_history->window()) {
+        archiveTransfer(m_finishedOrder.first());
+    }
+}
+
+void TransferManager::archiveTransfer(const QString& transferId)
+{
+    m_finishedOrder.removeAll(transferId);
+    
+    TransferItem* item = m_transfers.take(transferId);
+    if (!item) return;
+    
+    m_history->append(TransferRecord::fromItem(item));
+    emit transferRemoved(transferId);
+    item->deleteLater();
+}
+
+void TransferManager::restoreJournaledTransfers()
+{
+    m_journal->load();
+    
+    for (const JournalEntry& entry : m_journal->unfinished()) {
+        journaledItem(entry);
+    }
+}
+
+TransferItem* TransferManager::journaledItem(const JournalEntry& entry)
+{
+    TransferItem* item = m_transfers.value(entry.id, nullptr);
+    if (item) return item;
+    
+    item = new TransferItem(
+        entry.id, entry.name, entry.totalSize,
+        entry.outgoing ? TransferItem::Direction::Outgoing : TransferItem::Direction::Incoming,
+        entry.peerId, this
+    );
+    item->setFilePath(entry.sourcePath);
+    item->setPeerName(entry.peerName);
+    item->setTotalFiles(entry.totalFiles);
+    item->setStatus(TransferItem::Status::Pending);
+    
+    m_transfers[entry.id] = item;
+    emit transferAdded(item);
+    return item;
+}
+
+void TransferManager::onPeerAdded(Peer* peer)
+{
+    if (!peer) return;
+    
+    for (SwarmDownload* download : m_swarmDownloads) {
+        querySwarmSource(download, peer);
+    }
+    
+    if (peer->state() != Peer::ConnectionState::Discovered) return;
+    
+    if (shouldReconnect(peer->id())) {
+        sendConnectionRequest(peer);
+    }
+}
+
+void TransferManager::resumeTransfersWithPeer(Peer* peer)
+{
+    for (const JournalEntry& entry : m_journal->unfinished()) {
+        if (entry.peerId != peer->id()) continue;
+        
+        TransferItem* item = m_transfers.value(entry.id, nullptr);
+        if (item && item->status() == TransferItem::Status::InProgress) continue;
+        
+        TransferSession* session = getOrCreateSession(peer);
+        if (!session) return;
+        
+        if (entry.outgoing) {
+            resumeOutgoing(entry, session);
+        } else {
+            session->requestResume(entry.id);
+        }
+    }
+}
+
+void TransferManager::resumeOutgoing(const JournalEntry& entry, TransferSession* session)
+{
+    TransferItem* item = journaledItem(entry);
+    m_finishedOrder.removeAll(entry.id);
+    item->setErrorMessage(QString());
+    item->setStatus(TransferItem::Status::InProgress);
+    emit transferUpdated(item);
+    
+    if (entry.mirror) {
+        session->mirrorFolder(entry.sourcePath, entry.id, entry.mirrorDeletes, true);
+    } else if (entry.isFolder) {
+        session->sendFolder(entry.sourcePath, entry.id, entry.sentFiles, true);
+    } else {
+        session->sendFile(entry.sourcePath, entry.id, QString(), 1, 1, true);
+    }
+}
+
+void TransferManager::onSessionResumeRequested(const QString& transferId)
+{
+    TransferSession* session = qobject_cast<TransferSession*>(sender());
+    if (!session || !m_journal->contains(transferId)) return;
+    
+    JournalEntry entry = m_journal->entry(transferId);
+    if (!entry.outgoing || entry.peerId != session->peerId()) return;
+    
+    // Already picked up from our side
+    TransferItem* item = m_transfers.value(transferId, nullptr);
+    if (item && item->status() == TransferItem::Status::InProgress) return;
+    
+    resumeOutgoing(entry, session);
 }
 
 void TransferManager::updatePeerStateOnDisconnect(const QString& peerId)
@@ -438,9 +1385,11 @@ void TransferManager::updatePeerStateOnDisconnect(const QString& peerId)
             }
         }
         
-        // If no more sessions, revert to Discovered state
+        // If no more sessions, revert to Discovered state; the next
+        // connection is accepted afresh and gets a new pool secret
         if (!hasOtherSessions) {
             peer->setState(Peer::ConnectionState::Discovered);
+            m_poolSecrets.remove(peerId);
         }
     }
 }
@@ -4,9 +4,18 @@
 #include <QObject>
 #include <QMap>
 #include "TransferItem.h"
+#include "TransferHistory.h"
+#include "TransferJournal.h"
+#include "TrustedPeers.h"
+#include "PieceStore.h"
+#include "ContentIndex.h"
+#include "HashCache.h"
+#include "SwarmDownload.h"
 #include "PeerManager.h"
 #include "network/FileTransferServer.h"
 #include "network/FileTransferClient.h"
+#include "network/SessionPool.h"
+#include "network/SharedChunkStream.h"
 
 namespace Witra {
 
@@ -29,16 +38,38 @@ public:
     QList<TransferItem*> transfers() const { return m_transfers.values(); }
     TransferItem* transfer(const QString& id) const { return m_transfers.value(id, nullptr); }
     
+    // History
+    TransferHistory* history() const { return m_history; }
+    QList<TransferRecord> archivedTransfers(int offset, int count) const;
+    void clearFinished();
+    
     // Connection management
     void sendConnectionRequest(Peer* peer);
-    void acceptConnectionRequest(TransferSession* session);
+    void acceptConnectionRequest(TransferSession* session, bool trust = false);
     void rejectConnectionRequest(TransferSession* session);
     void disconnectFromPeer(Peer* peer);
     bool hasActiveTransfersWithPeer(const QString& peerId) const;
     
+    // Devices that reconnect without asking
+    TrustedPeers* trustedPeers() const { return m_trust; }
+    
+    // Connection pool
+    SessionPool* sessionPool() const { return m_pool; }
+    
     // File operations
     void sendFiles(Peer* peer, const QStringList& filePaths);
     void sendFolder(Peer* peer, const QString& folderPath);
+    
+    // Brings the peer's copy of a folder up to date, sending only new and
+    // changed files and optionally removing files deleted here
+    void mirrorFolder(Peer* peer, const QString& folderPath, bool propagateDeletes);
+    
+    // Sends each file to several peers at once, reading it from disk only once
+    void sendFilesToPeers(const QList<Peer*>& peers, const QStringList& filePaths);
+    
+    // Sends a file to several peers as hash-identified pieces that the
+    // receivers also serve to each other
+    void sendSwarm(const QList<Peer*>& peers, const QString& filePath);
     void cancelTransfer(const QString& transferId);
     
 signals:
@@ -55,22 +86,84 @@ private slots:
     void onOutgoingConnectionReady(TransferSession* session);
     void onOutgoingConnectionFailed(const QString& error);
     void onSessionDisconnected(TransferSession* session);
+    void onSessionLinkMeasured(TransferSession* session);
     void onSessionTransferStarted(const QString& transferId, const QString& fileName,
                                   qint64 totalSize, qint64 totalFiles);
     void onSessionTransferProgress(const QString& transferId, qint64 received, qint64 total);
+    void onFolderScanProgress(const QString& transferId, qint64 totalFiles, qint64 totalSize,
+                              bool complete);
+    void onFolderManifestReceived(const QString& transferId, const QString& folderName,
+                                  qint64 totalFiles, qint64 totalSize, bool complete);
+    void onSessionFileChecked(const QString& transferId, bool verified);
     void onSessionTransferCompleted(const QString& transferId);
     void onSessionTransferFailed(const QString& transferId, const QString& error);
+    void onSessionResumeRequested(const QString& transferId);
+    void onPeerAdded(Peer* peer);
+    void onSwarmOffered(const QString& transferId, const QJsonObject& manifest);
+    void onPiecesAdvertised(const QString& contentId, const QByteArray& bitfield,
+                            const QList<int>& added);
+    void onPieceReceived(const QString& contentId, int index, const QByteArray& data);
     
 private:
     void setupSessionConnections(TransferSession* session);
     TransferSession* getOrCreateSession(Peer* peer);
+    TransferSession* openSession(Peer* peer);
+    void prewarmSessions(Peer* peer);
+    void onPeerConnected(Peer* peer);
     void updatePeerStateOnDisconnect(const QString& peerId);
+    int failSessionTransfers(TransferSession* session, const QString& error);
+    bool shouldReconnect(const QString& peerId) const;
+    void finishFanOutLeg(const QString& legId, TransferItem::Status status,
+                         const QString& error = QString());
+    
+    // Swarm
+    void startSwarm(const QString& transferId, PieceManifest manifest);
+    void attachSwarmSession(TransferSession* session);
+    void querySwarmSource(SwarmDownload* download, Peer* peer);
+    bool isSwarmMember(const QString& contentId, const QString& peerId) const;
+    void queueFolder(Peer* peer, const QString& folderPath, bool mirror, bool propagateDeletes);
+    void updateSwarmTarget(const QString& contentId, const QString& peerId,
+                           const QByteArray& bitfield, const QList<int>& added);
+    QString uniqueDownloadPath(const QString& fileName) const;
+    void markFinished(TransferItem* item, bool resumable = false);
+    void archiveTransfer(const QString& transferId);
+    
+    // Journal replay and resume
+    void restoreJournaledTransfers();
+    TransferItem* journaledItem(const JournalEntry& entry);
+    void resumeTransfersWithPeer(Peer* peer);
+    void resumeOutgoing(const JournalEntry& entry, TransferSession* session);
     
     PeerManager* m_peerManager;
     FileTransferServer* m_server;
     FileTransferClient* m_client;
+    SessionPool* m_pool;
     QMap<QString, TransferItem*> m_transfers;
+    QStringList m_finishedOrder; // oldest finished transfer first
+    TransferHistory* m_history;
+    TransferJournal* m_journal;
+    TrustedPeers* m_trust;
     QMap<QString, TransferSession*> m_pendingRequests; // peerId -> session
+    QHash<QString, QString> m_poolSecrets; // peer id -> secret its extra pooled sessions present
+    
+    // Each fan-out target is its own transfer on the wire
+    struct FanOutLeg {
+        QString itemId;
+        QString peerId;
+    };
+    QHash<QString, FanOutLeg> m_fanOutLegs; // leg transfer id -> fan-out item
+    QHash<QString, SharedChunkStream*> m_fanOutStreams; // item id -> shared source
+    
+    // Swarms we seed, tracking what each receiver reports holding
+    struct SwarmSeed {
+        QString itemId;
+        QHash<QString, QBitArray> targetPieces; // peer id -> pieces held
+    };
+    PieceStore* m_pieceStore;
+    ContentIndex* m_contentIndex;
+    HashCache* m_hashCache;
+    QHash<QString, SwarmSeed> m_swarmSeeds; // content id -> seed
+    QHash<QString, SwarmDownload*> m_swarmDownloads; // content id -> download
     QString m_downloadPath;
     bool m_running;
 };
@@ -0,0 +1,137 @@
+#include "TrustedPeers.h"
+#include <QCryptographicHash>
+#include <QRandomGenerator>
+#include <QSettings>
+
+namespace Witra {
+
+TrustedPeers::TrustedPeers(QObject* parent)
+    : QObject(parent)
+{
+    QSettings settings;
+    settings.beginGroup("trustedPeers");
+    for (const QString& peerId : settings.childGroups()) {
+        Entry entry;
+        entry.name = settings.value(peerId + "/name").toString();
+        entry.acceptHash = settings.value(peerId + "/acceptHash").toString();
+        entry.reconnectToken = settings.value(peerId + "/reconnectToken").toString();
+        m_peers[peerId] = entry;
+    }
+    settings.endGroup();
+}
+
+bool TrustedPeers::isTrusted(const QString& peerId) const
+{
+    return !m_peers.value(peerId).acceptHash.isEmpty();
+}
+
+QString TrustedPeers::trust(const QString& peerId, const QString& name)
+{
+    if (peerId.isEmpty()) return QString();
+    
+    QString token = newToken();
+    
+    Entry& entry = m_peers[peerId];
+    entry.name = name;
+    entry.acceptHash = hashToken(token);
+    save(peerId);
+    
+    return token;
+}
+
+bool TrustedPeers::verify(const QString& peerId, const QString& token) const
+{
+    if (token.isEmpty()) return false;
+    
+    return tokensMatch(m_peers.value(peerId).acceptHash, hashToken(token));
+}
+
+QString TrustedPeers::newToken()
+{
+    QByteArray bytes(RECONNECT_TOKEN_BYTES, Qt::Uninitialized);
+    QRandomGenerator::system()->fillRange(reinterpret_cast<quint32*>(bytes.data()),
+                                          RECONNECT_TOKEN_BYTES / sizeof(quint32));
+    return QString::fromLatin1(bytes.toHex());
+}
+
+bool TrustedPeers::tokensMatch(const QString& expected, const QString& actual)
+{
+    if (expected.isEmpty() || expected.size() != actual.size()) return false;
+    
+    // Compare without an early exit
+    ushort diff = 0;
+    for (int i = 0; i < expected.size(); ++i) {
+        diff |= expected.at(i).unicode() ^ actual.at(i).unicode();
+    }
+    return diff == 0;
+}
+
+void TrustedPeers::revoke(const QString& peerId)
+{
+    if (!m_peers.contains(peerId)) return;
+    
+    m_peers[peerId].acceptHash.clear();
+    save(peerId);
+}
+
+QStringList TrustedPeers::trustedPeerIds() const
+{
+    QStringList ids;
+    for (auto it = m_peers.constBegin(); it != m_peers.constEnd(); ++it) {
+        if (!it->acceptHash.isEmpty()) {
+            ids.append(it.key());
+        }
+    }
+    return ids;
+}
+
+QString TrustedPeers::reconnectToken(const QString& peerId) const
+{
+    return m_peers.value(peerId).reconnectToken;
+}
+
+void TrustedPeers::setReconnectToken(const QString& peerId, const QString& name,
+                                     const QString& token)
+{
+    if (peerId.isEmpty() || token.isEmpty()) return;
+    
+    Entry& entry = m_peers[peerId];
+    entry.name = name;
+    entry.reconnectToken = token;
+    save(peerId);
+}
+
+void TrustedPeers::forgetReconnectToken(const QString& peerId)
+{
+    if (!m_peers.contains(peerId)) return;
+    
+    m_peers[peerId].reconnectToken.clear();
+    save(peerId);
+}
+
+QString TrustedPeers::hashToken(const QString& token)
+{
+    return QString::fromLatin1(
+        QCryptographicHash::hash(token.toLatin1(), QCryptographicHash::Sha256).toHex());
+}
+
+void TrustedPeers::save(const QString& peerId)
+{
+    QSettings settings;
+    settings.beginGroup("trustedPeers");
+    
+    const Entry entry = m_peers.value(peerId);
+    if (entry.acceptHash.isEmpty() && entry.reconnectToken.isEmpty()) {
+        m_peers.remove(peerId);
+        settings.remove(peerId);
+    } else {
+        settings.setValue(peerId + "/name", entry.name);
+        settings.setValue(peerId + "/acceptHash", entry.acceptHash);
+        settings.setValue(peerId + "/reconnectToken", entry.reconnectToken);
+    }
+    
+    settings.endGroup();
+    emit changed();
+}
+
+} // namespace Witra
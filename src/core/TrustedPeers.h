@@ -0,0 +1,60 @@
+#ifndef TRUSTEDPEERS_H
+#define TRUSTEDPEERS_H
+
+#include <QObject>
+#include <QHash>
+#include <QStringList>
+
+namespace Witra {
+
+// Random bytes in a reconnect token
+constexpr int RECONNECT_TOKEN_BYTES = 16;
+
+// Delay before a trusted peer is reconnected after a dropped link (ms)
+constexpr int TRUSTED_RECONNECT_DELAY = 1000;
+
+// Persisted list of trusted devices, keyed by peer id. Accepting a device as
+// trusted issues it a reconnect token; a later request carrying that token is
+// accepted without asking. Tokens the other side issued to us are kept here too.
+class TrustedPeers : public QObject {
+    Q_OBJECT
+    
+public:
+    explicit TrustedPeers(QObject* parent = nullptr);
+    
+    // Devices we accept without asking
+    bool isTrusted(const QString& peerId) const;
+    QString trust(const QString& peerId, const QString& name); // returns the new token
+    bool verify(const QString& peerId, const QString& token) const;
+    void revoke(const QString& peerId);
+    QStringList trustedPeerIds() const;
+    
+    // A fresh random token, and a comparison that takes the same time
+    // wherever the two differ
+    static QString newToken();
+    static bool tokensMatch(const QString& expected, const QString& actual);
+    
+    // Tokens that let us reconnect to devices that trust us
+    QString reconnectToken(const QString& peerId) const;
+    void setReconnectToken(const QString& peerId, const QString& name, const QString& token);
+    void forgetReconnectToken(const QString& peerId);
+    
+signals:
+    void changed();
+    
+private:
+    struct Entry {
+        QString name;
+        QString acceptHash;     // hash of the token we issued
+        QString reconnectToken; // token issued to us
+    };
+    
+    static QString hashToken(const QString& token);
+    void save(const QString& peerId);
+    
+    QHash<QString, Entry> m_peers;
+};
+
+} // namespace Witra
+
+#endif // TRUSTEDPEERS_H
@@ -0,0 +1,439 @@
+#include "UringReader.h"
+#include "network/ChunkPool.h"
+#include <QFile>
+#include <QSettings>
+
+#if defined(WITRA_HAVE_IO_URING)
+#include <QSocketNotifier>
+#include <QTimer>
+#include <QVector>
+#include <liburing.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace Witra {
+
+#if defined(WITRA_HAVE_IO_URING)
+
+// The ring behind every reader. Used from the GUI thread, where the
+// sessions live, and never torn down.
+class UringRing {
+public:
+    // Null where io_uring cannot be set up
+    static UringRing* instance();
+    
+    // False once a submission has failed for good; no new reads then
+    bool usable() const { return !m_broken; }
+    
+    // A free buffer, or -1 while all are in use
+    int takeBuffer();
+    char* buffer(int index) const { return m_memory + index * URING_BUFFER_SIZE; }
+    
+    bool queueRead(UringReader* owner, int fd, int index, qint64 offset, qint64 length);
+    
+    // The owner is done with the buffer; one still being read is freed
+    // when its completion arrives
+    void release(int index);
+    
+private:
+    UringRing();
+    ~UringRing();
+    
+    bool setUp();
+    void submit();
+    void reap();
+    void complete(int index, int result);
+    
+    io_uring m_ring;
+    bool m_ringReady;
+    char* m_memory;
+    int m_eventFd;
+    QSocketNotifier* m_notifier;
+    QVector<int> m_free;
+    QVector<UringReader*> m_owners; // per buffer, null once released
+    QVector<bool> m_inFlight;
+    QVector<int> m_queued; // buffers queued since the last submission
+    bool m_submitScheduled;
+    bool m_broken;
+};
+
+UringRing::UringRing()
+    : m_ringReady(false)
+    , m_memory(nullptr)
+    , m_eventFd(-1)
+    , m_notifier(nullptr)
+    , m_owners(URING_BUFFERS, nullptr)
+    , m_inFlight(URING_BUFFERS, false)
+    , m_submitScheduled(false)
+    , m_broken(false)
+{
+}
+
+UringRing::~UringRing()
+{
+    delete m_notifier;
+    if (m_ringReady) {
+        io_uring_queue_exit(&m_ring);
+    }
+    if (m_eventFd >= 0) {
+        ::close(m_eventFd);
+    }
+    qFreeAligned(m_memory);
+}
+
+UringRing* UringRing::instance()
+{
+    static UringRing* ring = nullptr;
+    static bool tried = false;
+    if (!tried) {
+        tried = true;
+        ring = new UringRing;
+        if (!ring->setUp()) {
+            delete ring;
+            ring = nullptr;
+        }
+    }
+    return ring;
+}
+
+bool UringRing::setUp()
+{
+    // Kernels without io_uring, or with it blocked, fail here
+    if (io_uring_queue_init(URING_QUEUE_DEPTH, &m_ring, 0) < 0) return false;
+    m_ringReady = true;
+    
+    // Registered once, so the kernel need not map the pages on every read;
+    // a low memlock limit refuses this
+    m_memory = static_cast<char*>(qMallocAligned(URING_BUFFERS * URING_BUFFER_SIZE, 4096));
+    if (!m_memory) return false;
+    QVector<iovec> iovecs(URING_BUFFERS);
+    for (int i = 0; i < URING_BUFFERS; ++i) {
+        iovecs[i].iov_base = buffer(i);
+        iovecs[i].iov_len = static_cast<size_t>(URING_BUFFER_SIZE);
+        m_free.append(URING_BUFFERS - 1 - i);
+    }
+    if (io_uring_register_buffers(&m_ring, iovecs.constData(), URING_BUFFERS) < 0) return false;
+    
+    m_eventFd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (m_eventFd < 0 || io_uring_register_eventfd(&m_ring, m_eventFd) < 0) return false;
+    
+    m_notifier = new QSocketNotifier(m_eventFd, QSocketNotifier::Read);
+    QObject::connect(m_notifier, &QSocketNotifier::activated, [this]() { reap(); });
+    return true;
+}
+
+int UringRing::takeBuffer()
+{
+    return m_free.isEmpty() ? -1 : m_free.takeLast();
+}
+
+bool UringRing::queueRead(UringReader* owner, int fd, int index, qint64 offset, qint64 length)
+{
+    io_uring_sqe* sqe = io_uring_get_sqe(&m_ring);
+    if (!sqe) return false;
+    
+    io_uring_prep_read_fixed(sqe, fd, buffer(index), static_cast<unsigned>(length),
+                             static_cast<__u64>(offset), index);
+    io_uring_sqe_set_data(sqe, reinterpret_cast<void*>(static_cast<quintptr>(index)));
+    m_owners[index] = owner;
+    m_inFlight[index] = true;
+    m_queued.append(index);
+    
+    // Everything queued before the event loop comes round goes in one call
+    if (!m_submitScheduled) {
+        m_submitScheduled = true;
+        QTimer::singleShot(0, m_notifier, [this]() { submit(); });
+    }
+    return true;
+}
+
+void UringRing::release(int index)
+{
+    m_owners[index] = nullptr;
+    if (!m_inFlight[index]) {
+        m_free.append(index);
+    }
+}
+
+void UringRing::submit()
+{
+    m_submitScheduled = false;
+    const int result = io_uring_submit(&m_ring);
+    if (result >= 0) {
+        m_queued.clear();
+        return;
+    }
+    
+    if (result == -EAGAIN || result == -EBUSY || result == -EINTR) {
+        m_submitScheduled = true;
+        QTimer::singleShot(1, m_notifier, [this]() { submit(); });
+        return;
+    }
+    
+    // Nothing queued reached the kernel, and nothing more will; readers
+    // go back to QFile. Those buffers are never handed out again.
+    m_broken = true;
+    const QVector<int> queued = m_queued;
+    m_queued.clear();
+    for (int index : queued) {
+        UringReader* owner = m_owners[index];
+        m_owners[index] = nullptr;
+        if (owner) {
+            owner->completed(index, result);
+        }
+    }
+}
+
+void UringRing::reap()
+{
+    quint64 count = 0;
+    if (::read(m_eventFd, &count, sizeof(count)) < 0 && errno != EAGAIN) return;
+    
+    io_uring_cqe* cqe = nullptr;
+    while (io_uring_peek_cqe(&m_ring, &cqe) == 0 && cqe) {
+        const int index = static_cast<int>(reinterpret_cast<quintptr>(io_uring_cqe_get_data(cqe)));
+        const int result = cqe->res;
+        io_uring_cqe_seen(&m_ring, cqe);
+        complete(index, result);
+    }
+}
+
+void UringRing::complete(int index, int result)
+{
+    if (index < 0 || index >= URING_BUFFERS || !m_inFlight[index]) return;
+    m_inFlight[index] = false;
+    
+    UringReader* owner = m_owners[index];
+    if (owner) {
+        owner->completed(index, result);
+    } else {
+        m_free.append(index);
+    }
+}
+
+#endif
+
+UringReader::UringReader(QObject* parent)
+    : QObject(parent)
+    , m_fd(-1)
+    , m_size(0)
+    , m_nextOffset(0)
+    , m_waiting(false)
+    , m_failed(false)
+{
+}
+
+UringReader::~UringReader()
+{
+    close();
+}
+
+#if defined(WITRA_HAVE_IO_URING)
+
+bool UringReader::available()
+{
+    static const bool on = QSettings().value("transfer/ioUring", true).toBool();
+    UringRing* ring = UringRing::instance();
+    return on && ring && ring->usable();
+}
+
+bool UringReader::open(const QString& filePath)
+{
+    close();
+    if (!available()) return false;
+    
+    m_fd = ::open(QFile::encodeName(filePath).constData(), O_RDONLY | O_CLOEXEC);
+    if (m_fd < 0) return false;
+    
+    struct stat info;
+    if (::fstat(m_fd, &info) != 0) {
+        close();
+        return false;
+    }
+    m_size = info.st_size;
+    m_nextOffset = 0;
+    m_failed = false;
+    return true;
+}
+
+void UringReader::close()
+{
+    dropReads();
+    if (m_fd >= 0) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+    m_waiting = false;
+    m_failed = false;
+}
+
+QByteArray UringReader::read(qint64 offset, qint64 length)
+{
+    if (m_fd < 0 || m_failed) return QByteArray();
+    if (offset >= m_size) return QByteArray("");
+    length = qMin(length, m_size - offset);
+    
+    // A jump drops what was read ahead and starts again from here
+    if (!m_slots.isEmpty() && m_slots.head().offset + m_slots.head().consumed != offset) {
+        dropReads();
+    }
+    if (m_slots.isEmpty()) {
+        m_nextOffset = offset;
+    }
+    
+    // Two chunks ahead, in buffer-sized reads
+    const int perChunk = static_cast<int>((length + URING_BUFFER_SIZE - 1) / URING_BUFFER_SIZE);
+    const int depth = qBound(URING_READ_AHEAD, 2 * perChunk, URING_MAX_READ_AHEAD);
+    fill(depth);
+    
+    if (m_slots.isEmpty()) {
+        // Every buffer is busy with other files; read this one here
+        QByteArray data = ChunkPool::instance().acquire(static_cast<int>(length));
+        const ssize_t count = ::pread(m_fd, data.data(), static_cast<size_t>(data.size()), offset);
+        if (count < 0) {
+            m_failed = true;
+            return QByteArray();
+        }
+        data.resize(static_cast<int>(count));
+        return count > 0 ? data : QByteArray("");
+    }
+    
+    const Slot& head = m_slots.head();
+    if (!head.done) {
+        m_waiting = true;
+        return QByteArray();
+    }
+    if (head.result < 0) {
+        m_failed = true;
+        dropReads();
+        return QByteArray();
+    }
+    if (head.result == 0) return QByteArray("");
+    
+    // As much of the chunk as has arrived; a short read ends it, as
+    // nothing read after it lines up
+    qint64 ready = 0;
+    for (const Slot& slot : qAsConst(m_slots)) {
+        if (!slot.done || slot.result < 0 || ready >= length) break;
+        ready += slot.result - slot.consumed;
+        if (slot.result < slot.length) break;
+    }
+    ready = qMin(ready, length);
+    
+    UringRing* ring = UringRing::instance();
+    QByteArray data = ChunkPool::instance().acquire(static_cast<int>(ready));
+    qint64 copied = 0;
+    while (copied < ready) {
+        Slot& slot = m_slots.head();
+        const qint64 take = qMin(ready - copied, slot.result - slot.consumed);
+        std::memcpy(data.data() + copied, ring->buffer(slot.buffer) + slot.consumed,
+                    static_cast<size_t>(take));
+        copied += take;
+        slot.consumed += take;
+        if (slot.consumed == slot.result) {
+            ring->release(slot.buffer);
+            m_slots.dequeue();
+        }
+    }
+    fill(depth);
+    return data;
+}
+
+void UringReader::fill(int depth)
+{
+    UringRing* ring = UringRing::instance();
+    if (!ring || !ring->usable()) return;
+    
+    while (m_slots.size() < depth && m_nextOffset < m_size) {
+        const int index = ring->takeBuffer();
+        if (index < 0) return;
+        
+        Slot slot;
+        slot.buffer = index;
+        slot.offset = m_nextOffset;
+        slot.length = qMin(URING_BUFFER_SIZE, m_size - m_nextOffset);
+        slot.consumed = 0;
+        slot.result = 0;
+        slot.done = false;
+        if (!ring->queueRead(this, m_fd, index, slot.offset, slot.length)) {
+            ring->release(index);
+            return;
+        }
+        m_slots.enqueue(slot);
+        m_nextOffset += slot.length;
+    }
+}
+
+void UringReader::dropReads()
+{
+    if (m_slots.isEmpty()) return;
+    
+    UringRing* ring = UringRing::instance();
+    for (const Slot& slot : qAsConst(m_slots)) {
+        ring->release(slot.buffer);
+    }
+    m_slots.clear();
+}
+
+void UringReader::completed(int buffer, int result)
+{
+    for (int i = 0; i < m_slots.size(); ++i) {
+        if (m_slots[i].buffer != buffer) continue;
+        
+        m_slots[i].result = result;
+        m_slots[i].done = true;
+        if (i == 0 && m_waiting) {
+            m_waiting = false;
+            emit readable();
+        }
+        return;
+    }
+}
+
+#else
+
+bool UringReader::available()
+{
+    return false;
+}
+
+bool UringReader::open(const QString& filePath)
+{
+    Q_UNUSED(filePath)
+    return false;
+}
+
+void UringReader::close()
+{
+}
+
+QByteArray UringReader::read(qint64 offset, qint64 length)
+{
+    Q_UNUSED(offset)
+    Q_UNUSED(length)
+    return QByteArray();
+}
+
+void UringReader::fill(int depth)
+{
+    Q_UNUSED(depth)
+}
+
+void UringReader::dropReads()
+{
+}
+
+void UringReader::completed(int buffer, int result)
+{
+    Q_UNUSED(buffer)
+    Q_UNUSED(result)
+}
+
+#endif
+
+} // namespace Witra
@@ -0,0 +1,85 @@
+#ifndef URINGREADER_H
+#define URINGREADER_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QQueue>
+
+namespace Witra {
+
+// Submission entries in the shared ring, one for each buffer
+constexpr int URING_QUEUE_DEPTH = 128;
+
+// Registered buffers shared by every reader; 8 MiB locked in all
+constexpr int URING_BUFFERS = 128;
+
+// Size of each read; larger chunks are gathered from several
+constexpr qint64 URING_BUFFER_SIZE = 64 * 1024;
+
+// Reads each file keeps in flight: two chunks' worth, within these bounds
+constexpr int URING_READ_AHEAD = 4;
+constexpr int URING_MAX_READ_AHEAD = 32;
+
+// Smaller files are read through QFile; read-ahead has nothing to win
+constexpr qint64 URING_MIN_FILE_SIZE = 1024 * 1024;
+
+class UringRing;
+
+// Reads a file sequentially through io_uring on Linux. All readers share
+// one ring and one set of registered buffers. Reads queued during a pass
+// of the event loop reach the kernel in a single submission and complete
+// through an eventfd, so a sender never waits on the disk and dozens of
+// sessions cost one syscall per pass rather than one per chunk.
+//
+// Only built in with WITRA_USE_IO_URING. Where the kernel refuses a ring,
+// available() is false and callers read through QFile as before.
+class UringReader : public QObject {
+    Q_OBJECT
+    
+public:
+    explicit UringReader(QObject* parent = nullptr);
+    ~UringReader() override;
+    
+    // Built in, set up, and the transfer/ioUring setting not turned off
+    static bool available();
+    
+    bool open(const QString& filePath);
+    void close();
+    bool isOpen() const { return m_fd >= 0; }
+    
+    // Data at offset, read ahead of time; null while still on its way or
+    // once reads have failed, empty at the end of the file
+    QByteArray read(qint64 offset, qint64 length);
+    bool failed() const { return m_failed; }
+    
+signals:
+    // A read() that returned null may try again
+    void readable();
+    
+private:
+    friend class UringRing;
+    
+    struct Slot {
+        int buffer;
+        qint64 offset;
+        qint64 length;
+        qint64 consumed; // bytes of the result already handed out
+        int result;
+        bool done;
+    };
+    
+    void fill(int depth);
+    void dropReads();
+    void completed(int buffer, int result);
+    
+    int m_fd;
+    qint64 m_size;
+    qint64 m_nextOffset;
+    QQueue<Slot> m_slots; // in file order
+    bool m_waiting;
+    bool m_failed;
+};
+
+} // namespace Witra
+
+#endif // URINGREADER_H
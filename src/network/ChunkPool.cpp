@@ -0,0 +1,69 @@
+#include "ChunkPool.h"
+
+namespace Witra {
+
+ChunkPool& ChunkPool::instance()
+{
+    static ChunkPool pool;
+    return pool;
+}
+
+int ChunkPool::capacityOf(int sizeClass)
+{
+    return static_cast<int>(MIN_CHUNK_SIZE << sizeClass) + CHUNK_POOL_SLACK;
+}
+
+QByteArray ChunkPool::acquire(int size)
+{
+    int sizeClass = 0;
+    while (sizeClass < CHUNK_POOL_CLASSES && capacityOf(sizeClass) < size) {
+        ++sizeClass;
+    }
+    if (sizeClass == CHUNK_POOL_CLASSES) return QByteArray(size, Qt::Uninitialized);
+    
+    QByteArray buffer;
+    {
+        QMutexLocker lock(&m_mutex);
+        ++m_stats.acquired;
+        if (!m_idle[sizeClass].isEmpty()) {
+            buffer = m_idle[sizeClass].takeLast();
+            m_stats.idleBytes -= capacityOf(sizeClass);
+            ++m_stats.reused;
+        }
+    }
+    
+    // Reserved, so shrinking a short read to nothing keeps the memory
+    if (buffer.capacity() < capacityOf(sizeClass)) {
+        buffer.reserve(capacityOf(sizeClass));
+    }
+    buffer.resize(size);
+    return buffer;
+}
+
+void ChunkPool::release(QByteArray& buffer)
+{
+    QByteArray taken;
+    taken.swap(buffer);
+    
+    // Someone else still reads it, or it never came from here
+    if (!taken.isDetached()) return;
+    int sizeClass = CHUNK_POOL_CLASSES - 1;
+    while (sizeClass >= 0 && taken.capacity() < capacityOf(sizeClass)) {
+        --sizeClass;
+    }
+    if (sizeClass < 0 || taken.capacity() >= 2 * capacityOf(sizeClass)) return;
+    
+    QMutexLocker lock(&m_mutex);
+    if (m_stats.idleBytes + capacityOf(sizeClass) > CHUNK_POOL_MAX_IDLE_BYTES) return;
+    m_idle[sizeClass].append(std::move(taken));
+    m_stats.idleBytes += capacityOf(sizeClass);
+    m_stats.peakIdleBytes = qMax(m_stats.peakIdleBytes, m_stats.idleBytes);
+}
+
+ChunkPool::Stats ChunkPool::stats() const
+{
+    QMutexLocker lock(&m_mutex);
+    return m_stats;
+}
+
+} // namespace Witra
@@ -0,0 +1,63 @@
+#ifndef CHUNKPOOL_H
+#define CHUNKPOOL_H
+
+#include <QByteArray>
+#include <QMutex>
+#include <QVector>
+#include "Protocol.h"
+
+namespace Witra {
+
+// Buffer sizes pooled: MIN_CHUNK_SIZE doubled up to MAX_CHUNK_SIZE
+constexpr int CHUNK_POOL_CLASSES = 7;
+
+// Room past the chunk itself for a frame header and CRC
+constexpr int CHUNK_POOL_SLACK = 16;
+
+// Idle memory kept for reuse; buffers returned beyond this are freed
+constexpr qint64 CHUNK_POOL_MAX_IDLE_BYTES = 32 * 1024 * 1024;
+
+// Chunk-sized buffers shared by the file reads and frame parsing of every
+// session, so a transfer at line rate reuses a handful of buffers instead
+// of allocating for each chunk. Buffers come in one size per chunk size a
+// session may pick. They are plain QByteArrays, and their implicit sharing
+// is the reference count: release() takes a buffer back only once no one
+// else holds it, so whoever lets go last returns it, and a buffer simply
+// dropped is freed as before.
+//
+// Thread-safe; the verifier hands buffers back from the thread pool.
+class ChunkPool {
+public:
+    struct Stats {
+        qint64 acquired = 0;
+        qint64 reused = 0; // acquires served from an idle buffer
+        qint64 idleBytes = 0;
+        qint64 peakIdleBytes = 0; // high-water mark of memory held for reuse
+        
+        double hitRate() const { return acquired ? double(reused) / acquired : 0.0; }
+    };
+    
+    static ChunkPool& instance();
+    
+    // A buffer of size bytes for the caller to fill; only sizes up to the
+    // largest chunk come from the pool
+    QByteArray acquire(int size);
+    
+    // Gives the buffer up, keeping its memory if nothing else shares it
+    void release(QByteArray& buffer);
+    
+    Stats stats() const;
+    
+private:
+    ChunkPool() = default;
+    
+    static int capacityOf(int sizeClass);
+    
+    mutable QMutex m_mutex;
+    QVector<QByteArray> m_idle[CHUNK_POOL_CLASSES];
+    Stats m_stats;
+};
+
+} // namespace Witra
+
+#endif // CHUNKPOOL_H
@@ -0,0 +1,84 @@
+#include "ChunkSizer.h"
+#include "SocketTuner.h"
+
+namespace Witra {
+
+ChunkSizer::ChunkSizer()
+    : m_limit(CHUNK_SIZE)
+    , m_chunkSize(MIN_CHUNK_SIZE)
+    , m_pendingLimit(MAX_PENDING_WRITE)
+    , m_throughput(0)
+    , m_rtt(-1)
+    , m_windowBytes(0)
+{
+}
+
+void ChunkSizer::setPeerLimit(qint64 maxChunk)
+{
+    m_limit = maxChunk > 0 ? qBound(MIN_CHUNK_SIZE, maxChunk, MAX_CHUNK_SIZE) : CHUNK_SIZE;
+    m_chunkSize = qMin(m_chunkSize, m_limit);
+}
+
+ChunkSizer::Stats ChunkSizer::stats() const
+{
+    Stats result;
+    result.chunkSize = m_chunkSize;
+    result.pendingLimit = m_pendingLimit;
+    result.throughput = m_throughput;
+    result.rtt = m_rtt;
+    return result;
+}
+
+void ChunkSizer::seed(qint64 throughput, int rtt)
+{
+    if (throughput <= 0) return;
+    m_throughput = throughput;
+    m_rtt = rtt;
+    
+    // Straight to the size the link calls for, not four times a step
+    m_chunkSize = m_limit;
+    resize();
+}
+
+bool ChunkSizer::addSent(qint64 bytes, qintptr descriptor)
+{
+    if (!m_window.isValid()) {
+        m_window.start();
+        m_windowBytes = 0;
+    }
+    m_windowBytes += bytes;
+    
+    const qint64 elapsed = m_window.elapsed();
+    if (elapsed < CHUNK_SAMPLE_INTERVAL) return false;
+    
+    const bool sampled = elapsed < CHUNK_SAMPLE_STALE;
+    if (sampled) {
+        const qint64 rate = m_windowBytes * 1000 / elapsed;
+        m_throughput = m_throughput ? (3 * m_throughput + rate) / 4 : rate;
+        m_rtt = SocketTuner::roundTripTime(descriptor);
+        resize();
+    }
+    m_window.start();
+    m_windowBytes = 0;
+    return sampled;
+}
+
+void ChunkSizer::resize()
+{
+    // Powers of two, so pooled buffers of each size are shared widely
+    const qint64 target = m_throughput * CHUNK_TARGET_TIME / 1000;
+    qint64 size = MIN_CHUNK_SIZE;
+    while (size * 2 <= target && size * 2 <= m_limit) {
+        size *= 2;
+    }
+    m_chunkSize = qMin(size, 4 * m_chunkSize);
+    
+    // Sixteen frames in flight, or two round trips' worth
+    qint64 pending = qMax(MAX_PENDING_WRITE, 16 * m_chunkSize);
+    if (m_rtt > 0) {
+        pending = qMax(pending, 2 * m_throughput * m_rtt / 1000000);
+    }
+    m_pendingLimit = qMin(pending, MAX_PENDING_LIMIT);
+}
+
+} // namespace Witra
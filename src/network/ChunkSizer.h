@@ -0,0 +1,71 @@
+#ifndef CHUNKSIZER_H
+#define CHUNKSIZER_H
+
+#include <QElapsedTimer>
+#include "Protocol.h"
+
+namespace Witra {
+
+// How long one data frame should take to leave at the measured rate (ms)
+constexpr int CHUNK_TARGET_TIME = 2;
+
+// Throughput is measured over windows at least this long (ms)
+constexpr int CHUNK_SAMPLE_INTERVAL = 100;
+
+// A window this long had the sender idle in it and is thrown away (ms)
+constexpr int CHUNK_SAMPLE_STALE = 1000;
+
+// Most unsent bytes a sender may queue, however fast and far the link
+constexpr qint64 MAX_PENDING_LIMIT = 64 * 1024 * 1024;
+
+// Picks a session's data frame size from how fast its socket drains.
+// Frames start small and are sized so one takes CHUNK_TARGET_TIME to
+// leave: large on 10 GbE, where per-frame costs dominate, and small on
+// slow WiFi, where progress and cancels should not wait on one frame.
+// Growth is at most fourfold per window, shrinking is immediate, and the
+// size stays within what the peer said it takes.
+//
+// The unsent bytes a sender may queue follow along: enough frames to
+// keep the pipe busy, and at least the bandwidth-delay product where the
+// round trip time is known.
+class ChunkSizer {
+public:
+    struct Stats {
+        qint64 chunkSize = 0;
+        qint64 pendingLimit = 0;
+        qint64 throughput = 0; // bytes per second
+        int rtt = -1;          // µs, -1 where the platform does not say
+    };
+    
+    ChunkSizer();
+    
+    // Largest frame the peer takes; 0 for a peer that did not say
+    void setPeerLimit(qint64 maxChunk);
+    
+    qint64 chunkSize() const { return m_chunkSize; }
+    qint64 pendingLimit() const { return m_pendingLimit; }
+    Stats stats() const;
+    
+    // Start from what an earlier session to the same peer measured
+    void seed(qint64 throughput, int rtt);
+    
+    // Bytes the socket took, straight into the kernel or drained from its
+    // own buffer; descriptor is read for the round trip time. True when
+    // this closed a window and the stats are new
+    bool addSent(qint64 bytes, qintptr descriptor);
+    
+private:
+    void resize();
+    
+    qint64 m_limit;
+    qint64 m_chunkSize;
+    qint64 m_pendingLimit;
+    qint64 m_throughput;
+    int m_rtt;
+    QElapsedTimer m_window;
+    qint64 m_windowBytes;
+};
+
+} // namespace Witra
+
+#endif // CHUNKSIZER_H
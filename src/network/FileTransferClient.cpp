@@ -5,6 +5,10 @@ namespace Witra {
 
 FileTransferClient::FileTransferClient(QObject* parent)
     : QObject(parent)
+    , m_journal(nullptr)
+    , m_pieceStore(nullptr)
+    , m_contentIndex(nullptr)
+    , m_hashCache(nullptr)
 {
     m_downloadPath = QDir::homePath() + "/Downloads/Witra";
 }
@@ -25,6 +29,10 @@ TransferSession* FileTransferClient::connectToPeer(const QHostAddress& address,
     TransferSession* session = new TransferSession(socket, this);
     session->setIsIncoming(false);
     session->setDownloadPath(m_downloadPath);
+    session->setJournal(m_journal);
+    session->setPieceStore(m_pieceStore);
+    session->setContentIndex(m_contentIndex);
+    session->setHashCache(m_hashCache);
     
     m_sessions[session->sessionId()] = session;
     
@@ -22,6 +22,10 @@ public:
     
     void setDownloadPath(const QString& path) { m_downloadPath = path; }
     QString downloadPath() const { return m_downloadPath; }
+    void setJournal(TransferJournal* journal) { m_journal = journal; }
+    void setPieceStore(PieceStore* store) { m_pieceStore = store; }
+    void setContentIndex(ContentIndex* index) { m_contentIndex = index; }
+    void setHashCache(HashCache* cache) { m_hashCache = cache; }
     
 signals:
     void connected(TransferSession* session);
@@ -34,6 +38,10 @@ private slots:
 private:
     QMap<QString, TransferSession*> m_sessions;
     QString m_downloadPath;
+    TransferJournal* m_journal;
+    PieceStore* m_pieceStore;
+    ContentIndex* m_contentIndex;
+    HashCache* m_hashCache;
 };
 
 } // namespace Witra
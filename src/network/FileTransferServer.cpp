@@ -6,6 +6,10 @@ namespace Witra {
 FileTransferServer::FileTransferServer(QObject* parent)
     : QObject(parent)
     , m_server(new QTcpServer(this))
+    , m_journal(nullptr)
+    , m_pieceStore(nullptr)
+    , m_contentIndex(nullptr)
+    , m_hashCache(nullptr)
 {
     // Default download path
     m_downloadPath = QDir::homePath() + "/Downloads/Witra";
@@ -67,6 +71,10 @@ void FileTransferServer::onNewConnection()
         TransferSession* session = new TransferSession(socket, this);
         session->setIsIncoming(true);
         session->setDownloadPath(m_downloadPath);
+        session->setJournal(m_journal);
+        session->setPieceStore(m_pieceStore);
+        session->setContentIndex(m_contentIndex);
+        session->setHashCache(m_hashCache);
         
         m_sessions[session->sessionId()] = session;
         
@@ -22,6 +22,10 @@ public:
     
     void setDownloadPath(const QString& path) { m_downloadPath = path; }
     QString downloadPath() const { return m_downloadPath; }
+    void setJournal(TransferJournal* journal) { m_journal = journal; }
+    void setPieceStore(PieceStore* store) { m_pieceStore = store; }
+    void setContentIndex(ContentIndex* index) { m_contentIndex = index; }
+    void setHashCache(HashCache* cache) { m_hashCache = cache; }
     
     TransferSession* session(const QString& sessionId) const;
     QList<TransferSession*> sessions() const { return m_sessions.values(); }
@@ -40,6 +44,10 @@ private:
     QTcpServer* m_server;
     QMap<QString, TransferSession*> m_sessions;
     QString m_downloadPath;
+    TransferJournal* m_journal;
+    PieceStore* m_pieceStore;
+    ContentIndex* m_contentIndex;
+    HashCache* m_hashCache;
 };
 
 } // namespace Witra
@@ -0,0 +1,82 @@
+#include "FrameWriter.h"
+#include <QTcpSocket>
+
+#if defined(Q_OS_WIN)
+#include <winsock2.h>
+#else
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+namespace Witra {
+
+FrameWriter::FrameWriter(QTcpSocket* socket)
+    : m_socket(socket)
+{
+}
+
+qint64 FrameWriter::write(const char* header, int headerSize, const QByteArray& payload)
+{
+    // Anything still queued in the socket must go first
+    qint64 sent = 0;
+    if (m_socket->bytesToWrite() == 0) {
+        sent = sendDirect(header, headerSize, payload);
+    }
+    if (sent == headerSize + payload.size()) return sent;
+    
+    if (sent < headerSize) {
+        m_socket->write(header + sent, headerSize - sent);
+        m_socket->write(payload);
+    } else {
+        const qint64 done = sent - headerSize;
+        m_socket->write(payload.constData() + done, payload.size() - done);
+    }
+    return sent;
+}
+
+qint64 FrameWriter::sendDirect(const char* header, int headerSize, const QByteArray& payload)
+{
+    const qintptr descriptor = m_socket->socketDescriptor();
+    if (descriptor == -1) return 0;
+    const int parts = payload.isEmpty() ? 1 : 2;
+    
+    // Errors are left for the socket to run into on its own write
+#if defined(Q_OS_WIN)
+    WSABUF buffers[2];
+    buffers[0].buf = const_cast<char*>(header);
+    buffers[0].len = static_cast<ULONG>(headerSize);
+    buffers[1].buf = const_cast<char*>(payload.constData());
+    buffers[1].len = static_cast<ULONG>(payload.size());
+    
+    DWORD count = 0;
+    if (WSASend(static_cast<SOCKET>(descriptor), buffers, parts, &count, 0, nullptr, nullptr) != 0) {
+        return 0;
+    }
+    return count;
+#else
+    iovec buffers[2];
+    buffers[0].iov_base = const_cast<char*>(header);
+    buffers[0].iov_len = static_cast<size_t>(headerSize);
+    buffers[1].iov_base = const_cast<char*>(payload.constData());
+    buffers[1].iov_len = static_cast<size_t>(payload.size());
+    
+    msghdr message = {};
+    message.msg_iov = buffers;
+    message.msg_iovlen = parts;
+    
+#if defined(MSG_NOSIGNAL)
+    const int flags = MSG_NOSIGNAL;
+#else
+    const int flags = 0; // Qt's socket engine already ignores SIGPIPE
+#endif
+    
+    ssize_t count;
+    do {
+        count = ::sendmsg(static_cast<int>(descriptor), &message, flags);
+    } while (count < 0 && errno == EINTR);
+    return count < 0 ? 0 : count;
+#endif
+}
+
+} // namespace Witra
@@ -0,0 +1,36 @@
+#ifndef FRAMEWRITER_H
+#define FRAMEWRITER_H
+
+#include <QByteArray>
+
+class QTcpSocket;
+
+namespace Witra {
+
+// Largest frame header: size, type and CRC32C
+constexpr int FRAME_HEADER_MAX = 9;
+
+// Writes a frame as two pieces, its header and its payload, handed to the
+// kernel together with sendmsg() (WSASend() on Windows), so the payload is
+// never copied just to sit behind a few bytes of header.
+//
+// Whatever the kernel cannot take at once goes through QTcpSocket::write()
+// as before, and so does every frame after it until the socket's own
+// buffer has drained. Bytes therefore always leave in order, and a slow
+// peer still fills the socket buffer that senders wait on.
+class FrameWriter {
+public:
+    explicit FrameWriter(QTcpSocket* socket);
+    
+    // Returns the bytes sent straight away, the rest being left queued
+    qint64 write(const char* header, int headerSize, const QByteArray& payload);
+    
+private:
+    qint64 sendDirect(const char* header, int headerSize, const QByteArray& payload);
+    
+    QTcpSocket* m_socket;
+};
+
+} // namespace Witra
+
+#endif // FRAMEWRITER_H
@@ -0,0 +1,78 @@
+#include "LinkProfiles.h"
+#include <QDateTime>
+#include <QNetworkInterface>
+#include <QSet>
+#include <QSettings>
+#include <QTcpSocket>
+
+namespace Witra {
+
+namespace {
+
+QString groupOf(const QString& peerId, const QString& interfaceName)
+{
+    return QStringLiteral("linkProfiles/") + peerId + '/' + interfaceName;
+}
+
+// Links being probed; sessions all live on the main thread
+QSet<QString> probing;
+
+} // namespace
+
+QString LinkProfiles::interfaceOf(const QTcpSocket* socket)
+{
+    const QHostAddress local = socket->localAddress();
+    for (const QNetworkInterface& iface : QNetworkInterface::allInterfaces()) {
+        for (const QNetworkAddressEntry& entry : iface.addressEntries()) {
+            if (entry.ip().isEqual(local, QHostAddress::TolerantConversion)) {
+                return iface.name();
+            }
+        }
+    }
+    return QStringLiteral("any");
+}
+
+LinkProfiles::Profile LinkProfiles::load(const QString& peerId, const QString& interfaceName)
+{
+    Profile profile;
+    if (peerId.isEmpty()) return profile;
+    
+    QSettings settings;
+    settings.beginGroup(groupOf(peerId, interfaceName));
+    const QDateTime updated = settings.value("updated").toDateTime();
+    if (updated.isValid() && updated.daysTo(QDateTime::currentDateTimeUtc()) <= LINK_PROFILE_MAX_AGE) {
+        profile.sendRate = settings.value("sendRate", 0).toLongLong();
+        profile.receiveRate = settings.value("receiveRate", 0).toLongLong();
+        profile.rtt = settings.value("rtt", -1).toInt();
+    }
+    settings.endGroup();
+    return profile;
+}
+
+void LinkProfiles::save(const QString& peerId, const QString& interfaceName, const Profile& profile)
+{
+    if (peerId.isEmpty() || !profile.isValid()) return;
+    
+    QSettings settings;
+    settings.beginGroup(groupOf(peerId, interfaceName));
+    settings.setValue("sendRate", profile.sendRate);
+    settings.setValue("receiveRate", profile.receiveRate);
+    settings.setValue("rtt", profile.rtt);
+    settings.setValue("updated", QDateTime::currentDateTimeUtc());
+    settings.endGroup();
+}
+
+bool LinkProfiles::claimProbe(const QString& peerId, const QString& interfaceName)
+{
+    const QString link = groupOf(peerId, interfaceName);
+    if (probing.contains(link)) return false;
+    probing.insert(link);
+    return true;
+}
+
+void LinkProfiles::releaseProbe(const QString& peerId, const QString& interfaceName)
+{
+    probing.remove(groupOf(peerId, interfaceName));
+}
+
+} // namespace Witra
@@ -0,0 +1,43 @@
+#ifndef LINKPROFILES_H
+#define LINKPROFILES_H
+
+#include <QString>
+
+class QTcpSocket;
+
+namespace Witra {
+
+// Learned profiles older than this are ignored (days)
+constexpr int LINK_PROFILE_MAX_AGE = 30;
+
+// What past sessions measured on the link to a peer, kept per peer and
+// local interface under "linkProfiles/" in the settings, since WiFi and
+// Ethernet to the same machine are different links. A new session starts
+// from these numbers rather than from defaults, so even a short transfer
+// gets full-sized frames and buffers without a warm-up. Live measurements
+// then carry on from there and are saved back when the session ends.
+class LinkProfiles {
+public:
+    struct Profile {
+        qint64 sendRate = 0;    // bytes per second
+        qint64 receiveRate = 0;
+        int rtt = -1;           // µs
+        
+        bool isValid() const { return sendRate > 0 || receiveRate > 0; }
+    };
+    
+    // Name of the local interface a connected socket runs over
+    static QString interfaceOf(const QTcpSocket* socket);
+    
+    static Profile load(const QString& peerId, const QString& interfaceName);
+    static void save(const QString& peerId, const QString& interfaceName, const Profile& profile);
+    
+    // One link probe at a time per link, so pooled sessions opening
+    // together do not split the bandwidth they measure
+    static bool claimProbe(const QString& peerId, const QString& interfaceName);
+    static void releaseProbe(const QString& peerId, const QString& interfaceName);
+};
+
+} // namespace Witra
+
+#endif // LINKPROFILES_H
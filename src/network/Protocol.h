@@ -4,6 +4,7 @@
 #include <QString>
 #include <QJsonObject>
 #include <QJsonDocument>
+#include <QJsonArray>
 #include <QUuid>
 
 namespace Witra {
@@ -20,6 +21,38 @@ constexpr int PEER_TIMEOUT = 10000;
 
 // Buffer sizes
 constexpr qint64 CHUNK_SIZE = 65536; // 64KB chunks for file transfer
+constexpr qint64 MAX_PENDING_WRITE = 16 * CHUNK_SIZE; // unsent socket bytes before a sender waits
+
+// Bounds a session's data frames adapt between; peers that do not state
+// their largest frame get nothing above CHUNK_SIZE
+constexpr qint64 MIN_CHUNK_SIZE = 16 * 1024;
+constexpr qint64 MAX_CHUNK_SIZE = 1024 * 1024;
+
+// Folder manifests go out in pages of this many files
+constexpr int MANIFEST_PAGE_ENTRIES = 512;
+
+// Files a sender lists ahead of the data it is sending
+constexpr int MANIFEST_WINDOW = 4 * MANIFEST_PAGE_ENTRIES;
+
+// Damaged data frames a file may need repaired before it is given up on
+constexpr int FRAME_REPAIR_LIMIT = 64;
+
+// Finished files a sender can still repair frames of
+constexpr int FRAME_REPAIR_HISTORY = 64;
+
+// How long each side of a link probe sends its timed burst (ms)
+constexpr int LINK_PROBE_TIME = 250;
+
+// A link probe not finished by then is given up on and sending resumes (ms)
+constexpr int LINK_PROBE_TIMEOUT = 3000;
+
+// Frame kinds, the byte after the size
+namespace FrameType {
+    constexpr quint8 HEADER = 0;
+    constexpr quint8 DATA = 1;
+    constexpr quint8 CHECKED_DATA = 2; // [4 bytes CRC32C of the data][data]
+    constexpr quint8 PROBE = 3;        // link probe filler, timed and thrown away
+}
 
 // Message types for discovery
 namespace DiscoveryType {
@@ -36,10 +69,23 @@ namespace TransferType {
     constexpr const char* FILE_DATA = "file_data";
     constexpr const char* FILE_COMPLETE = "file_complete";
     constexpr const char* FOLDER_HEADER = "folder_header";
+    constexpr const char* FOLDER_MANIFEST = "folder_manifest";
+    constexpr const char* MIRROR_WANT = "mirror_want";
+    constexpr const char* DELTA_SIGNATURE = "delta_signature";
     constexpr const char* TRANSFER_CANCEL = "transfer_cancel";
     constexpr const char* TRANSFER_ACK = "transfer_ack";
+    constexpr const char* TRANSFER_RESUME = "transfer_resume";
+    constexpr const char* SWARM_MANIFEST = "swarm_manifest";
+    constexpr const char* PIECE_HAVE = "piece_have";
+    constexpr const char* PIECE_REQUEST = "piece_request";
+    constexpr const char* PIECE_DATA = "piece_data";
+    constexpr const char* FRAME_NACK = "frame_nack";
+    constexpr const char* FRAME_REPAIR = "frame_repair";
+    constexpr const char* HOLE_MAP = "hole_map";
     constexpr const char* PING = "ping";
     constexpr const char* PONG = "pong";
+    constexpr const char* LINK_PROBE = "link_probe";
+    constexpr const char* LINK_PROBE_RESULT = "link_probe_result";
 }
 
 // Discovery message structure
@@ -90,7 +136,37 @@ struct TransferHeader {
     qint64 totalFiles;
     qint64 currentFileIndex;
     QString senderName;
+    qint64 offset = 0;      // Resume point carried by TRANSFER_ACK
+    bool resume = false;    // FILE_HEADER asks the receiver for a resume offset
+    QString token;          // Reconnect token presented in a request or issued in an accept
+    QString poolSecret;     // Issued in the accept of a newly connected peer; its extra pooled
+                            // CONNECTION_REQUESTs, from either side, present it
+    QString contentId;      // Swarmed file a piece message or swarm-only connection is about
+    QJsonObject manifest;   // Piece layout carried by SWARM_MANIFEST
+    QJsonArray pieces;      // Piece indices requested, or newly held
+    QByteArray bitfield;    // Every piece held, packed
+    QJsonArray entries;     // Files listed by a FOLDER_MANIFEST page
+    qint64 totalSize = 0;   // Folder bytes found so far
+    bool lastPage = false;  // No FOLDER_MANIFEST pages follow
+    bool mirror = false;    // Mirror transfer: only changed files move, overwritten in place
+    bool deletes = false;   // Mirror also removes files the sender no longer has
+    qint64 modified = 0;    // Source mtime of a mirrored file (msecs since epoch)
+    QJsonArray wanted;      // Entries of the oldest unanswered manifest page a MIRROR_WANT asks for
+    bool delta = false;     // FILE_HEADER offers to send only what differs from the receiver's copy
+    QByteArray signature;   // Block checksums of the receiver's copy; empty asks for the whole file
+    QByteArray checksum;    // SHA-256 of the content: FILE_HEADER offers it for dedupe, FILE_COMPLETE
+                            // carries it for a delta rebuild to match
+    QString sameAs;         // FILE_HEADER: an earlier file of the same transfer with this content
+    QByteArray digest;      // FILE_COMPLETE: XXH64 of the file as the sender read it
+    bool frameChecks = false; // CONNECTION_REQUEST/ACCEPT: data frames sent to us carry a CRC32C
+    qint64 length = 0;      // Bytes from offset a FRAME_NACK asks for again, or a FRAME_REPAIR carries
+    bool holeMaps = false;  // CONNECTION_REQUEST/ACCEPT: sparse files may be sent to us without their holes
+    QJsonArray extents;     // HOLE_MAP: [offset, length] of each data extent; the rest of the file is holes
+    qint64 maxChunk = 0;    // CONNECTION_REQUEST/ACCEPT: largest data frame to send us
+    bool linkProbe = false; // CONNECTION_REQUEST/ACCEPT: we answer a link probe after the accept
+    qint64 rate = 0;        // LINK_PROBE_RESULT: bytes per second the probe burst arrived at
     
+    // Optional fields are only written when set to keep control frames small
     QByteArray toJson() const {
         QJsonObject obj;
         obj["type"] = type;
@@ -101,6 +177,33 @@ struct TransferHeader {
         obj["totalFiles"] = totalFiles;
         obj["currentFileIndex"] = currentFileIndex;
         obj["senderName"] = senderName;
+        if (offset > 0) obj["offset"] = offset;
+        if (resume) obj["resume"] = true;
+        if (!token.isEmpty()) obj["token"] = token;
+        if (!poolSecret.isEmpty()) obj["poolSecret"] = poolSecret;
+        if (!contentId.isEmpty()) obj["contentId"] = contentId;
+        if (!manifest.isEmpty()) obj["manifest"] = manifest;
+        if (!pieces.isEmpty()) obj["pieces"] = pieces;
+        if (!bitfield.isEmpty()) obj["bitfield"] = QString::fromLatin1(bitfield.toBase64());
+        if (!entries.isEmpty()) obj["entries"] = entries;
+        if (totalSize > 0) obj["totalSize"] = totalSize;
+        if (lastPage) obj["lastPage"] = true;
+        if (mirror) obj["mirror"] = true;
+        if (deletes) obj["deletes"] = true;
+        if (modified > 0) obj["modified"] = modified;
+        if (type == TransferType::MIRROR_WANT) obj["wanted"] = wanted;
+        if (delta) obj["delta"] = true;
+        if (!signature.isEmpty()) obj["signature"] = QString::fromLatin1(signature.toBase64());
+        if (!checksum.isEmpty()) obj["checksum"] = QString::fromLatin1(checksum.toHex());
+        if (!sameAs.isEmpty()) obj["sameAs"] = sameAs;
+        if (!digest.isEmpty()) obj["digest"] = QString::fromLatin1(digest.toHex());
+        if (frameChecks) obj["frameChecks"] = true;
+        if (length > 0) obj["length"] = length;
+        if (holeMaps) obj["holeMaps"] = true;
+        if (type == TransferType::HOLE_MAP) obj["extents"] = extents;
+        if (maxChunk > 0) obj["maxChunk"] = maxChunk;
+        if (linkProbe) obj["linkProbe"] = true;
+        if (rate > 0) obj["rate"] = rate;
         return QJsonDocument(obj).toJson(QJsonDocument::Compact);
     }
     
@@ -117,6 +220,33 @@ struct TransferHeader {
             header.totalFiles = obj["totalFiles"].toVariant().toLongLong();
             header.currentFileIndex = obj["currentFileIndex"].toVariant().toLongLong();
             header.senderName = obj["senderName"].toString();
+            header.offset = obj["offset"].toVariant().toLongLong();
+            header.resume = obj["resume"].toBool();
+            header.token = obj["token"].toString();
+            header.poolSecret = obj["poolSecret"].toString();
+            header.contentId = obj["contentId"].toString();
+            header.manifest = obj["manifest"].toObject();
+            header.pieces = obj["pieces"].toArray();
+            header.bitfield = QByteArray::fromBase64(obj["bitfield"].toString().toLatin1());
+            header.entries = obj["entries"].toArray();
+            header.totalSize = obj["totalSize"].toVariant().toLongLong();
+            header.lastPage = obj["lastPage"].toBool();
+            header.mirror = obj["mirror"].toBool();
+            header.deletes = obj["deletes"].toBool();
+            header.modified = obj["modified"].toVariant().toLongLong();
+            header.wanted = obj["wanted"].toArray();
+            header.delta = obj["delta"].toBool();
+            header.signature = QByteArray::fromBase64(obj["signature"].toString().toLatin1());
+            header.checksum = QByteArray::fromHex(obj["checksum"].toString().toLatin1());
+            header.sameAs = obj["sameAs"].toString();
+            header.digest = QByteArray::fromHex(obj["digest"].toString().toLatin1());
+            header.frameChecks = obj["frameChecks"].toBool();
+            header.length = obj["length"].toVariant().toLongLong();
+            header.holeMaps = obj["holeMaps"].toBool();
+            header.extents = obj["extents"].toArray();
+            header.maxChunk = obj["maxChunk"].toVariant().toLongLong();
+            header.linkProbe = obj["linkProbe"].toBool();
+            header.rate = obj["rate"].toVariant().toLongLong();
         }
         return header;
     }
@@ -0,0 +1,214 @@
+#include "SessionPool.h"
+#include <QSettings>
+#include <algorithm>
+
+namespace Witra {
+
+SessionPool::SessionPool(QObject* parent)
+    : QObject(parent)
+    , m_reapTimer(new QTimer(this))
+    , m_idleTimeout(DEFAULT_POOL_IDLE_TIMEOUT)
+    , m_prewarm(true)
+    , m_warmSessions(DEFAULT_POOL_WARM_SESSIONS)
+    , m_hits(0)
+    , m_misses(0)
+    , m_reaped(0)
+{
+    QSettings settings;
+    m_idleTimeout = settings.value("pool/idleTimeout", DEFAULT_POOL_IDLE_TIMEOUT).toInt();
+    m_prewarm = settings.value("pool/prewarm", true).toBool();
+    m_warmSessions = qBound(1, settings.value("pool/warmSessions", DEFAULT_POOL_WARM_SESSIONS).toInt(),
+                            MAX_POOLED_SESSIONS_PER_PEER);
+    
+    connect(m_reapTimer, &QTimer::timeout, this, &SessionPool::reapIdleSessions);
+    m_reapTimer->start(POOL_REAP_INTERVAL);
+}
+
+TransferSession* SessionPool::acquire(const QString& peerId)
+{
+    prune(peerId);
+    
+    TransferSession* best = nullptr;
+    for (const QPointer<TransferSession>& session : m_sessions.value(peerId)) {
+        if (!session->isBusy()) {
+            best = session;
+            break;
+        }
+        // All busy: fall back to the one with the shortest send queue
+        if (!best || session->queuedFiles() < best->queuedFiles()) {
+            best = session;
+        }
+    }
+    
+    if (best) {
+        ++m_hits;
+    } else {
+        ++m_misses;
+    }
+    emit statsChanged();
+    
+    return best;
+}
+
+void SessionPool::add(TransferSession* session)
+{
+    if (!session || session->peerId().isEmpty()) return;
+    
+    const QString peerId = session->peerId();
+    m_pending[peerId].removeAll(QPointer<TransferSession>(session));
+    
+    QList<QPointer<TransferSession>>& sessions = m_sessions[peerId];
+    if (sessions.contains(QPointer<TransferSession>(session))) return;
+    
+    sessions.append(session);
+    connect(session, &TransferSession::disconnected, this, [this, peerId]() {
+        prune(peerId);
+        emit statsChanged();
+    });
+    
+    emit statsChanged();
+}
+
+void SessionPool::addPending(const QString& peerId, TransferSession* session)
+{
+    if (!session) return;
+    m_pending[peerId].append(session);
+}
+
+int SessionPool::sessionCount(const QString& peerId) const
+{
+    int count = 0;
+    for (const QPointer<TransferSession>& session : m_sessions.value(peerId)) {
+        if (session) ++count;
+    }
+    return count;
+}
+
+int SessionPool::idleCount(const QString& peerId) const
+{
+    int count = 0;
+    for (const QPointer<TransferSession>& session : m_sessions.value(peerId)) {
+        if (session && !session->isBusy()) ++count;
+    }
+    return count;
+}
+
+int SessionPool::pendingCount(const QString& peerId) const
+{
+    int count = 0;
+    for (const QPointer<TransferSession>& session : m_pending.value(peerId)) {
+        if (session) ++count;
+    }
+    return count;
+}
+
+bool SessionPool::needsWarmSession(const QString& peerId) const
+{
+    if (!m_prewarm) return false;
+    
+    int total = sessionCount(peerId) + pendingCount(peerId);
+    if (total >= MAX_POOLED_SESSIONS_PER_PEER) return false;
+    
+    // Keep the warm target, and one spare whenever every session is busy
+    return total < m_warmSessions || (idleCount(peerId) == 0 && pendingCount(peerId) == 0);
+}
+
+void SessionPool::setIdleTimeout(int msecs)
+{
+    m_idleTimeout = msecs;
+    
+    QSettings settings;
+    settings.setValue("pool/idleTimeout", msecs);
+}
+
+void SessionPool::setPrewarmEnabled(bool enabled)
+{
+    m_prewarm = enabled;
+    
+    QSettings settings;
+    settings.setValue("pool/prewarm", enabled);
+}
+
+SessionPool::Stats SessionPool::stats() const
+{
+    Stats result;
+    result.hits = m_hits;
+    result.misses = m_misses;
+    result.reaped = m_reaped;
+    for (const QString& peerId : m_sessions.keys()) {
+        result.established += sessionCount(peerId);
+        for (const QPointer<TransferSession>& session : m_sessions.value(peerId)) {
+            if (session) {
+                result.largestChunk = qMax(result.largestChunk, session->sendStats().chunkSize);
+            }
+        }
+    }
+    for (const QString& peerId : m_pending.keys()) {
+        result.pending += pendingCount(peerId);
+    }
+    return result;
+}
+
+void SessionPool::reapIdleSessions()
+{
+    bool changed = false;
+    
+    for (const QString& peerId : m_sessions.keys()) {
+        prune(peerId);
+        
+        // Only the side that opened a session closes it, and each side keeps
+        // the last one it opened, so the two ends never both close the
+        // session the other meant to keep and drop the peer
+        QList<QPointer<TransferSession>> sessions = m_sessions.value(peerId);
+        int remaining = 0;
+        for (const QPointer<TransferSession>& session : sessions) {
+            if (!session->isIncoming()) ++remaining;
+        }
+        
+        for (const QPointer<TransferSession>& session : sessions) {
+            if (remaining <= 1) break;
+            if (session->isIncoming()) continue;
+            if (session->isBusy() || session->idleTime() < m_idleTimeout) continue;
+            
+            m_sessions[peerId].removeAll(session);
+            session->disconnectFromPeer();
+            --remaining;
+            ++m_reaped;
+            changed = true;
+        }
+    }
+    
+    if (changed) {
+        emit statsChanged();
+    }
+}
+
+void SessionPool::prune(const QString& peerId)
+{
+    auto isGone = [](const QPointer<TransferSession>& session) {
+        return session.isNull() ||
+               session->socket()->state() != QAbstractSocket::ConnectedState;
+    };
+    
+    if (m_sessions.contains(peerId)) {
+        QList<QPointer<TransferSession>>& sessions = m_sessions[peerId];
+        sessions.erase(std::remove_if(sessions.begin(), sessions.end(), isGone), sessions.end());
+        if (sessions.isEmpty()) {
+            m_sessions.remove(peerId);
+        }
+    }
+    
+    if (m_pending.contains(peerId)) {
+        QList<QPointer<TransferSession>>& pending = m_pending[peerId];
+        pending.erase(std::remove_if(pending.begin(), pending.end(),
+                                     [](const QPointer<TransferSession>& session) {
+                                         return session.isNull();
+                                     }),
+                      pending.end());
+        if (pending.isEmpty()) {
+            m_pending.remove(peerId);
+        }
+    }
+}
+
+} // namespace Witra
@@ -0,0 +1,90 @@
+#ifndef SESSIONPOOL_H
+#define SESSIONPOOL_H
+
+#include <QObject>
+#include <QHash>
+#include <QList>
+#include <QPointer>
+#include <QTimer>
+#include "TransferSession.h"
+
+namespace Witra {
+
+// How often idle sessions are checked (ms)
+constexpr int POOL_REAP_INTERVAL = 5000;
+
+// Sessions idle for longer than this are closed (ms)
+constexpr int DEFAULT_POOL_IDLE_TIMEOUT = 60000;
+
+// Established sessions kept ready per connected peer when pre-warming
+constexpr int DEFAULT_POOL_WARM_SESSIONS = 2;
+
+// Upper bound on pooled sessions per peer
+constexpr int MAX_POOLED_SESSIONS_PER_PEER = 4;
+
+// Per-peer pool of accepted sessions. Hands out established connections so a
+// new transfer starts without a handshake, and closes surplus idle ones.
+class SessionPool : public QObject {
+    Q_OBJECT
+    
+public:
+    struct Stats {
+        quint64 hits = 0;
+        quint64 misses = 0;
+        int established = 0;
+        int pending = 0;
+        quint64 reaped = 0;
+        qint64 largestChunk = 0; // biggest data frame any session has settled on
+        
+        double hitRate() const {
+            quint64 total = hits + misses;
+            return total ? static_cast<double>(hits) / static_cast<double>(total) : 0.0;
+        }
+    };
+    
+    explicit SessionPool(QObject* parent = nullptr);
+    
+    // Best established session for the peer (idle first), or nullptr on a miss
+    TransferSession* acquire(const QString& peerId);
+    
+    // Accepted sessions join the pool; connecting ones are tracked as pending
+    void add(TransferSession* session);
+    void addPending(const QString& peerId, TransferSession* session);
+    
+    int sessionCount(const QString& peerId) const;
+    int idleCount(const QString& peerId) const;
+    int pendingCount(const QString& peerId) const;
+    bool needsWarmSession(const QString& peerId) const;
+    
+    // Settings
+    int idleTimeout() const { return m_idleTimeout; }
+    void setIdleTimeout(int msecs);
+    bool prewarmEnabled() const { return m_prewarm; }
+    void setPrewarmEnabled(bool enabled);
+    int warmSessions() const { return m_warmSessions; }
+    
+    Stats stats() const;
+    
+signals:
+    void statsChanged();
+    
+private slots:
+    void reapIdleSessions();
+    
+private:
+    void prune(const QString& peerId);
+    
+    QHash<QString, QList<QPointer<TransferSession>>> m_sessions;
+    QHash<QString, QList<QPointer<TransferSession>>> m_pending;
+    QTimer* m_reapTimer;
+    int m_idleTimeout;
+    bool m_prewarm;
+    int m_warmSessions;
+    quint64 m_hits;
+    quint64 m_misses;
+    quint64 m_reaped;
+};
+
+} // namespace Witra
+
+#endif // SESSIONPOOL_H
@@ -0,0 +1,113 @@
+#include "SharedChunkStream.h"
+#include "Protocol.h"
+#include "ChunkPool.h"
+#include <limits>
+
+namespace Witra {
+
+SharedChunkStream::SharedChunkStream(const QString& filePath, QObject* parent)
+    : QObject(parent)
+    , m_filePath(filePath)
+    , m_file(filePath)
+    , m_size(0)
+    , m_chunkCount(0)
+    , m_firstChunk(0)
+{
+}
+
+bool SharedChunkStream::open()
+{
+    if (!m_file.open(QIODevice::ReadOnly)) return false;
+    
+    m_size = m_file.size();
+    m_chunkCount = (m_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    if (m_size >= PAGE_CACHE_MIN_FILE_SIZE && PageCacheWindow::enabled()) {
+        m_cache.attach(&m_file, PageCacheWindow::Mode::Read);
+    }
+    return true;
+}
+
+void SharedChunkStream::addReader(const QObject* reader)
+{
+    // Late readers can only join while the first chunk is still held
+    m_positions.insert(reader, m_firstChunk);
+}
+
+void SharedChunkStream::removeReader(const QObject* reader)
+{
+    if (!m_positions.remove(reader)) return;
+    
+    // The slowest reader may have just left
+    const qint64 before = m_firstChunk;
+    dropConsumed();
+    if (m_firstChunk != before) {
+        emit chunksAvailable();
+    }
+}
+
+QByteArray SharedChunkStream::nextChunk(const QObject* reader)
+{
+    auto it = m_positions.find(reader);
+    if (it == m_positions.end() || it.value() >= m_chunkCount) return QByteArray();
+    
+    const qint64 index = it.value();
+    if (index >= m_firstChunk + m_chunks.size()) {
+        readAhead();
+        if (index >= m_firstChunk + m_chunks.size()) return QByteArray();
+    }
+    
+    QByteArray chunk = m_chunks.at(static_cast<int>(index - m_firstChunk));
+    ++it.value();
+    
+    // Advancing the slowest reader frees window space for the others
+    const qint64 before = m_firstChunk;
+    dropConsumed();
+    if (m_firstChunk != before) {
+        emit chunksAvailable();
+    }
+    
+    return chunk;
+}
+
+bool SharedChunkStream::atEnd(const QObject* reader) const
+{
+    return m_positions.value(reader, m_chunkCount) >= m_chunkCount;
+}
+
+qint64 SharedChunkStream::slowestPosition() const
+{
+    qint64 slowest = std::numeric_limits<qint64>::max();
+    for (qint64 position : m_positions) {
+        slowest = qMin(slowest, position);
+    }
+    return slowest;
+}
+
+void SharedChunkStream::readAhead()
+{
+    const qint64 limit = qMin(m_chunkCount, slowestPosition() + SHARED_STREAM_WINDOW);
+    
+    while (m_firstChunk + m_chunks.size() < limit) {
+        QByteArray chunk = ChunkPool::instance().acquire(CHUNK_SIZE);
+        chunk.resize(static_cast<int>(qMax<qint64>(0, m_file.read(chunk.data(), CHUNK_SIZE))));
+        if (chunk.isEmpty()) {
+            // File shrank underneath us; end the stream where it stopped
+            m_chunkCount = m_firstChunk + m_chunks.size();
+            break;
+        }
+        m_chunks.enqueue(chunk);
+    }
+    m_cache.advance(m_file.pos());
+}
+
+void SharedChunkStream::dropConsumed()
+{
+    const qint64 slowest = slowestPosition();
+    while (!m_chunks.isEmpty() && m_firstChunk < slowest) {
+        QByteArray chunk = m_chunks.dequeue();
+        ChunkPool::instance().release(chunk);
+        ++m_firstChunk;
+    }
+}
+
+} // namespace Witra
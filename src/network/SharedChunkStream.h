@@ -0,0 +1,60 @@
+#ifndef SHAREDCHUNKSTREAM_H
+#define SHAREDCHUNKSTREAM_H
+
+#include <QObject>
+#include <QFile>
+#include <QHash>
+#include <QQueue>
+#include "core/PageCacheWindow.h"
+
+namespace Witra {
+
+// Chunks read ahead of the slowest reader of a shared stream
+constexpr int SHARED_STREAM_WINDOW = 64;
+
+// Reads a file once and hands the same chunks to several sessions. Chunks are
+// implicitly shared, so every session writes the one copy; a chunk is dropped
+// once all readers are past it, and the slowest reader bounds the read-ahead.
+class SharedChunkStream : public QObject {
+    Q_OBJECT
+    
+public:
+    explicit SharedChunkStream(const QString& filePath, QObject* parent = nullptr);
+    
+    bool open();
+    QString filePath() const { return m_filePath; }
+    qint64 size() const { return m_size; }
+    
+    void addReader(const QObject* reader);
+    void removeReader(const QObject* reader);
+    int readerCount() const { return m_positions.size(); }
+    
+    // Next chunk for the reader; null while it is a full window ahead
+    QByteArray nextChunk(const QObject* reader);
+    bool atEnd(const QObject* reader) const;
+    
+    // Chunks held in memory right now
+    int bufferedChunks() const { return m_chunks.size(); }
+    
+signals:
+    // A reader that got a null chunk may try again
+    void chunksAvailable();
+    
+private:
+    qint64 slowestPosition() const;
+    void readAhead();
+    void dropConsumed();
+    
+    QString m_filePath;
+    QFile m_file;
+    PageCacheWindow m_cache;
+    qint64 m_size;
+    qint64 m_chunkCount;
+    QQueue<QByteArray> m_chunks;
+    qint64 m_firstChunk; // index of m_chunks.head()
+    QHash<const QObject*, qint64> m_positions; // next chunk index per reader
+};
+
+} // namespace Witra
+
+#endif // SHAREDCHUNKSTREAM_H
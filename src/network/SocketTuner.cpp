@@ -0,0 +1,189 @@
+#include "SocketTuner.h"
+#include "ChunkSizer.h"
+#include <QFile>
+#include <QSettings>
+#include <QStringList>
+#include <QTcpSocket>
+
+#if defined(Q_OS_LINUX) || defined(Q_OS_MACOS)
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#endif
+
+namespace Witra {
+
+namespace {
+
+#if defined(Q_OS_LINUX)
+qint64 readProc(const char* path, int field)
+{
+    QFile file(QString::fromLatin1(path));
+    if (!file.open(QIODevice::ReadOnly)) return -1;
+    const QList<QByteArray> values = file.readAll().simplified().split(' ');
+    return field < values.size() ? values.at(field).toLongLong() : -1;
+}
+
+// net.core.wmem_max or rmem_max; setsockopt() silently caps at it
+qint64 kernelLimit(QAbstractSocket::SocketOption option)
+{
+    static const qint64 send = readProc("/proc/sys/net/core/wmem_max", 0);
+    static const qint64 receive = readProc("/proc/sys/net/core/rmem_max", 0);
+    return option == QAbstractSocket::SendBufferSizeSocketOption ? send : receive;
+}
+
+// Largest buffer the kernel's own autotuning grows to (tcp_wmem, tcp_rmem)
+qint64 autotuneLimit(QAbstractSocket::SocketOption option)
+{
+    static const qint64 send = readProc("/proc/sys/net/ipv4/tcp_wmem", 2);
+    static const qint64 receive = readProc("/proc/sys/net/ipv4/tcp_rmem", 2);
+    return option == QAbstractSocket::SendBufferSizeSocketOption ? send : receive;
+}
+#endif
+
+} // namespace
+
+SocketTuner::Profile SocketTuner::profileFor(const QString& peerId)
+{
+    Profile profile;
+    QSettings settings;
+    
+    QStringList groups{QStringLiteral("tuning")};
+    if (!peerId.isEmpty()) groups.append(QStringLiteral("tuning/peers/") + peerId);
+    
+    for (const QString& group : groups) {
+        settings.beginGroup(group);
+        const QString buffers = settings.value("buffers").toString();
+        if (buffers == "auto") {
+            profile.autoBuffers = true;
+            profile.bufferSize = 0;
+        } else if (buffers == "system") {
+            profile.autoBuffers = false;
+            profile.bufferSize = 0;
+        } else if (buffers.toInt() > 0) {
+            profile.autoBuffers = false;
+            profile.bufferSize = buffers.toInt();
+        }
+        profile.noDelay = settings.value("noDelay", profile.noDelay).toBool();
+        profile.congestion = settings.value("congestion", profile.congestion).toString();
+        settings.endGroup();
+    }
+    return profile;
+}
+
+int SocketTuner::roundTripTime(qintptr descriptor)
+{
+    if (descriptor == -1) return -1;
+    
+#if defined(Q_OS_LINUX)
+    tcp_info info = {};
+    socklen_t size = sizeof(info);
+    if (::getsockopt(static_cast<int>(descriptor), IPPROTO_TCP, TCP_INFO, &info, &size) != 0) {
+        return -1;
+    }
+    return static_cast<int>(info.tcpi_rtt);
+#elif defined(Q_OS_MACOS)
+    tcp_connection_info info = {};
+    socklen_t size = sizeof(info);
+    if (::getsockopt(static_cast<int>(descriptor), IPPROTO_TCP, TCP_CONNECTION_INFO,
+                     &info, &size) != 0) {
+        return -1;
+    }
+    return static_cast<int>(info.tcpi_srtt * 1000);
+#else
+    return -1;
+#endif
+}
+
+SocketTuner::SocketTuner()
+    : m_socket(nullptr)
+    , m_sendBuffer(0)
+    , m_receiveBuffer(0)
+    , m_receiveRate(0)
+    , m_windowBytes(0)
+{
+}
+
+void SocketTuner::apply(QTcpSocket* socket, const Profile& profile)
+{
+    m_socket = socket;
+    m_profile = profile;
+    if (!m_socket) return;
+    
+    m_socket->setSocketOption(QAbstractSocket::LowDelayOption, profile.noDelay ? 1 : 0);
+    if (profile.bufferSize > 0) {
+        m_socket->setSocketOption(QAbstractSocket::SendBufferSizeSocketOption, profile.bufferSize);
+        m_socket->setSocketOption(QAbstractSocket::ReceiveBufferSizeSocketOption, profile.bufferSize);
+    }
+    
+#if defined(Q_OS_LINUX) && defined(TCP_CONGESTION)
+    const qintptr descriptor = m_socket->socketDescriptor();
+    if (!profile.congestion.isEmpty() && descriptor != -1) {
+        // Refused where the module is missing or not allowed; the system's stays
+        const QByteArray name = profile.congestion.toLatin1();
+        ::setsockopt(static_cast<int>(descriptor), IPPROTO_TCP, TCP_CONGESTION,
+                     name.constData(), static_cast<socklen_t>(name.size()));
+    }
+#endif
+}
+
+void SocketTuner::tuneSend(qint64 throughput, int rtt)
+{
+    grow(QAbstractSocket::SendBufferSizeSocketOption, throughput, rtt, m_sendBuffer);
+}
+
+void SocketTuner::addReceived(qint64 bytes)
+{
+    if (!m_socket || !m_profile.autoBuffers) return;
+    
+    if (!m_window.isValid()) {
+        m_window.start();
+        m_windowBytes = 0;
+    }
+    m_windowBytes += bytes;
+    
+    // Windowed like the sender's, so an idle gap does not read as a slow link
+    const qint64 elapsed = m_window.elapsed();
+    if (elapsed < CHUNK_SAMPLE_INTERVAL) return;
+    
+    if (elapsed < CHUNK_SAMPLE_STALE) {
+        const qint64 rate = m_windowBytes * 1000 / elapsed;
+        m_receiveRate = m_receiveRate ? (3 * m_receiveRate + rate) / 4 : rate;
+        grow(QAbstractSocket::ReceiveBufferSizeSocketOption, m_receiveRate,
+             roundTripTime(m_socket->socketDescriptor()), m_receiveBuffer);
+    }
+    m_window.start();
+    m_windowBytes = 0;
+}
+
+void SocketTuner::seedReceive(qint64 throughput, int rtt)
+{
+    if (throughput <= 0) return;
+    m_receiveRate = throughput;
+    grow(QAbstractSocket::ReceiveBufferSizeSocketOption, throughput, rtt, m_receiveBuffer);
+}
+
+void SocketTuner::grow(QAbstractSocket::SocketOption option, qint64 throughput, int rtt, int& applied)
+{
+    if (!m_socket || !m_profile.autoBuffers || throughput <= 0 || rtt <= 0) return;
+    
+    qint64 target = qBound<qint64>(SOCKET_BUFFER_MIN, 2 * throughput * rtt / 1000000,
+                                   SOCKET_BUFFER_MAX);
+    qint64 effective = target;
+#if defined(Q_OS_LINUX)
+    // The kernel caps the request and then doubles it for its own overhead.
+    // Setting a buffer ends autotuning for it, so that has to be outgrown
+    if (kernelLimit(option) > 0) target = qMin(target, kernelLimit(option));
+    effective = 2 * target;
+    if (effective <= autotuneLimit(option)) return;
+#endif
+    
+    // Worth a syscall only for a real step up
+    const int current = qMax(applied, m_socket->socketOption(option).toInt());
+    if (effective <= current + current / 4) return;
+    
+    m_socket->setSocketOption(option, static_cast<int>(target));
+    applied = static_cast<int>(effective);
+}
+
+} // namespace Witra
@@ -0,0 +1,71 @@
+#ifndef SOCKETTUNER_H
+#define SOCKETTUNER_H
+
+#include <QAbstractSocket>
+#include <QElapsedTimer>
+#include <QString>
+
+class QTcpSocket;
+
+namespace Witra {
+
+// Smallest and largest socket buffers the automatic sizing asks for
+constexpr int SOCKET_BUFFER_MIN = 256 * 1024;
+constexpr int SOCKET_BUFFER_MAX = 16 * 1024 * 1024;
+
+// Sets up a session's socket for the link it runs over. Frames go out
+// without waiting on Nagle, and once the round trip time and rate are
+// measured the kernel buffers are raised to twice the bandwidth-delay
+// product, so a long fat link is not held to a LAN-sized window. Buffers
+// only grow, and only past what the system already gives them: on Linux
+// setting one turns the kernel's own autotuning off for it.
+//
+// Settings under "tuning/" hold the defaults and "tuning/peers/<peer id>/"
+// overrides them for one peer:
+//   buffers     "auto", "system", or a fixed size in bytes
+//   noDelay     false to let Nagle batch small frames
+//   congestion  a Linux congestion control such as "bbr"
+class SocketTuner {
+public:
+    struct Profile {
+        bool autoBuffers = true;
+        int bufferSize = 0; // fixed send and receive buffers; 0 leaves the system's
+        bool noDelay = true;
+        QString congestion; // empty for the system's
+    };
+    
+    static Profile profileFor(const QString& peerId);
+    
+    // Smoothed round trip time of a TCP socket in µs, or -1
+    static int roundTripTime(qintptr descriptor);
+    
+    SocketTuner();
+    
+    // Again whenever the peer, and so maybe the profile, changes
+    void apply(QTcpSocket* socket, const Profile& profile);
+    
+    // The sender's measured rate (bytes per second) and round trip (µs)
+    void tuneSend(qint64 throughput, int rtt);
+    
+    // Bytes read off the socket; the receive buffer follows their rate
+    void addReceived(qint64 bytes);
+    
+    // Starts the receive rate from an earlier session's
+    void seedReceive(qint64 throughput, int rtt);
+    qint64 receiveRate() const { return m_receiveRate; }
+    
+private:
+    void grow(QAbstractSocket::SocketOption option, qint64 throughput, int rtt, int& applied);
+    
+    QTcpSocket* m_socket;
+    Profile m_profile;
+    int m_sendBuffer;    // what we last asked for, 0 for nothing yet
+    int m_receiveBuffer;
+    qint64 m_receiveRate;
+    QElapsedTimer m_window;
+    qint64 m_windowBytes;
+};
+
+} // namespace Witra
+
+#endif // SOCKETTUNER_H
@@ -1,46 +1,171 @@
 #include "TransferSession.h"
+#include "ChunkPool.h"
+#include "core/TransferJournal.h"
+#include "core/PieceStore.h"
+#include "core/ContentIndex.h"
+#include "core/HashCache.h"
+#include "core/Crc32c.h"
+#include "core/DirectWriter.h"
+#include <QDateTime>
 #include <QDir>
-#include <QDirIterator>
 #include <QFileInfo>
+#include <QLocale>
+#include <QSettings>
+#include <QStorageInfo>
+#include <QThreadPool>
 #include <QTimer>
+#include <QtEndian>
+#include <cstring>
+#include <filesystem>
 
 namespace Witra {
 
+namespace {
+
+// A path from the peer may only name something below the download folder:
+// nothing absolute, and no empty, "." or ".." components
+bool isSafeRelativePath(const QString& path)
+{
+    if (path.isEmpty() || QDir::isAbsolutePath(path)) return false;
+#if defined(Q_OS_WIN)
+    if (path.contains('\\') || path.contains(':')) return false;
+#endif
+    const QStringList parts = path.split('/');
+    for (const QString& part : parts) {
+        if (part.isEmpty() || part == "." || part == "..") return false;
+    }
+    return true;
+}
+
+// Atomically swaps a finished file in over an existing one
+bool replaceFile(const QString& from, const QString& to)
+{
+    std::error_code error;
+    std::filesystem::rename(std::filesystem::path(from.toStdU16String()),
+                            std::filesystem::path(to.toStdU16String()), error);
+    return !error;
+}
+
+QJsonObject manifestEntry(const ScanEntry& entry)
+{
+    QJsonObject obj;
+    obj["path"] = entry.relativePath;
+    obj["size"] = entry.size;
+    obj["mtime"] = entry.modified;
+    if (!entry.hash.isEmpty()) obj["hash"] = QString::fromLatin1(entry.hash.toHex());
+    return obj;
+}
+
+} // namespace
+
 TransferSession::TransferSession(QTcpSocket* socket, QObject* parent)
     : QObject(parent)
     , m_socket(socket)
+    , m_frameWriter(socket)
     , m_sessionId(generateUniqueId())
     , m_isIncoming(false)
     , m_state(State::Idle)
+    , m_accepted(false)
+    , m_journal(nullptr)
+    , m_pieceStore(nullptr)
+    , m_contentIndex(nullptr)
+    , m_hashCache(nullptr)
     , m_expectedSize(0)
     , m_expectingHeader(true)
+    , m_inputHeld(false)
+    , m_frameChecks(true)
+    , m_peerFrameChecks(false)
+    , m_peerHoleMaps(false)
     , m_currentFile(nullptr)
     , m_currentFileSize(0)
     , m_currentBytesReceived(0)
     , m_totalFiles(0)
     , m_currentFileIndex(0)
+    , m_receiveTransferBase(0)
+    , m_mirrorDeletes(false)
+    , m_mirrorWantedFiles(0)
+    , m_mirrorWantedBytes(0)
+    , m_currentModified(0)
+    , m_currentDeltaOffered(false)
+    , m_deltaReceive(false)
+    , m_deltaBase(nullptr)
+    , m_deltaBlockSize(0)
+    , m_deltaBaseSize(0)
+    , m_deltaHash(QCryptographicHash::Sha256)
+    , m_verifier(new StreamVerifier(this))
+    , m_repairRequests(0)
+    , m_repairOffset(-1)
+    , m_repairRemaining(0)
+    , m_repairHeld(false)
+    , m_currentSparse(false)
+    , m_currentExtentIndex(0)
+    , m_pieceIndex(-1)
+    , m_pieceRemaining(0)
     , m_sendFile(nullptr)
     , m_sendTotalSize(0)
     , m_sendBytesSent(0)
+    , m_sendTransferBase(0)
+    , m_sendFileIndex(0)
+    , m_sendTotalFiles(0)
+    , m_sendReader(new UringReader(this))
+    , m_awaitingResumeAck(false)
+    , m_waitingForWrite(false)
+    , m_awaitingDelta(false)
+    , m_sendDelta(false)
+    , m_deltaOpIndex(0)
+    , m_deltaOpDone(0)
+    , m_sendHashing(false)
+    , m_sendSparse(false)
+    , m_sendExtentIndex(0)
+    , m_probeState(ProbeState::Idle)
+    , m_probeClaimed(false)
+    , m_probeSent(false)
+    , m_probeSending(false)
+    , m_probeReceived(0)
+    , m_probeSendRate(-1)
+    , m_probeReceiveRate(-1)
+    , m_probeRtt(-1)
 {
+    m_lastActivity.start();
+    m_frameChecks = QSettings().value("transfer/frameChecks", true).toBool();
+    connect(m_verifier, &StreamVerifier::finished, this, &TransferSession::onFileVerified);
+    connect(m_sendReader, &UringReader::readable,
+            this, &TransferSession::sendNextChunk, Qt::QueuedConnection);
+    
     if (m_socket) {
         m_socket->setParent(this);
         connect(m_socket, &QTcpSocket::readyRead, this, &TransferSession::onReadyRead);
         connect(m_socket, &QTcpSocket::disconnected, this, &TransferSession::onDisconnected);
         connect(m_socket, &QTcpSocket::errorOccurred, this, &TransferSession::onSocketError);
+        connect(m_socket, &QTcpSocket::bytesWritten, this, &TransferSession::onBytesWritten);
+        
+        // Options only stick once the socket exists, so outgoing ones wait
+        connect(m_socket, &QTcpSocket::connected, this, &TransferSession::applyTuning);
+        applyTuning();
     }
 }
 
 TransferSession::~TransferSession()
 {
+    endProbe();
+    rememberLink();
     if (m_currentFile) {
         m_currentFile->close();
         delete m_currentFile;
     }
-    if (m_sendFile) {
-        m_sendFile->close();
-        delete m_sendFile;
-    }
+    abortSending();
+}
+
+void TransferSession::setPeerId(const QString& id)
+{
+    m_peerId = id;
+    applyTuning();
+}
+
+void TransferSession::applyTuning()
+{
+    if (!m_socket || m_socket->state() != QAbstractSocket::ConnectedState) return;
+    m_socketTuner.apply(m_socket, SocketTuner::profileFor(m_peerId));
 }
 
 QHostAddress TransferSession::peerAddress() const
@@ -48,24 +173,47 @@ QHostAddress TransferSession::peerAddress() const
     return m_socket ? m_socket->peerAddress() : QHostAddress();
 }
 
-void TransferSession::sendConnectionRequest(const QString& senderName, const QString& senderId)
+void TransferSession::sendConnectionRequest(const QString& senderName, const QString& senderId,
+                                            const QString& reconnectToken, const QString& poolSecret)
 {
     TransferHeader header;
     header.type = TransferType::CONNECTION_REQUEST;
     header.senderName = senderName;
     header.transferId = senderId;
+    header.token = reconnectToken;
+    header.poolSecret = poolSecret;
+    header.contentId = m_swarmContent;
+    header.frameChecks = m_frameChecks;
+    header.holeMaps = true;
+    header.maxChunk = MAX_CHUNK_SIZE;
+    header.linkProbe = true;
     
     sendHeader(header);
     m_state = State::WaitingForAccept;
+    
+    // A trusted peer accepts on sight, so queued files follow the request in
+    // the same flight instead of waiting a round trip for the accept
+    if (!reconnectToken.isEmpty()) {
+        m_accepted = true;
+        startNextFile();
+    }
 }
 
-void TransferSession::sendConnectionAccept()
+void TransferSession::sendConnectionAccept(const QString& issuedToken, const QString& poolSecret)
 {
     TransferHeader header;
     header.type = TransferType::CONNECTION_ACCEPT;
+    header.token = issuedToken;
+    header.poolSecret = poolSecret;
+    header.frameChecks = m_frameChecks;
+    header.holeMaps = true;
+    header.maxChunk = MAX_CHUNK_SIZE;
+    header.linkProbe = true;
     
     sendHeader(header);
     m_state = State::Accepted;
+    m_accepted = true;
+    startNextFile();
 }
 
 void TransferSession::sendConnectionReject()
@@ -78,49 +226,255 @@ void TransferSession::sendConnectionReject()
 }
 
 void TransferSession::sendFile(const QString& filePath, const QString& transferId,
-                               const QString& relativePath, qint64 totalFiles, qint64 currentFile)
+                               const QString& relativePath, qint64 totalFiles, qint64 currentFile,
+                               bool resume)
 {
-    QFileInfo fileInfo(filePath);
-    if (!fileInfo.exists() || !fileInfo.isFile()) {
-        emit transferFailed(transferId, tr("File not found: %1").arg(filePath));
-        return;
+    OutgoingFile file;
+    file.filePath = filePath;
+    file.transferId = transferId;
+    file.relativePath = relativePath;
+    file.totalFiles = totalFiles;
+    file.fileIndex = currentFile;
+    file.resume = resume;
+    
+    m_sendQueue.enqueue(file);
+    
+    // Files go out one after another once the connection has been accepted
+    if (!isSendingFile() && m_accepted) {
+        startNextFile();
+    }
+}
+
+void TransferSession::sendShared(SharedChunkStream* stream, const QString& transferId)
+{
+    OutgoingFile file;
+    file.filePath = stream->filePath();
+    file.transferId = transferId;
+    file.totalFiles = 1;
+    file.fileIndex = 1;
+    file.resume = false;
+    file.stream = stream;
+    
+    // Registered up front so the stream keeps its first chunks for us
+    stream->addReader(this);
+    m_sendQueue.enqueue(file);
+    
+    if (!isSendingFile() && m_accepted) {
+        startNextFile();
     }
+}
+
+bool TransferSession::isSendingFile() const
+{
+    return m_sendFile || m_sendStream;
+}
+
+void TransferSession::releaseStream(SharedChunkStream* stream)
+{
+    if (!stream) return;
     
+    disconnect(stream, nullptr, this, nullptr);
+    stream->removeReader(this);
+}
+
+void TransferSession::abortSending()
+{
     if (m_sendFile) {
         m_sendFile->close();
         delete m_sendFile;
-    }
-    
-    m_sendFile = new QFile(filePath, this);
-    if (!m_sendFile->open(QIODevice::ReadOnly)) {
-        emit transferFailed(transferId, tr("Cannot open file: %1").arg(filePath));
-        delete m_sendFile;
         m_sendFile = nullptr;
-        return;
     }
+    m_sendReader->close();
     
-    m_sendTransferId = transferId;
-    m_sendTotalSize = fileInfo.size();
-    m_sendBytesSent = 0;
-    
-    // Send file header
-    TransferHeader header;
-    header.type = TransferType::FILE_HEADER;
-    header.transferId = transferId;
-    header.fileName = fileInfo.fileName();
-    header.relativePath = relativePath.isEmpty() ? fileInfo.fileName() : relativePath;
-    header.fileSize = m_sendTotalSize;
-    header.totalFiles = totalFiles;
-    header.currentFileIndex = currentFile;
-    
-    sendHeader(header);
-    m_state = State::Transferring;
+    releaseStream(m_sendStream);
+    m_sendStream = nullptr;
     
-    // Start sending chunks
-    QTimer::singleShot(0, this, &TransferSession::sendNextChunk);
+    for (const OutgoingFile& file : m_sendQueue) {
+        releaseQueued(file);
+    }
+    m_sendQueue.clear();
+    m_sendTransferId.clear();
+    m_awaitingResumeAck = false;
+    m_awaitingDelta = false;
+    m_sendDelta = false;
+}
+
+void TransferSession::startNextFile()
+{
+    while (!isSendingFile() && !m_sendQueue.isEmpty()) {
+        if (m_sendQueue.head().scanner) {
+            if (!expandFolder()) return;
+            continue;
+        }
+        
+        // Picked up again once the hash is in, unless it was cached
+        if (needsHash(m_sendQueue.head())) {
+            hashQueued(m_sendQueue.head());
+            if (!m_sendQueue.head().hashed) return;
+        }
+        
+        OutgoingFile next = m_sendQueue.dequeue();
+        QFileInfo fileInfo(next.filePath);
+        
+        // The next file hashes while this one is sent
+        if (!m_sendQueue.isEmpty() && needsHash(m_sendQueue.head())) {
+            hashQueued(m_sendQueue.head());
+        }
+        
+        if (next.stream) {
+            // Shared source: chunks come from the stream, not our own file
+            m_sendStream = next.stream;
+            connect(m_sendStream, &SharedChunkStream::chunksAvailable,
+                    this, &TransferSession::sendNextChunk, Qt::QueuedConnection);
+        } else if (!fileInfo.exists() || !fileInfo.isFile()) {
+            dropQueuedFiles(next.transferId);
+            emit transferFailed(next.transferId, tr("File not found: %1").arg(next.filePath));
+            continue;
+        } else {
+            m_sendFile = new QFile(next.filePath, this);
+        }
+        
+        if (m_sendFile && !m_sendFile->open(QIODevice::ReadOnly)) {
+            delete m_sendFile;
+            m_sendFile = nullptr;
+            dropQueuedFiles(next.transferId);
+            emit transferFailed(next.transferId, tr("Cannot open file: %1").arg(next.filePath));
+            continue;
+        }
+        
+        if (next.transferId != m_sendTransferId) {
+            m_sendTransferBase = 0;
+            m_sentHashes.clear();
+        }
+        
+        m_sendTransferId = next.transferId;
+        m_sendRelativePath = next.relativePath.isEmpty() ? fileInfo.fileName() : next.relativePath;
+        m_sendTotalSize = m_sendStream ? m_sendStream->size() : fileInfo.size();
+        m_sendBytesSent = 0;
+        m_sendFileIndex = next.fileIndex;
+        m_sendTotalFiles = next.totalFiles;
+        
+        // Huge files are read without pushing everything else out of the cache
+        if (m_sendFile && m_sendTotalSize >= PAGE_CACHE_MIN_FILE_SIZE && PageCacheWindow::enabled()) {
+            m_sendCache.attach(m_sendFile, PageCacheWindow::Mode::Read);
+        } else {
+            m_sendCache.detach();
+        }
+        
+        // Plain reads go ahead through io_uring where it is built in
+        if (m_sendFile && m_sendTotalSize >= URING_MIN_FILE_SIZE) {
+            m_sendReader->open(next.filePath);
+        } else {
+            m_sendReader->close();
+        }
+        m_sendDelta = false;
+        m_deltaOps.clear();
+        m_deltaChecksum.clear();
+        m_sendHash.reset();
+        m_sendHashing = true;
+        
+        // Holes of a sparse file are neither read nor sent
+        m_sendSparse = false;
+        m_sendExtents.clear();
+        m_sendExtentIndex = 0;
+        if (m_sendFile && m_peerHoleMaps && m_sendTotalSize >= SPARSE_MIN_FILE_SIZE) {
+            m_sendExtents = dataExtents(next.filePath, &m_sendSparse);
+        }
+        
+        // Send file header
+        TransferHeader header;
+        header.type = TransferType::FILE_HEADER;
+        header.transferId = next.transferId;
+        header.fileName = fileInfo.fileName();
+        header.relativePath = m_sendRelativePath;
+        header.fileSize = m_sendTotalSize;
+        header.totalFiles = next.totalFiles;
+        header.currentFileIndex = next.fileIndex;
+        header.resume = next.resume;
+        header.mirror = next.mirror;
+        header.modified = next.modified;
+        
+        // A changed mirrored file may be sent as a delta against the old copy
+        header.delta = next.mirror && !next.resume && m_sendFile &&
+                       m_sendTotalSize >= DELTA_MIN_FILE_SIZE;
+        
+        // The receiver may hold this content already, perhaps as a file
+        // sent earlier in this very transfer
+        header.checksum = next.hash;
+        if (!next.hash.isEmpty()) {
+            header.sameAs = m_sentHashes.value(next.hash);
+            m_sentHashes.insert(next.hash, m_sendRelativePath);
+        }
+        
+        sendHeader(header);
+        m_state = State::Transferring;
+        
+        if (m_sendSparse) {
+            TransferHeader holes;
+            holes.type = TransferType::HOLE_MAP;
+            holes.transferId = next.transferId;
+            holes.relativePath = m_sendRelativePath;
+            for (const FileExtent& extent : m_sendExtents) {
+                holes.extents.append(QJsonArray{extent.offset, extent.length});
+            }
+            sendHeader(holes);
+        }
+        
+        // A resumed or hashed file waits for the receiver to say where to
+        // continue; at the end when it had the content
+        if (next.resume || (!header.checksum.isEmpty() && !header.delta)) {
+            m_awaitingResumeAck = true;
+            return;
+        }
+        
+        // A delta offer waits for the receiver's signature, or its refusal
+        if (header.delta) {
+            m_awaitingDelta = true;
+            return;
+        }
+        
+        // Start sending chunks
+        QTimer::singleShot(0, this, &TransferSession::sendNextChunk);
+    }
+}
+
+void TransferSession::dropQueuedFiles(const QString& transferId)
+{
+    QQueue<OutgoingFile> remaining;
+    for (const OutgoingFile& file : m_sendQueue) {
+        if (file.transferId != transferId) {
+            remaining.enqueue(file);
+        } else {
+            releaseQueued(file);
+        }
+    }
+    m_sendQueue = remaining;
+}
+
+void TransferSession::releaseQueued(const OutgoingFile& file)
+{
+    releaseStream(file.stream);
+    if (file.scanner) {
+        file.scanner->deleteLater();
+    }
+}
+
+void TransferSession::sendFolder(const QString& folderPath, const QString& transferId,
+                                 const QSet<QString>& sentFiles, bool resume)
+{
+    queueFolder(folderPath, transferId, sentFiles, resume, false, false);
+}
+
+void TransferSession::mirrorFolder(const QString& folderPath, const QString& transferId,
+                                   bool propagateDeletes, bool resume)
+{
+    // Files that already arrived before an interruption now compare equal,
+    // so a resumed mirror simply starts over
+    queueFolder(folderPath, transferId, QSet<QString>(), resume, true, propagateDeletes);
 }
 
-void TransferSession::sendFolder(const QString& folderPath, const QString& transferId)
+void TransferSession::queueFolder(const QString& folderPath, const QString& transferId,
+                                  const QSet<QString>& sentFiles, bool resume, bool mirror, bool propagateDeletes)
 {
     QDir dir(folderPath);
     if (!dir.exists()) {
@@ -128,58 +482,235 @@ void TransferSession::sendFolder(const QString& folderPath, const QString& trans
         return;
     }
     
-    // Collect all files recursively
-    QStringList files;
-    QDirIterator it(folderPath, QDir::Files, QDirIterator::Subdirectories);
-    while (it.hasNext()) {
-        files.append(it.next());
+    DirectoryScanner* scanner = new DirectoryScanner(folderPath, this);
+    
+    // A mirror's totals are what the receiver asks for, not what was found
+    if (!mirror) {
+        connect(scanner, &DirectoryScanner::progress, this,
+                [this, transferId](qint64 files, qint64 bytes) {
+            emit folderScanProgress(transferId, files, bytes, false);
+        });
+        connect(scanner, &DirectoryScanner::finished, this,
+                [this, transferId](qint64 files, qint64 bytes) {
+            emit folderScanProgress(transferId, files, bytes, true);
+        });
     }
     
-    if (files.isEmpty()) {
-        emit transferFailed(transferId, tr("Folder is empty: %1").arg(folderPath));
-        return;
+    // New files or the end of the walk may be what the queue is waiting on
+    auto wake = [this]() {
+        if (!isSendingFile() && m_accepted) startNextFile();
+    };
+    connect(scanner, &DirectoryScanner::entriesAvailable, this, wake);
+    connect(scanner, &DirectoryScanner::finished, this, wake);
+    
+    OutgoingFile folder;
+    folder.filePath = folderPath;
+    folder.transferId = transferId;
+    folder.totalFiles = 0;
+    folder.fileIndex = sentFiles.size();
+    folder.resume = resume;
+    folder.scanner = scanner;
+    folder.sentFiles = sentFiles;
+    folder.mirror = mirror;
+    folder.mirrorDeletes = propagateDeletes;
+    
+    m_sendQueue.enqueue(folder);
+    scanner->start();
+}
+
+bool TransferSession::expandFolder()
+{
+    OutgoingFile& folder = m_sendQueue.head();
+    DirectoryScanner* scanner = folder.scanner;
+    
+    announceFiles(folder);
+    
+    // Hold one file back until the next is known, so the last file of the
+    // folder can be marked as such
+    const bool listed = folder.manifestDone && folder.awaiting.isEmpty();
+    if (folder.announced.size() < (listed ? 1 : 2)) {
+        if (!listed) return false;
+        
+        OutgoingFile done = m_sendQueue.dequeue();
+        releaseQueued(done);
+        if (done.fileIndex == 0 && !done.manifestStarted) {
+            emit transferFailed(done.transferId, tr("Folder is empty: %1").arg(done.filePath));
+        } else {
+            // Every file had already gone out before the interruption, or
+            // the mirror was already up to date
+            emit transferCompleted(done.transferId);
+        }
+        return true;
+    }
+    
+    const ScanEntry entry = folder.announced.takeFirst();
+    const bool last = listed && folder.announced.isEmpty();
+    const qint64 expected = folder.mirror ? folder.wantedFiles : scanner->filesFound();
+    
+    OutgoingFile file;
+    file.filePath = entry.path;
+    file.transferId = folder.transferId;
+    file.relativePath = entry.relativePath;
+    file.fileIndex = ++folder.fileIndex;
+    file.totalFiles = last ? file.fileIndex : qMax(expected, file.fileIndex + 1);
+    file.resume = folder.resume;
+    file.mirror = folder.mirror;
+    file.modified = entry.modified;
+    file.hash = entry.hash;
+    file.hashed = !entry.hash.isEmpty();
+    
+    if (last) {
+        releaseQueued(m_sendQueue.dequeue());
+    }
+    m_sendQueue.prepend(file);
+    return true;
+}
+
+void TransferSession::announceFiles(OutgoingFile& folder)
+{
+    DirectoryScanner* scanner = folder.scanner;
+    
+    // Pages run a bounded window ahead of the data, so memory stays flat
+    // however large the tree
+    while (!folder.manifestDone) {
+        const int room = MANIFEST_WINDOW - folder.announced.size() - folder.awaiting.size();
+        const int count = qMin(qMin(room, MANIFEST_PAGE_ENTRIES), scanner->available());
+        const bool lastPage = scanner->isFinished() && count == scanner->available();
+        
+        // Only full pages, unless the manifest is closing or data would stall
+        if (!lastPage && count < MANIFEST_PAGE_ENTRIES &&
+            (count == 0 || !folder.announced.isEmpty() || !folder.awaiting.isEmpty())) {
+            break;
+        }
+        
+        TransferHeader header;
+        header.type = TransferType::FOLDER_MANIFEST;
+        header.transferId = folder.transferId;
+        header.fileName = QDir(folder.filePath).dirName();
+        header.totalFiles = scanner->filesFound();
+        header.totalSize = scanner->bytesFound();
+        header.lastPage = lastPage;
+        header.mirror = folder.mirror;
+        header.deletes = folder.mirrorDeletes;
+        
+        for (int i = 0; i < count; ++i) {
+            ScanEntry entry = scanner->take();
+            // Matched by path, so files added or removed since the
+            // interruption do not shift what counts as sent
+            if (folder.sentFiles.contains(entry.relativePath)) continue;
+            if (m_hashCache && entry.size >= DEDUPE_MIN_SIZE) {
+                entry.hash = m_hashCache->cached(entry.path);
+            }
+            header.entries.append(manifestEntry(entry));
+            (folder.mirror ? folder.awaiting : folder.announced).append(entry);
+        }
+        
+        // An empty folder, or a resumed one with nothing left, lists nothing
+        if (!header.entries.isEmpty() || folder.manifestStarted) {
+            sendHeader(header);
+            folder.manifestStarted = true;
+            if (folder.mirror) {
+                folder.pageSizes.enqueue(count);
+            }
+        }
+        folder.manifestDone = lastPage;
     }
+}
+
+void TransferSession::cancelTransfer(const QString& transferId)
+{
+    if (transferId.isEmpty() || !handlesTransfer(transferId)) return;
     
-    // Send folder header
     TransferHeader header;
-    header.type = TransferType::FOLDER_HEADER;
+    header.type = TransferType::TRANSFER_CANCEL;
     header.transferId = transferId;
-    header.fileName = dir.dirName();
-    header.totalFiles = files.size();
-    
     sendHeader(header);
     
-    // Send each file
-    QString basePath = QFileInfo(folderPath).absolutePath();
-    for (qint64 i = 0; i < files.size(); ++i) {
-        QString relativePath = dir.dirName() + "/" + 
-                              QDir(folderPath).relativeFilePath(files[i]);
-        sendFile(files[i], transferId, relativePath, files.size(), i + 1);
+    // Whatever the peer still has in flight for it is ignored
+    if (m_currentFile && transferId == m_currentTransferId) {
+        m_refusedTransferId = transferId;
+        const bool held = m_repairHeld;
+        discardReceivedFile();
+        
+        // Messages set aside behind a damaged file are read again
+        if (held) {
+            QTimer::singleShot(0, this, &TransferSession::processBuffer);
+        }
+    }
+    
+    if (transferId == m_sendTransferId && isSendingFile()) {
+        stopSendingFile();
     }
+    dropQueuedFiles(transferId);
+    
+    if (!isBusy()) {
+        m_state = State::Idle;
+    } else if (m_accepted) {
+        startNextFile();
+    }
+}
+
+bool TransferSession::handlesTransfer(const QString& transferId) const
+{
+    if (transferId == m_sendTransferId || transferId == m_currentTransferId) return true;
+    
+    for (const OutgoingFile& file : m_sendQueue) {
+        if (file.transferId == transferId) return true;
+    }
+    return false;
 }
 
-void TransferSession::cancelTransfer()
+void TransferSession::requestResume(const QString& transferId)
 {
     TransferHeader header;
-    header.type = TransferType::TRANSFER_CANCEL;
-    header.transferId = m_currentTransferId.isEmpty() ? m_sendTransferId : m_currentTransferId;
+    header.type = TransferType::TRANSFER_RESUME;
+    header.transferId = transferId;
     
     sendHeader(header);
+}
+
+void TransferSession::sendSwarmManifest(const QString& transferId, const QJsonObject& manifest)
+{
+    TransferHeader header;
+    header.type = TransferType::SWARM_MANIFEST;
+    header.transferId = transferId;
+    header.manifest = manifest;
     
-    if (m_currentFile) {
-        m_currentFile->close();
-        m_currentFile->remove();
-        delete m_currentFile;
-        m_currentFile = nullptr;
-    }
+    sendHeader(header);
+}
+
+void TransferSession::advertisePieces(const QString& contentId, const QByteArray& bitfield)
+{
+    TransferHeader header;
+    header.type = TransferType::PIECE_HAVE;
+    header.contentId = contentId;
+    header.bitfield = bitfield;
     
-    if (m_sendFile) {
-        m_sendFile->close();
-        delete m_sendFile;
-        m_sendFile = nullptr;
+    m_servedContent.insert(contentId);
+    sendHeader(header);
+}
+
+void TransferSession::announcePiece(const QString& contentId, int index)
+{
+    TransferHeader header;
+    header.type = TransferType::PIECE_HAVE;
+    header.contentId = contentId;
+    header.pieces.append(index);
+    
+    m_servedContent.insert(contentId);
+    sendHeader(header);
+}
+
+void TransferSession::requestPieces(const QString& contentId, const QList<int>& indices)
+{
+    TransferHeader header;
+    header.type = TransferType::PIECE_REQUEST;
+    header.contentId = contentId;
+    for (int index : indices) {
+        header.pieces.append(index);
     }
     
-    m_state = State::Idle;
+    sendHeader(header);
 }
 
 void TransferSession::disconnectFromPeer()
@@ -198,110 +729,368 @@ void TransferSession::writeMessage(const QByteArray& data, bool isHeader)
 {
     if (!m_socket || m_socket->state() != QAbstractSocket::ConnectedState) return;
     
+    m_lastActivity.restart();
+    
     // Message format: [4 bytes size][1 byte type (0=header, 1=data)][data]
-    QByteArray message;
-    QDataStream stream(&message, QIODevice::WriteOnly);
-    stream.setByteOrder(QDataStream::BigEndian);
-    stream << static_cast<qint32>(data.size() + 1);
-    stream << static_cast<quint8>(isHeader ? 0 : 1);
-    message.append(data);
+    // A peer that asked for frame checks gets data as type 2, CRC first
+    const bool checked = !isHeader && m_peerFrameChecks;
+    const int headerSize = checked ? 9 : 5;
+    char header[FRAME_HEADER_MAX];
+    qToBigEndian<qint32>(headerSize - 4 + data.size(), header);
+    header[4] = static_cast<char>(isHeader ? FrameType::HEADER
+                                  : checked ? FrameType::CHECKED_DATA : FrameType::DATA);
+    if (checked) {
+        qToBigEndian<quint32>(crc32c(data), header + 5);
+    }
     
-    m_socket->write(message);
+    // The data goes out as it is, right behind its header
+    countSent(m_frameWriter.write(header, headerSize, data));
+}
+
+void TransferSession::countSent(qint64 bytes)
+{
+    // Each fresh rate sample may call for a larger send buffer
+    if (m_chunkSizer.addSent(bytes, m_socket->socketDescriptor())) {
+        const ChunkSizer::Stats stats = m_chunkSizer.stats();
+        m_socketTuner.tuneSend(stats.throughput, stats.rtt);
+    }
 }
 
 void TransferSession::sendNextChunk()
 {
-    if (!m_sendFile || !m_sendFile->isOpen()) return;
+    if (!isSendingFile() || m_awaitingResumeAck || m_awaitingDelta || m_waitingForWrite) return;
+    if (probing()) return; // the probe measures an otherwise idle link
     
-    QByteArray chunk = m_sendFile->read(CHUNK_SIZE);
-    if (chunk.isEmpty()) {
-        // File complete
-        TransferHeader header;
-        header.type = TransferType::FILE_COMPLETE;
-        header.transferId = m_sendTransferId;
-        sendHeader(header);
+    QByteArray chunk;
+    qint64 covered = 0;
+    if (m_sendDelta) {
+        // Progress counts the bytes the ops rebuild, not the bytes sent
+        chunk = nextDeltaChunk(covered);
+        if (chunk.isEmpty()) {
+            finishSendFile();
+            return;
+        }
+    } else if (m_sendStream) {
+        if (m_sendStream->atEnd(this)) {
+            finishSendFile();
+            return;
+        }
         
-        m_sendFile->close();
-        delete m_sendFile;
-        m_sendFile = nullptr;
+        // A full window ahead of the slowest peer; chunksAvailable resumes us
+        chunk = m_sendStream->nextChunk(this);
+        if (chunk.isNull()) return;
+    } else {
+        if (!m_sendFile->isOpen()) return;
         
-        emit transferCompleted(m_sendTransferId);
-        m_state = State::Completed;
-        return;
+        // A sparse file jumps from one data extent to the next
+        qint64 length = m_chunkSizer.chunkSize();
+        if (m_sendSparse) {
+            while (m_sendExtentIndex < m_sendExtents.size() &&
+                   m_sendExtents[m_sendExtentIndex].end() <= m_sendBytesSent) {
+                ++m_sendExtentIndex;
+            }
+            if (m_sendExtentIndex == m_sendExtents.size()) {
+                finishSendFile();
+                return;
+            }
+            
+            const FileExtent& extent = m_sendExtents[m_sendExtentIndex];
+            if (m_sendBytesSent < extent.offset) {
+                m_sendBytesSent = extent.offset;
+                m_sendFile->seek(m_sendBytesSent);
+            }
+            length = qMin(length, extent.end() - m_sendBytesSent);
+        }
+        
+        if (m_sendReader->isOpen()) {
+            // Null until the read-ahead gets there; readable() resumes us
+            chunk = m_sendReader->read(m_sendBytesSent, length);
+            if (chunk.isNull()) {
+                if (!m_sendReader->failed()) return;
+                m_sendReader->close();
+                m_sendFile->seek(m_sendBytesSent);
+                chunk = readSendChunk(length);
+            }
+        } else {
+            chunk = readSendChunk(length);
+        }
+        if (chunk.isEmpty()) {
+            finishSendFile();
+            return;
+        }
+        m_sendCache.advance(m_sendBytesSent + chunk.size());
     }
     
     writeMessage(chunk, false);
-    m_sendBytesSent += chunk.size();
+    m_sendBytesSent += m_sendDelta ? covered : chunk.size();
+    if (m_sendHashing) {
+        m_sendHash.addData(chunk);
+    }
+    ChunkPool::instance().release(chunk);
     
-    emit transferProgress(m_sendTransferId, m_sendBytesSent, m_sendTotalSize);
+    emit transferProgress(m_sendTransferId, m_sendTransferBase + m_sendBytesSent, m_sendTotalSize);
+    
+    // Let the socket drain before queueing more, so a slow peer holds back
+    // its own sender instead of piling chunks into the write buffer
+    if (m_socket->bytesToWrite() > m_chunkSizer.pendingLimit()) {
+        m_waitingForWrite = true;
+        return;
+    }
     
     // Continue sending
     QTimer::singleShot(0, this, &TransferSession::sendNextChunk);
 }
 
-void TransferSession::onReadyRead()
+QByteArray TransferSession::readSendChunk(qint64 length)
 {
-    m_buffer.append(m_socket->readAll());
-    
-    while (m_buffer.size() >= 4) {
-        // Read message size
-        if (m_expectedSize == 0) {
-            QDataStream stream(m_buffer.left(4));
-            stream.setByteOrder(QDataStream::BigEndian);
-            stream >> m_expectedSize;
-        }
-        
-        // Check if we have the complete message
-        if (m_buffer.size() < 4 + m_expectedSize) break;
-        
-        // Extract message
-        quint8 messageType = static_cast<quint8>(m_buffer.at(4));
-        QByteArray messageData = m_buffer.mid(5, m_expectedSize - 1);
-        m_buffer.remove(0, 4 + m_expectedSize);
-        m_expectedSize = 0;
-        
-        if (messageType == 0) {
-            // Header message
-            processMessage(messageData);
-        } else {
-            // Data message (file chunk)
-            handleFileData(messageData);
-        }
-    }
+    QByteArray chunk = ChunkPool::instance().acquire(static_cast<int>(length));
+    const qint64 count = m_sendFile->read(chunk.data(), length);
+    chunk.resize(static_cast<int>(qMax<qint64>(0, count)));
+    return chunk;
 }
 
-void TransferSession::processMessage(const QByteArray& message)
+void TransferSession::onBytesWritten(qint64 bytes)
 {
-    TransferHeader header = TransferHeader::fromJson(message);
-    
-    if (header.type == TransferType::CONNECTION_REQUEST) {
-        handleConnectionRequest(header);
-    } else if (header.type == TransferType::CONNECTION_ACCEPT) {
-        handleConnectionAccept(header);
-    } else if (header.type == TransferType::CONNECTION_REJECT) {
-        handleConnectionReject(header);
-    } else if (header.type == TransferType::FILE_HEADER) {
-        handleFileHeader(header);
-    } else if (header.type == TransferType::FILE_COMPLETE) {
-        handleFileComplete(header);
-    } else if (header.type == TransferType::TRANSFER_CANCEL) {
-        handleTransferCancel(header);
+    countSent(bytes);
+    if (m_probeSending && m_socket->bytesToWrite() <= m_chunkSizer.pendingLimit() / 2) {
+        sendProbeFrames();
+    }
+    if (!m_pieceQueue.isEmpty()) {
+        sendQueuedPieces();
     }
+    if (!m_waitingForWrite || m_socket->bytesToWrite() > m_chunkSizer.pendingLimit() / 2) return;
+    
+    m_waitingForWrite = false;
+    sendNextChunk();
 }
 
-void TransferSession::handleConnectionRequest(const TransferHeader& header)
+void TransferSession::finishSendFile()
+{
+    // File complete
+    TransferHeader header;
+    header.type = TransferType::FILE_COMPLETE;
+    header.transferId = m_sendTransferId;
+    header.relativePath = m_sendRelativePath;
+    header.checksum = m_deltaChecksum;
+    if (m_sendHashing) {
+        header.digest = m_sendHash.result();
+    }
+    sendHeader(header);
+    
+    // Kept a while, in case the receiver finds frames of it damaged
+    const QString sentPath = m_sendFile ? m_sendFile->fileName()
+                           : m_sendStream ? m_sendStream->filePath() : QString();
+    if (m_peerFrameChecks && !m_sendDelta && !sentPath.isEmpty()) {
+        const QString key = m_sendTransferId + '/' + m_sendRelativePath;
+        if (!m_repairPaths.contains(key)) {
+            m_repairOrder.enqueue(key);
+        }
+        m_repairPaths.insert(key, sentPath);
+        while (m_repairOrder.size() > FRAME_REPAIR_HISTORY) {
+            m_repairPaths.remove(m_repairOrder.dequeue());
+        }
+    }
+    
+    m_sendDelta = false;
+    m_sendHashing = false;
+    m_deltaOps.clear();
+    m_deltaChecksum.clear();
+    
+    if (m_sendFile) {
+        m_sendFile->close();
+        delete m_sendFile;
+        m_sendFile = nullptr;
+    }
+    m_sendReader->close();
+    releaseStream(m_sendStream);
+    m_sendStream = nullptr;
+    m_sendTransferBase += m_sendTotalSize;
+    
+    if (m_journal) {
+        m_journal->recordFileSent(m_sendTransferId, m_sendRelativePath);
+    }
+    
+    if (m_sendFileIndex >= m_sendTotalFiles) {
+        emit transferCompleted(m_sendTransferId);
+        m_state = State::Completed;
+    }
+    
+    startNextFile();
+}
+
+void TransferSession::onReadyRead()
+{
+    m_lastActivity.restart();
+    
+    // Straight onto the end of the buffer, without a temporary
+    const qint64 available = m_socket->bytesAvailable();
+    const int oldSize = m_buffer.size();
+    m_buffer.resize(oldSize + static_cast<int>(available));
+    const qint64 count = m_socket->read(m_buffer.data() + oldSize, available);
+    m_buffer.resize(oldSize + static_cast<int>(qMax<qint64>(0, count)));
+    m_socketTuner.addReceived(qMax<qint64>(0, count));
+    processBuffer();
+}
+
+void TransferSession::processBuffer()
+{
+    while (!m_inputHeld && m_buffer.size() >= 4) {
+        // Read message size
+        if (m_expectedSize == 0) {
+            m_expectedSize = qFromBigEndian<qint32>(m_buffer.constData());
+        }
+        
+        // Check if we have the complete message
+        if (m_buffer.size() < 4 + m_expectedSize) break;
+        
+        // Extract message into a pooled buffer; a checked frame leads
+        // with the CRC32C of its data
+        const int frameSize = 4 + m_expectedSize;
+        const quint8 messageType = static_cast<quint8>(m_buffer.at(4));
+        const bool checked = messageType == FrameType::CHECKED_DATA;
+        const int dataOffset = checked ? 9 : 5;
+        const bool truncated = frameSize < dataOffset;
+        QByteArray messageData = ChunkPool::instance().acquire(truncated ? 0 : frameSize - dataOffset);
+        std::memcpy(messageData.data(), m_buffer.constData() + dataOffset,
+                    static_cast<size_t>(messageData.size()));
+        const quint32 expectedCrc = checked && !truncated
+                                  ? qFromBigEndian<quint32>(m_buffer.constData() + 5) : 0;
+        
+        // Behind a file still missing damaged frames, everything but its
+        // repairs is set aside whole, to be read again once it completes
+        if (m_repairHeld && !passesRepairHold(messageType, messageData)) {
+            m_deferred.append(m_buffer.constData(), frameSize);
+            m_buffer.remove(0, frameSize);
+            m_expectedSize = 0;
+            ChunkPool::instance().release(messageData);
+            continue;
+        }
+        m_buffer.remove(0, frameSize);
+        m_expectedSize = 0;
+        if (truncated) continue;
+        
+        const bool intact = !checked || crc32c(messageData) == expectedCrc;
+        
+        if (messageType == FrameType::HEADER) {
+            // Header message
+            processMessage(messageData);
+        } else if (messageType == FrameType::PROBE) {
+            // Link probe filler, only counted
+            countProbeFrame(messageData.size());
+        } else if (m_repairRemaining > 0) {
+            // Data asked for again by a FRAME_NACK
+            appendRepairData(messageData, intact);
+        } else if (m_pieceRemaining > 0) {
+            // Body of a swarm piece; the piece hash catches damage
+            appendPieceData(messageData);
+        } else if (!m_isIncoming || m_accepted) {
+            // Data message (file chunk)
+            handleFileData(messageData, intact);
+        }
+        ChunkPool::instance().release(messageData);
+    }
+}
+
+void TransferSession::processMessage(const QByteArray& message)
+{
+    TransferHeader header = TransferHeader::fromJson(message);
+    
+    // Nothing but the request is read before an incoming connection is
+    // accepted; files pipelined behind a refused reconnect are dropped
+    if (m_isIncoming && !m_accepted && header.type != TransferType::CONNECTION_REQUEST) {
+        return;
+    }
+    
+    // Piece-only connections never carry whole files
+    if (!m_swarmContent.isEmpty() &&
+        (header.type == TransferType::FILE_HEADER || header.type == TransferType::TRANSFER_RESUME ||
+         header.type == TransferType::SWARM_MANIFEST || header.type == TransferType::FOLDER_MANIFEST)) {
+        return;
+    }
+    
+    if (header.type == TransferType::CONNECTION_REQUEST) {
+        handleConnectionRequest(header);
+    } else if (header.type == TransferType::CONNECTION_ACCEPT) {
+        handleConnectionAccept(header);
+    } else if (header.type == TransferType::CONNECTION_REJECT) {
+        handleConnectionReject(header);
+    } else if (header.type == TransferType::FILE_HEADER) {
+        handleFileHeader(header);
+    } else if (header.type == TransferType::FOLDER_MANIFEST) {
+        handleFolderManifest(header);
+    } else if (header.type == TransferType::MIRROR_WANT) {
+        handleMirrorWant(header);
+    } else if (header.type == TransferType::DELTA_SIGNATURE) {
+        handleDeltaSignature(header);
+    } else if (header.type == TransferType::FILE_COMPLETE) {
+        handleFileComplete(header);
+    } else if (header.type == TransferType::TRANSFER_CANCEL) {
+        handleTransferCancel(header);
+    } else if (header.type == TransferType::TRANSFER_ACK) {
+        handleTransferAck(header);
+    } else if (header.type == TransferType::TRANSFER_RESUME) {
+        handleTransferResume(header);
+    } else if (header.type == TransferType::SWARM_MANIFEST) {
+        emit swarmOffered(header.transferId, header.manifest);
+    } else if (header.type == TransferType::PIECE_HAVE) {
+        handlePieceHave(header);
+    } else if (header.type == TransferType::PIECE_REQUEST) {
+        handlePieceRequest(header);
+    } else if (header.type == TransferType::PIECE_DATA) {
+        handlePieceData(header);
+    } else if (header.type == TransferType::FRAME_NACK) {
+        handleFrameNack(header);
+    } else if (header.type == TransferType::FRAME_REPAIR) {
+        handleFrameRepair(header);
+    } else if (header.type == TransferType::HOLE_MAP) {
+        handleHoleMap(header);
+    } else if (header.type == TransferType::PING) {
+        TransferHeader pong;
+        pong.type = TransferType::PONG;
+        sendHeader(pong);
+    } else if (header.type == TransferType::PONG) {
+        handlePong();
+    } else if (header.type == TransferType::LINK_PROBE) {
+        handleLinkProbe();
+    } else if (header.type == TransferType::LINK_PROBE_RESULT) {
+        handleLinkProbeResult(header);
+    }
+}
+
+void TransferSession::handleConnectionRequest(const TransferHeader& header)
 {
     m_peerName = header.senderName;
     m_peerId = header.transferId;
+    m_token = header.token;
+    m_poolSecret = header.poolSecret;
+    m_swarmContent = header.contentId;
+    m_peerFrameChecks = header.frameChecks;
+    m_peerHoleMaps = header.holeMaps;
+    m_chunkSizer.setPeerLimit(header.maxChunk);
     m_isIncoming = true;
+    applyTuning();
+    applyLinkProfile();
     emit connectionRequestReceived(header.senderName, header.transferId);
 }
 
 void TransferSession::handleConnectionAccept(const TransferHeader& header)
 {
-    Q_UNUSED(header)
+    m_token = header.token;
+    m_poolSecret = header.poolSecret;
+    m_peerFrameChecks = header.frameChecks;
+    m_peerHoleMaps = header.holeMaps;
+    m_chunkSizer.setPeerLimit(header.maxChunk);
+    
+    // A link with nothing learned about it is measured before files go
+    if (!applyLinkProfile() && header.linkProbe) {
+        startLinkProbe();
+    }
     m_state = State::Accepted;
+    m_accepted = true;
     emit connectionAccepted();
+    
+    // Anything queued while the handshake was in flight goes out now
+    startNextFile();
 }
 
 void TransferSession::handleConnectionReject(const TransferHeader& header)
@@ -309,10 +1098,39 @@ void TransferSession::handleConnectionReject(const TransferHeader& header)
     Q_UNUSED(header)
     m_state = State::Rejected;
     emit connectionRejected();
+    
+    // Files already sent on a refused trusted reconnect went nowhere
+    m_accepted = false;
+    abortSending();
 }
 
 void TransferSession::handleFileHeader(const TransferHeader& header)
 {
+    if (header.transferId == m_refusedTransferId) return;
+    
+    // Folder files name their place in the tree, single files just a name;
+    // a mirror replaces the file at its relative path
+    const QString target = header.relativePath.contains('/') ? header.relativePath
+                                                            : header.fileName;
+    if (localPath(target).isEmpty() || (header.mirror && localPath(header.relativePath).isEmpty())) {
+        refuseTransfer(header.transferId, tr("Refused unsafe path: %1").arg(target));
+        return;
+    }
+    
+    // Only a file received from its first byte can be verified
+    m_verifier->stop();
+    m_receiveCache.detach();
+    m_directWriter.discard();
+    clearRepairs();
+    m_currentSparse = false;
+    m_currentExtents.clear();
+    m_currentExtentIndex = 0;
+    
+    if (header.transferId != m_currentTransferId) {
+        m_receiveTransferBase = 0;
+        m_receivedPaths.clear();
+    }
+    
     m_currentTransferId = header.transferId;
     m_currentFileName = header.fileName;
     m_currentRelativePath = header.relativePath;
@@ -320,32 +1138,67 @@ void TransferSession::handleFileHeader(const TransferHeader& header)
     m_currentBytesReceived = 0;
     m_totalFiles = header.totalFiles;
     m_currentFileIndex = header.currentFileIndex;
+    m_checkpointTimer.start();
     
-    // Create destination path
-    QString destPath = m_downloadPath;
-    if (destPath.isEmpty()) {
-        destPath = QDir::homePath() + "/Downloads/Witra";
+    // Mirrored files replace the existing copy in place once complete
+    m_currentMirrorPath = header.mirror
+        ? localPath(m_currentRelativePath) : QString();
+    m_currentModified = header.modified;
+    m_currentChecksum = header.checksum;
+    m_currentContentHash.clear();
+    m_currentDeltaOffered = header.delta;
+    
+    if (m_journal && !m_journal->contains(m_currentTransferId)) {
+        QString name = m_currentRelativePath.contains('/')
+            ? m_currentRelativePath.section('/', 0, 0)
+            : m_currentFileName;
+        m_journal->recordIncoming(m_currentTransferId, m_peerId, m_peerName,
+                                  name, m_currentFileSize, m_totalFiles);
+    }
+    
+    // Continue a partial file left behind by an interrupted transfer
+    if (header.resume && m_journal) {
+        JournalFile partial = m_journal->partialFile(m_currentTransferId, m_currentRelativePath);
+        if (!partial.localPath.isEmpty() && openResumedFile(partial)) {
+            TransferHeader ack;
+            ack.type = TransferType::TRANSFER_ACK;
+            ack.transferId = m_currentTransferId;
+            ack.offset = m_currentBytesReceived;
+            sendHeader(ack);
+            
+            m_state = State::Transferring;
+            emit transferStarted(m_currentTransferId, m_currentFileName, 
+                                m_currentFileSize, m_totalFiles);
+            return;
+        }
     }
     
-    QDir destDir(destPath);
+    // Create destination path
+    QDir destDir(downloadDir());
     if (!destDir.exists()) {
         destDir.mkpath(".");
     }
     
-    // Handle relative path for folders
+    // Handle relative path for folders; a manifest may have made the
+    // directory already
     QString filePath;
     if (m_currentRelativePath.contains('/')) {
         QString subDir = m_currentRelativePath.left(m_currentRelativePath.lastIndexOf('/'));
-        destDir.mkpath(subDir);
-        filePath = destDir.absoluteFilePath(m_currentRelativePath);
+        if (!m_preparedDirs.contains(subDir)) {
+            destDir.mkpath(localPath(subDir));
+        }
+        filePath = localPath(m_currentRelativePath);
     } else {
-        filePath = destDir.absoluteFilePath(m_currentFileName);
+        filePath = localPath(m_currentFileName);
     }
     
     // Handle file name conflicts
     QFileInfo fileInfo(filePath);
     int counter = 1;
-    while (QFile::exists(filePath)) {
+    if (!m_currentMirrorPath.isEmpty()) {
+        filePath = m_currentMirrorPath + MIRROR_PART_SUFFIX;
+    }
+    while (m_currentMirrorPath.isEmpty() && QFile::exists(filePath)) {
         filePath = destDir.absoluteFilePath(
             QString("%1 (%2).%3").arg(fileInfo.baseName())
                                  .arg(counter++)
@@ -360,65 +1213,1374 @@ void TransferSession::handleFileHeader(const TransferHeader& header)
     
     m_currentFile = new QFile(filePath, this);
     if (!m_currentFile->open(QIODevice::WriteOnly)) {
-        emit transferFailed(m_currentTransferId, 
-                           tr("Cannot create file: %1").arg(filePath));
         delete m_currentFile;
         m_currentFile = nullptr;
+        // The sender may be waiting on our ack; it must not wait forever
+        refuseTransfer(m_currentTransferId, tr("Cannot create file: %1").arg(filePath));
         return;
     }
+    // The offered content hash is taken here as well, so what the indexes
+    // record is never just the sender's word
+    m_verifier->start(!m_currentChecksum.isEmpty());
+    
+    // A delta rebuild is not a prefix of the new file, so it is never
+    // journaled as resumable; a refused offer is journaled once answered
+    closeDeltaBase();
+    const QString duplicate = findDuplicate(header);
+    if (!duplicate.isEmpty()) {
+        startLocalCopy(duplicate);
+    } else if (header.delta) {
+        startDeltaReceive();
+    } else if (m_currentFileSize >= DIRECT_IO_MIN_FILE_SIZE && DirectWriter::enabled()) {
+        // Opt-in; a filesystem that refuses direct I/O is written buffered
+        m_directWriter.open(filePath);
+    }
+    
+    // Huge files are written back as they arrive and kept out of the cache
+    if (!m_directWriter.isOpen() && m_currentFileSize >= PAGE_CACHE_MIN_FILE_SIZE &&
+        PageCacheWindow::enabled()) {
+        m_receiveCache.attach(m_currentFile, PageCacheWindow::Mode::Write);
+    }
+    
+    if (m_journal && !header.delta) {
+        m_journal->recordFileStarted(m_currentTransferId, m_currentRelativePath,
+                                     filePath, m_currentFileSize);
+    }
+    
+    // Nothing usable on our side; tell a resuming or hashing sender to
+    // start over
+    if (header.resume || (duplicate.isEmpty() && !header.checksum.isEmpty() && !header.delta)) {
+        TransferHeader ack;
+        ack.type = TransferType::TRANSFER_ACK;
+        ack.transferId = m_currentTransferId;
+        sendHeader(ack);
+    }
     
     m_state = State::Transferring;
     emit transferStarted(m_currentTransferId, m_currentFileName, 
                         m_currentFileSize, m_totalFiles);
 }
 
-void TransferSession::handleFileData(const QByteArray& data)
+void TransferSession::handleFileData(const QByteArray& data, bool intact)
 {
     if (!m_currentFile || !m_currentFile->isOpen()) {
         return;
     }
     
-    m_currentFile->write(data);
-    m_currentBytesReceived += data.size();
+    // Delta ops cannot be asked for again by range
+    if (!intact && m_deltaReceive) {
+        abortReceive(tr("Delta data for %1 was damaged in transit").arg(m_currentRelativePath));
+        return;
+    }
+    
+    if (m_currentSparse && !m_deltaReceive) {
+        skipHoles();
+    }
+    
+    if (!intact) {
+        // Left as a hole until the repair comes back, written buffered from here on
+        endDirectWrite();
+        requestRepair(m_currentBytesReceived, data.size());
+        if (!m_currentFile) return;
+        m_currentBytesReceived += data.size();
+        m_currentFile->seek(m_currentBytesReceived);
+    } else if (m_deltaReceive) {
+        if (!applyDelta(data)) {
+            // A full disk is reported as such, not left to the checksum
+            abortReceive(m_currentFile->error() == QFileDevice::WriteError
+                ? tr("Cannot write %1: %2").arg(m_currentRelativePath, m_currentFile->errorString())
+                : tr("Invalid delta data for %1").arg(m_currentRelativePath));
+            return;
+        }
+    } else {
+        // A refused direct write hands everything it holds back to the buffered file
+        if (!m_directWriter.isOpen()) {
+            m_currentFile->write(data);
+        } else if (!m_directWriter.write(data)) {
+            endDirectWrite();
+        }
+        m_currentBytesReceived += data.size();
+        m_verifier->addData(data);
+    }
+    m_receiveCache.advance(m_currentFile->pos());
+    
+    // A hole must not be claimed as received
+    if (m_journal && !m_deltaReceive && m_missingRanges.isEmpty() &&
+        m_checkpointTimer.hasExpired(JOURNAL_CHECKPOINT_INTERVAL)) {
+        checkpointReceive();
+    }
     
-    emit transferProgress(m_currentTransferId, m_currentBytesReceived, m_currentFileSize);
+    emit transferProgress(m_currentTransferId, m_receiveTransferBase + m_currentBytesReceived,
+                          m_currentFileSize);
 }
 
-void TransferSession::handleFileComplete(const TransferHeader& header)
+bool TransferSession::openResumedFile(const JournalFile& partial)
 {
-    Q_UNUSED(header)
+    QFileInfo info(partial.localPath);
+    if (!info.exists()) return false;
+    
+    // Never trust more than what actually reached the disk
+    qint64 offset = qMin(partial.done ? partial.size : partial.offset, info.size());
     
     if (m_currentFile) {
-        QString filePath = m_currentFile->fileName();
         m_currentFile->close();
         delete m_currentFile;
+    }
+    
+    m_currentFile = new QFile(partial.localPath, this);
+    if (!m_currentFile->open(QIODevice::ReadWrite) ||
+        !m_currentFile->resize(offset) || !m_currentFile->seek(offset)) {
+        delete m_currentFile;
         m_currentFile = nullptr;
+        return false;
+    }
+    
+    m_currentBytesReceived = offset;
+    if (m_currentFileSize >= PAGE_CACHE_MIN_FILE_SIZE && PageCacheWindow::enabled()) {
+        m_receiveCache.attach(m_currentFile, PageCacheWindow::Mode::Write);
+    }
+    return true;
+}
+
+void TransferSession::checkpointReceive()
+{
+    // Data must be durable before the journal may claim it; a direct
+    // writer's partial block is not on disk yet
+    TransferJournal::syncToDisk(m_currentFile);
+    m_journal->recordFileProgress(m_currentTransferId, m_currentRelativePath,
+                                  m_directWriter.isOpen() ? m_directWriter.written()
+                                                          : m_currentBytesReceived);
+    m_checkpointTimer.restart();
+}
+
+void TransferSession::handleFileComplete(const TransferHeader& header)
+{
+    if (!m_currentFile) {
+        m_verifier->stop();
+        return;
+    }
+    endDirectWrite();
+    
+    // Damaged frames are still on their way back; finish once they are in
+    if (!m_missingRanges.isEmpty()) {
+        m_pendingComplete = header;
+        m_repairHeld = true;
+        return;
+    }
+    
+    // A rebuilt file must match the sender's copy byte for byte before
+    // it may replace ours
+    bool verified = false;
+    if (m_deltaReceive) {
+        const bool intact = m_deltaBuffer.isEmpty() &&
+            (header.checksum.isEmpty() || header.checksum == m_deltaHash.result());
+        verified = !header.checksum.isEmpty();
+        closeDeltaBase();
+        if (!intact) {
+            abortReceive(tr("Delta rebuild of %1 does not match the sender's copy")
+                             .arg(m_currentRelativePath));
+            return;
+        }
+        if (verified) {
+            m_currentContentHash = m_deltaHash.result();
+        }
+    } else if ((!header.digest.isEmpty() || (!m_currentChecksum.isEmpty() && !m_currentSparse)) &&
+               m_verifier->isActive()) {
+        // Nothing after this message is read until the hash has caught up
+        m_expectedDigest = header.digest;
+        m_inputHeld = true;
+        m_verifier->finish();
+        return;
+    }
+    
+    m_verifier->stop();
+    finishReceivedFile(verified);
+}
+
+void TransferSession::onFileVerified(const QByteArray& digest, const QByteArray& contentHash)
+{
+    if (!m_inputHeld) return;
+    
+    // Without a digest from the sender the file was only hashed for the
+    // indexes; holes never pass through the hash, so a sparse file is not
+    if (m_currentFile && (m_expectedDigest.isEmpty() || digest == m_expectedDigest)) {
+        m_currentContentHash = m_currentSparse ? QByteArray() : contentHash;
+        finishReceivedFile(!m_expectedDigest.isEmpty());
+    } else if (m_currentFile) {
+        abortReceive(tr("%1 was corrupted in transit").arg(m_currentRelativePath));
+    }
+    
+    m_expectedDigest.clear();
+    m_inputHeld = false;
+    processBuffer();
+}
+
+void TransferSession::finishReceivedFile(bool verified)
+{
+    // A trailing hole is never written to; the length is set instead
+    if (m_currentSparse && m_currentFile->isOpen() && m_currentFile->size() < m_currentFileSize) {
+        m_currentFile->resize(m_currentFileSize);
+    }
+    
+    QString filePath = m_currentFile->fileName();
+    m_currentFile->close();
+    delete m_currentFile;
+    m_currentFile = nullptr;
+    
+    if (!m_currentMirrorPath.isEmpty()) {
+        filePath = replaceMirroredFile(filePath);
+    }
+    
+    if (!m_currentContentHash.isEmpty()) {
+        m_receivedPaths.insert(m_currentContentHash, filePath);
+        if (m_contentIndex) {
+            m_contentIndex->add(m_currentContentHash, filePath);
+        }
+        if (m_hashCache) {
+            m_hashCache->insert(filePath, m_currentContentHash);
+        }
+    }
+    
+    if (m_journal) {
+        m_journal->recordFileDone(m_currentTransferId, m_currentRelativePath);
+    }
+    m_receiveTransferBase += m_currentFileSize;
+    
+    emit fileChecked(m_currentTransferId, verified);
+    emit fileReceived(m_currentTransferId, filePath);
+    
+    if (m_currentFileIndex >= m_totalFiles) {
+        emit transferCompleted(m_currentTransferId);
+        m_state = State::Completed;
+    }
+}
+
+void TransferSession::handleFolderManifest(const TransferHeader& header)
+{
+    if (header.transferId == m_refusedTransferId) return;
+    
+    if (header.transferId != m_manifestTransferId) {
+        m_manifestTransferId = header.transferId;
+        m_preparedDirs.clear();
+        m_mirrorDeletes = header.mirror && header.deletes;
+        m_mirrorWantedFiles = 0;
+        m_mirrorWantedBytes = 0;
+        m_mirrorPaths.clear();
+    }
+    
+    // One path reaching outside the download folder refuses the whole folder
+    for (const QJsonValue& value : header.entries) {
+        const QString relativePath = value.toObject()["path"].toString();
+        if (localPath(relativePath).isEmpty()) {
+            refuseTransfer(header.transferId, tr("Refused unsafe path: %1").arg(relativePath));
+            return;
+        }
+    }
+    
+    QDir destDir(downloadDir());
+    
+    // A mirror only takes files it lacks or holds a different version of;
+    // received files keep the sender's mtime so unchanged ones match next time
+    QJsonArray wanted;
+    if (header.mirror) {
+        for (int i = 0; i < header.entries.size(); ++i) {
+            const QJsonObject entry = header.entries.at(i).toObject();
+            const QString relativePath = entry["path"].toString();
+            const QFileInfo local(localPath(relativePath));
+            
+            if (m_mirrorDeletes) {
+                m_mirrorPaths.insert(relativePath);
+            }
+            
+            const qint64 size = entry["size"].toVariant().toLongLong();
+            if (local.isFile() && local.size() == size &&
+                local.lastModified().toMSecsSinceEpoch() == entry["mtime"].toVariant().toLongLong()) {
+                continue;
+            }
+            
+            // Only touched, not changed: both sides already know the hash
+            if (m_hashCache && entry.contains("hash") && local.isFile() && local.size() == size &&
+                m_hashCache->cached(local.filePath()) ==
+                    QByteArray::fromHex(entry["hash"].toString().toLatin1())) {
+                continue;
+            }
+            
+            wanted.append(i);
+            ++m_mirrorWantedFiles;
+            m_mirrorWantedBytes += size;
+        }
+    }
+    
+    const qint64 totalFiles = header.mirror ? m_mirrorWantedFiles : header.totalFiles;
+    const qint64 totalSize = header.mirror ? m_mirrorWantedBytes : header.totalSize;
+    
+    // Fail before the first byte rather than part-way through
+    const qint64 received = header.transferId == m_currentTransferId ? m_receiveTransferBase : 0;
+    const QStorageInfo storage(destDir.exists() ? destDir.absolutePath() : QDir::homePath());
+    if (storage.isValid() && totalSize - received > storage.bytesAvailable()) {
+        refuseTransfer(header.transferId,
+                       tr("Not enough free space: %1 needed, %2 available")
+                           .arg(QLocale().formattedDataSize(totalSize - received))
+                           .arg(QLocale().formattedDataSize(storage.bytesAvailable())));
+        return;
+    }
+    
+    // Lay out the directory tree a page at a time instead of once per file
+    for (const QJsonValue& value : header.entries) {
+        const QString relativePath = value.toObject()["path"].toString();
+        const QString subDir = relativePath.section('/', 0, -2);
+        if (!subDir.isEmpty() && !m_preparedDirs.contains(subDir)) {
+            destDir.mkpath(localPath(subDir));
+            m_preparedDirs.insert(subDir);
+        }
+    }
+    
+    if (header.mirror) {
+        TransferHeader reply;
+        reply.type = TransferType::MIRROR_WANT;
+        reply.transferId = header.transferId;
+        reply.wanted = wanted;
+        sendHeader(reply);
+    }
+    
+    if (m_journal) {
+        if (!m_journal->contains(header.transferId)) {
+            m_journal->recordIncoming(header.transferId, m_peerId, m_peerName,
+                                      header.fileName, totalSize, totalFiles);
+        } else if (header.lastPage) {
+            m_journal->recordTotals(header.transferId, totalSize, totalFiles);
+        }
+    }
+    
+    emit folderManifestReceived(header.transferId, header.fileName, totalFiles,
+                                totalSize, header.lastPage);
+    
+    if (header.mirror && header.lastPage) {
+        if (m_mirrorDeletes) {
+            removeStaleFiles(header.fileName);
+        }
         
-        emit fileReceived(m_currentTransferId, filePath);
+        // Nothing changed, so no file will arrive to finish the transfer
+        if (m_mirrorWantedFiles == 0) {
+            emit transferCompleted(header.transferId);
+        }
+    }
+}
+
+void TransferSession::removeStaleFiles(const QString& folderName)
+{
+    // Only ever inside the mirrored folder itself
+    if (folderName.isEmpty() || folderName == "." || folderName == ".." ||
+        folderName.contains('/') || folderName.contains('\\')) {
+        return;
+    }
+    
+    const QString rootPath = QDir(downloadDir()).absoluteFilePath(folderName);
+    if (!QFileInfo(rootPath).isDir()) return;
+    
+    QSet<QString> keep = m_mirrorPaths;
+    m_mirrorPaths.clear();
+    
+    DirectoryScanner* scanner = new DirectoryScanner(rootPath, this);
+    auto sweep = [scanner, keep]() {
+        while (scanner->available() > 0) {
+            const ScanEntry entry = scanner->take();
+            
+            // Part files belong to mirrored files still on their way
+            if (keep.contains(entry.relativePath) || entry.path.endsWith(MIRROR_PART_SUFFIX)) {
+                continue;
+            }
+            QFile::remove(entry.path);
+        }
+        if (scanner->atEnd()) {
+            scanner->deleteLater();
+        }
+    };
+    connect(scanner, &DirectoryScanner::entriesAvailable, this, sweep);
+    connect(scanner, &DirectoryScanner::finished, this, sweep);
+    scanner->start();
+}
+
+void TransferSession::handleMirrorWant(const TransferHeader& header)
+{
+    for (OutgoingFile& folder : m_sendQueue) {
+        if (folder.transferId != header.transferId || !folder.scanner) continue;
+        if (folder.pageSizes.isEmpty()) return;
+        
+        // Replies come back in page order
+        const int count = qMin(folder.pageSizes.dequeue(), folder.awaiting.size());
+        const QList<ScanEntry> page = folder.awaiting.mid(0, count);
+        folder.awaiting.erase(folder.awaiting.begin(), folder.awaiting.begin() + count);
         
-        if (m_currentFileIndex >= m_totalFiles) {
-            emit transferCompleted(m_currentTransferId);
-            m_state = State::Completed;
+        for (const QJsonValue& value : header.wanted) {
+            const int index = value.toInt(-1);
+            if (index < 0 || index >= page.size()) continue;
+            
+            folder.announced.append(page.at(index));
+            ++folder.wantedFiles;
+            folder.wantedBytes += page.at(index).size;
         }
+        
+        emit folderScanProgress(folder.transferId, folder.wantedFiles, folder.wantedBytes,
+                                folder.manifestDone && folder.awaiting.isEmpty());
+        break;
+    }
+    
+    if (!isSendingFile() && m_accepted) {
+        startNextFile();
     }
 }
 
-void TransferSession::handleTransferCancel(const TransferHeader& header)
+QString TransferSession::replaceMirroredFile(const QString& partPath)
 {
-    if (m_currentFile) {
-        m_currentFile->close();
-        m_currentFile->remove();
-        delete m_currentFile;
-        m_currentFile = nullptr;
+    // Carry the sender's mtime so the next mirror sees the file as unchanged
+    QFile part(partPath);
+    if (m_currentModified > 0 && part.open(QIODevice::ReadWrite)) {
+        part.setFileTime(QDateTime::fromMSecsSinceEpoch(m_currentModified),
+                         QFileDevice::FileModificationTime);
+        part.close();
     }
     
-    emit transferFailed(header.transferId, tr("Transfer cancelled by peer"));
-    m_state = State::Idle;
+    return replaceFile(partPath, m_currentMirrorPath) ? m_currentMirrorPath : partPath;
 }
 
-void TransferSession::onDisconnected()
+void TransferSession::handleDeltaSignature(const TransferHeader& header)
 {
-    emit disconnected();
+    if (!m_awaitingDelta || header.transferId != m_sendTransferId ||
+        header.relativePath != m_sendRelativePath || !m_sendFile) {
+        return;
+    }
+    
+    // No usable copy on the other side; send the whole file
+    const DeltaSignature base = DeltaSignature::unpack(header.signature);
+    if (base.isEmpty()) {
+        m_awaitingDelta = false;
+        QTimer::singleShot(0, this, &TransferSession::sendNextChunk);
+        return;
+    }
+    
+    // Matching reads the whole file, so it runs on the thread pool
+    const QString filePath = m_sendFile->fileName();
+    const QString transferId = m_sendTransferId;
+    const qint64 fileIndex = m_sendFileIndex;
+    QPointer<TransferSession> self(this);
+    
+    QThreadPool::globalInstance()->start([self, filePath, base, transferId, fileIndex]() {
+        const DeltaPlan plan = DeltaPlan::build(filePath, base);
+        if (!self) return;
+        QMetaObject::invokeMethod(self.data(), [self, transferId, fileIndex, plan]() {
+            if (self) self->onDeltaPlanned(transferId, fileIndex, plan);
+        }, Qt::QueuedConnection);
+    });
+}
+
+void TransferSession::onDeltaPlanned(const QString& transferId, qint64 fileIndex,
+                                     const DeltaPlan& plan)
+{
+    if (!m_awaitingDelta || transferId != m_sendTransferId || fileIndex != m_sendFileIndex ||
+        !m_sendFile) {
+        return;
+    }
+    
+    m_awaitingDelta = false;
+    m_sendDelta = true;
+    m_sendHashing = false;
+    m_deltaOps = plan.ops;
+    m_deltaOpIndex = 0;
+    m_deltaOpDone = 0;
+    m_deltaChecksum = plan.checksum;
+    
+    // The receiver already expects ops; if matching failed, one literal
+    // covering the whole file still rebuilds it
+    if (m_deltaOps.isEmpty() && m_sendTotalSize > 0) {
+        DeltaOp whole;
+        whole.length = m_sendTotalSize;
+        m_deltaOps.append(whole);
+    }
+    
+    sendNextChunk();
+}
+
+QByteArray TransferSession::nextDeltaChunk(qint64& covered)
+{
+    // Records: 'L' <length> <bytes> copies literal data, 'B' <block> <count>
+    // copies a run of blocks from the receiver's copy
+    QByteArray chunk;
+    QDataStream stream(&chunk, QIODevice::WriteOnly);
+    stream.setByteOrder(QDataStream::BigEndian);
+    covered = 0;
+    
+    while (m_deltaOpIndex < m_deltaOps.size() && chunk.size() < CHUNK_SIZE &&
+           covered < DELTA_COPY_MAX) {
+        const DeltaOp& op = m_deltaOps.at(m_deltaOpIndex);
+        
+        if (op.isBlock()) {
+            int count = 1;
+            qint64 length = op.length;
+            while (m_deltaOpIndex + count < m_deltaOps.size() && length + op.length <= DELTA_COPY_MAX) {
+                const DeltaOp& next = m_deltaOps.at(m_deltaOpIndex + count);
+                if (next.block != op.block + count) break;
+                length += next.length;
+                ++count;
+            }
+            
+            stream << static_cast<quint8>('B') << static_cast<qint32>(op.block)
+                   << static_cast<qint32>(count);
+            m_deltaOpIndex += count;
+            covered += length;
+            continue;
+        }
+        
+        const qint64 room = CHUNK_SIZE - chunk.size() - 5;
+        if (room <= 0) break;
+        
+        m_sendFile->seek(op.offset + m_deltaOpDone);
+        const QByteArray data = m_sendFile->read(qMin(room, op.length - m_deltaOpDone));
+        if (data.isEmpty()) {
+            // File shrank underneath us; the checksum will not match
+            m_deltaOpIndex = m_deltaOps.size();
+            break;
+        }
+        
+        stream << static_cast<quint8>('L') << static_cast<qint32>(data.size());
+        stream.writeRawData(data.constData(), data.size());
+        m_deltaOpDone += data.size();
+        covered += data.size();
+        
+        if (m_deltaOpDone >= op.length) {
+            ++m_deltaOpIndex;
+            m_deltaOpDone = 0;
+        }
+    }
+    
+    return chunk;
+}
+
+void TransferSession::startDeltaReceive()
+{
+    m_deltaBuffer.clear();
+    m_deltaHash.reset();
+    
+    // Only the checked copy the mirror replaces is ever signed or read from
+    const QFileInfo base(m_currentMirrorPath);
+    if (m_currentMirrorPath.isEmpty() || m_currentMirrorPath != localPath(m_currentRelativePath) ||
+        !base.isFile() || base.size() == 0) {
+        onDeltaSigned(m_currentTransferId, m_currentRelativePath, DeltaSignature());
+        return;
+    }
+    
+    // Signing reads the whole old copy, so it runs on the thread pool
+    const QString basePath = m_currentMirrorPath;
+    const QString transferId = m_currentTransferId;
+    const QString relativePath = m_currentRelativePath;
+    QPointer<TransferSession> self(this);
+    
+    QThreadPool::globalInstance()->start([self, basePath, transferId, relativePath]() {
+        const DeltaSignature signature = DeltaSignature::fromFile(basePath);
+        if (!self) return;
+        QMetaObject::invokeMethod(self.data(), [self, transferId, relativePath, signature]() {
+            if (self) self->onDeltaSigned(transferId, relativePath, signature);
+        }, Qt::QueuedConnection);
+    });
+}
+
+void TransferSession::onDeltaSigned(const QString& transferId, const QString& relativePath,
+                                    const DeltaSignature& signature)
+{
+    if (!m_currentFile || transferId != m_currentTransferId ||
+        relativePath != m_currentRelativePath) {
+        return;
+    }
+    
+    // Block copies read the old copy, which must still be what was signed
+    if (!signature.isEmpty()) {
+        m_deltaBase = new QFile(m_currentMirrorPath, this);
+        if (m_deltaBase->open(QIODevice::ReadOnly) && m_deltaBase->size() == signature.fileSize) {
+            m_deltaReceive = true;
+            m_deltaBlockSize = signature.blockSize;
+            m_deltaBaseSize = signature.fileSize;
+        } else {
+            closeDeltaBase();
+        }
+    }
+    
+    if (!m_deltaReceive && m_journal) {
+        m_journal->recordFileStarted(m_currentTransferId, m_currentRelativePath,
+                                     m_currentFile->fileName(), m_currentFileSize);
+    }
+    
+    TransferHeader reply;
+    reply.type = TransferType::DELTA_SIGNATURE;
+    reply.transferId = transferId;
+    reply.relativePath = relativePath;
+    if (m_deltaReceive) {
+        reply.signature = signature.pack();
+    }
+    sendHeader(reply);
+}
+
+bool TransferSession::applyDelta(const QByteArray& data)
+{
+    m_deltaBuffer.append(data);
+    
+    const uchar* records = reinterpret_cast<const uchar*>(m_deltaBuffer.constData());
+    const int size = m_deltaBuffer.size();
+    int pos = 0;
+    
+    while (pos < size) {
+        const char op = static_cast<char>(records[pos]);
+        
+        if (op == 'L') {
+            if (size - pos < 5) break;
+            const qint32 length = qFromBigEndian<qint32>(records + pos + 1);
+            if (length <= 0 || length > CHUNK_SIZE) return false;
+            if (size - pos - 5 < length) break;
+            
+            const QByteArray literal = m_deltaBuffer.mid(pos + 5, length);
+            if (m_currentFile->write(literal) != literal.size()) return false;
+            m_deltaHash.addData(literal);
+            m_currentBytesReceived += length;
+            pos += 5 + length;
+        } else if (op == 'B') {
+            if (size - pos < 9) break;
+            const qint32 block = qFromBigEndian<qint32>(records + pos + 1);
+            const qint32 count = qFromBigEndian<qint32>(records + pos + 5);
+            const qint64 offset = static_cast<qint64>(block) * m_deltaBlockSize;
+            if (m_deltaBlockSize <= 0 || block < 0 || count <= 0 || offset >= m_deltaBaseSize ||
+                count > qMax<qint64>(1, DELTA_COPY_MAX / m_deltaBlockSize)) {
+                return false;
+            }
+            
+            qint64 remaining = qMin(count * m_deltaBlockSize, m_deltaBaseSize - offset);
+            if (!m_deltaBase->seek(offset)) return false;
+            while (remaining > 0) {
+                const QByteArray copy = m_deltaBase->read(qMin(remaining, CHUNK_SIZE));
+                if (copy.isEmpty() || m_currentFile->write(copy) != copy.size()) return false;
+                m_deltaHash.addData(copy);
+                m_currentBytesReceived += copy.size();
+                remaining -= copy.size();
+            }
+            pos += 9;
+        } else {
+            return false;
+        }
+    }
+    
+    m_deltaBuffer.remove(0, pos);
+    return true;
+}
+
+void TransferSession::abortReceive(const QString& error)
+{
+    closeDeltaBase();
+    m_directWriter.discard();
+    m_verifier->stop();
+    clearRepairs();
+    
+    // A mirrored file keeps its old copy; the sender is stopped and anything it
+    // still has in flight for this transfer is ignored
+    if (m_currentFile) {
+        m_currentFile->close();
+        m_currentFile->remove();
+        delete m_currentFile;
+        m_currentFile = nullptr;
+    }
+    
+    m_refusedTransferId = m_currentTransferId;
+    
+    TransferHeader cancel;
+    cancel.type = TransferType::TRANSFER_CANCEL;
+    cancel.transferId = m_currentTransferId;
+    sendHeader(cancel);
+    
+    emit transferFailed(m_currentTransferId, error);
+    m_state = State::Failed;
+}
+
+void TransferSession::endDirectWrite()
+{
+    if (!m_directWriter.isOpen()) return;
+    
+    qint64 offset = 0;
+    const QByteArray tail = m_directWriter.close(&offset);
+    m_currentFile->seek(offset);
+    m_currentFile->write(tail);
+}
+
+void TransferSession::closeDeltaBase()
+{
+    if (m_deltaBase) {
+        m_deltaBase->close();
+        delete m_deltaBase;
+        m_deltaBase = nullptr;
+    }
+    m_deltaReceive = false;
+    m_deltaBuffer.clear();
+}
+
+bool TransferSession::needsHash(const OutgoingFile& file) const
+{
+    return !file.hashed && !file.stream && !file.scanner && !file.resume &&
+           QFileInfo(file.filePath).size() >= DEDUPE_MIN_SIZE;
+}
+
+void TransferSession::hashQueued(OutgoingFile& file)
+{
+    if (file.hashing) return;
+    
+    // An unchanged file is never read twice to hash it
+    if (m_hashCache) {
+        file.hash = m_hashCache->cached(file.filePath);
+        file.hashed = !file.hash.isEmpty();
+        if (file.hashed) return;
+    }
+    file.hashing = true;
+    
+    const QString filePath = file.filePath;
+    const QString transferId = file.transferId;
+    QPointer<TransferSession> self(this);
+    
+    QThreadPool::globalInstance()->start([self, filePath, transferId]() {
+        QByteArray key;
+        const QByteArray hash = HashCache::hashFile(filePath, &key);
+        if (!self) return;
+        QMetaObject::invokeMethod(self.data(), [self, filePath, transferId, key, hash]() {
+            if (self) self->onFileHashed(filePath, transferId, key, hash);
+        }, Qt::QueuedConnection);
+    });
+}
+
+void TransferSession::onFileHashed(const QString& filePath, const QString& transferId,
+                                   const QByteArray& key, const QByteArray& hash)
+{
+    if (m_hashCache && !key.isEmpty() && !hash.isEmpty()) {
+        m_hashCache->insert(key, hash);
+    }
+    
+    for (OutgoingFile& file : m_sendQueue) {
+        if (file.filePath != filePath || file.transferId != transferId || !file.hashing) continue;
+        
+        // An unreadable file goes without a hash and fails when opened
+        file.hash = hash;
+        file.hashing = false;
+        file.hashed = true;
+        break;
+    }
+    
+    if (m_accepted && !isSendingFile()) {
+        startNextFile();
+    }
+}
+
+QString TransferSession::findDuplicate(const TransferHeader& header)
+{
+    if (header.checksum.isEmpty() || header.resume) return QString();
+    
+    // An earlier file of this transfer is the surest source, found by the
+    // hash we took of it rather than the name the sender gives
+    const QString earlier = header.sameAs.isEmpty() ? QString() : m_receivedPaths.value(header.checksum);
+    if (!earlier.isEmpty() && QFileInfo(earlier).size() == header.fileSize) {
+        return earlier;
+    }
+    
+    return m_contentIndex ? m_contentIndex->find(header.checksum, header.fileSize) : QString();
+}
+
+void TransferSession::startLocalCopy(const QString& sourcePath)
+{
+    // The empty target is filled by the copy; the sender waits on our ack
+    const QString targetPath = m_currentFile->fileName();
+    m_currentFile->close();
+    
+    const QString transferId = m_currentTransferId;
+    const QString relativePath = m_currentRelativePath;
+    QPointer<TransferSession> self(this);
+    
+    QThreadPool::globalInstance()->start([self, sourcePath, targetPath, transferId, relativePath]() {
+        const bool copied = ContentIndex::cloneFile(sourcePath, targetPath);
+        if (!self) return;
+        QMetaObject::invokeMethod(self.data(), [self, transferId, relativePath, copied]() {
+            if (self) self->onLocalCopied(transferId, relativePath, copied);
+        }, Qt::QueuedConnection);
+    });
+}
+
+void TransferSession::onLocalCopied(const QString& transferId, const QString& relativePath,
+                                    bool copied)
+{
+    if (!m_currentFile || transferId != m_currentTransferId ||
+        relativePath != m_currentRelativePath) {
+        return;
+    }
+    
+    if (copied) {
+        // Both sources are kept under hashes taken here, so the copy's is known
+        m_verifier->stop();
+        m_currentContentHash = m_currentChecksum;
+        m_currentBytesReceived = m_currentFileSize;
+        emit transferProgress(m_currentTransferId, m_receiveTransferBase + m_currentBytesReceived,
+                              m_currentFileSize);
+    } else if (!m_currentFile->open(QIODevice::WriteOnly)) {
+        abortReceive(tr("Cannot create file: %1").arg(m_currentFile->fileName()));
+        return;
+    } else if (m_currentDeltaOffered) {
+        // Fall back to what the sender offered in the first place
+        startDeltaReceive();
+        return;
+    }
+    
+    TransferHeader ack;
+    ack.type = TransferType::TRANSFER_ACK;
+    ack.transferId = m_currentTransferId;
+    ack.offset = copied ? m_currentFileSize : 0;
+    sendHeader(ack);
+}
+
+QString TransferSession::downloadDir() const
+{
+    return m_downloadPath.isEmpty() ? QDir::homePath() + "/Downloads/Witra" : m_downloadPath;
+}
+
+QString TransferSession::localPath(const QString& relativePath) const
+{
+    if (!isSafeRelativePath(relativePath)) return QString();
+    
+    // Checked again once resolved, so nothing the peer names leaves the folder
+    const QString root = QDir::cleanPath(QDir(downloadDir()).absolutePath());
+    const QString path = QDir::cleanPath(QDir(root).absoluteFilePath(relativePath));
+    return path.startsWith(root + '/') ? path : QString();
+}
+
+void TransferSession::refuseTransfer(const QString& transferId, const QString& error)
+{
+    m_refusedTransferId = transferId;
+    
+    TransferHeader cancel;
+    cancel.type = TransferType::TRANSFER_CANCEL;
+    cancel.transferId = transferId;
+    sendHeader(cancel);
+    
+    if (m_currentFile && m_currentTransferId == transferId) {
+        m_currentFile->close();
+        delete m_currentFile;
+        m_currentFile = nullptr;
+    }
+    
+    emit transferFailed(transferId, error);
+}
+
+void TransferSession::discardReceivedFile()
+{
+    m_currentFile->close();
+    m_currentFile->remove();
+    delete m_currentFile;
+    m_currentFile = nullptr;
+    closeDeltaBase();
+    m_verifier->stop();
+    m_directWriter.discard();
+    clearRepairs();
+}
+
+void TransferSession::stopSendingFile()
+{
+    if (m_sendFile) {
+        m_sendFile->close();
+        delete m_sendFile;
+        m_sendFile = nullptr;
+    }
+    m_sendReader->close();
+    releaseStream(m_sendStream);
+    m_sendStream = nullptr;
+    m_awaitingResumeAck = false;
+    m_awaitingDelta = false;
+    m_sendDelta = false;
+}
+
+void TransferSession::handleTransferCancel(const TransferHeader& header)
+{
+    if (m_currentFile && header.transferId == m_currentTransferId) {
+        discardReceivedFile();
+    }
+    
+    // A receiver can refuse a folder it has no room for; stop sending it
+    if (header.transferId == m_sendTransferId && isSendingFile()) {
+        stopSendingFile();
+    }
+    dropQueuedFiles(header.transferId);
+    
+    emit transferFailed(header.transferId, tr("Transfer cancelled by peer"));
+    m_state = State::Idle;
+    
+    if (m_accepted) {
+        startNextFile();
+    }
+}
+
+void TransferSession::handleTransferAck(const TransferHeader& header)
+{
+    if ((!m_awaitingResumeAck && !m_awaitingDelta) || header.transferId != m_sendTransferId ||
+        !m_sendFile) {
+        return;
+    }
+    
+    // A receiver that copied the content locally acks at the end
+    qint64 offset = qBound<qint64>(0, header.offset, m_sendTotalSize);
+    m_sendFile->seek(offset);
+    
+    m_sendBytesSent = offset;
+    m_sendHashing = offset == 0;
+    m_awaitingResumeAck = false;
+    m_awaitingDelta = false;
+    
+    QTimer::singleShot(0, this, &TransferSession::sendNextChunk);
+}
+
+void TransferSession::handleTransferResume(const TransferHeader& header)
+{
+    emit resumeRequested(header.transferId);
+}
+
+void TransferSession::handlePieceHave(const TransferHeader& header)
+{
+    QList<int> added;
+    for (const QJsonValue& value : header.pieces) {
+        added.append(value.toInt());
+    }
+    emit piecesAdvertised(header.contentId, header.bitfield, added);
+}
+
+void TransferSession::handlePieceRequest(const TransferHeader& header)
+{
+    if (!m_pieceStore || !m_pieceStore->contains(header.contentId)) return;
+    
+    // Only the swarm this connection was opened for, or one offered to the peer
+    if (header.contentId != m_swarmContent && !m_servedContent.contains(header.contentId)) return;
+    
+    for (const QJsonValue& value : header.pieces) {
+        m_pieceQueue.enqueue(qMakePair(header.contentId, value.toInt()));
+    }
+    sendQueuedPieces();
+}
+
+void TransferSession::sendQueuedPieces()
+{
+    // Each piece goes out as one header plus its data frames, written in one
+    // go so they never interleave with a file being sent on this session.
+    // Like file chunks, they wait while the socket has enough queued
+    while (!m_pieceQueue.isEmpty() && m_socket->bytesToWrite() <= m_chunkSizer.pendingLimit()) {
+        const QPair<QString, int> next = m_pieceQueue.dequeue();
+        QByteArray data = m_pieceStore->readPiece(next.first, next.second);
+        if (data.isEmpty()) continue;
+        
+        TransferHeader piece;
+        piece.type = TransferType::PIECE_DATA;
+        piece.contentId = next.first;
+        piece.offset = next.second;
+        piece.fileSize = data.size();
+        sendHeader(piece);
+        
+        for (qint64 pos = 0; pos < data.size(); pos += CHUNK_SIZE) {
+            writeMessage(data.mid(pos, CHUNK_SIZE), false);
+        }
+    }
+}
+
+void TransferSession::handlePieceData(const TransferHeader& header)
+{
+    // A piece no longer than the manifest says; anything else is dropped
+    // with the connection rather than buffered
+    const PieceManifest manifest = m_pieceStore && m_pieceStore->contains(header.contentId)
+                                 ? m_pieceStore->manifest(header.contentId) : PieceManifest();
+    const qint64 index = header.offset;
+    if (index < 0 || index >= manifest.pieceCount() || header.fileSize < 0 ||
+        header.fileSize > qMin<qint64>(manifest.pieceLength(static_cast<int>(index)), SWARM_PIECE_SIZE)) {
+        m_buffer.clear();
+        m_expectedSize = 0;
+        m_socket->abort();
+        return;
+    }
+    
+    m_pieceContentId = header.contentId;
+    m_pieceIndex = static_cast<int>(index);
+    m_pieceRemaining = header.fileSize;
+    m_pieceBuffer.clear();
+    m_pieceBuffer.reserve(static_cast<int>(m_pieceRemaining));
+    
+    if (m_pieceRemaining == 0) {
+        emit pieceReceived(m_pieceContentId, m_pieceIndex, m_pieceBuffer);
+    }
+}
+
+void TransferSession::appendPieceData(const QByteArray& data)
+{
+    m_pieceBuffer.append(data);
+    m_pieceRemaining -= data.size();
+    
+    if (m_pieceRemaining <= 0) {
+        m_pieceRemaining = 0;
+        emit pieceReceived(m_pieceContentId, m_pieceIndex, m_pieceBuffer);
+        m_pieceBuffer.clear();
+    }
+}
+
+void TransferSession::requestRepair(qint64 offset, qint64 length)
+{
+    if (++m_repairRequests > FRAME_REPAIR_LIMIT) {
+        abortReceive(tr("Too much of %1 was damaged in transit").arg(m_currentRelativePath));
+        return;
+    }
+    
+    // The streamed hash no longer sees the file in order
+    m_missingRanges.insert(offset, length);
+    m_verifier->stop();
+    
+    TransferHeader nack;
+    nack.type = TransferType::FRAME_NACK;
+    nack.transferId = m_currentTransferId;
+    nack.relativePath = m_currentRelativePath;
+    nack.offset = offset;
+    nack.length = length;
+    sendHeader(nack);
+}
+
+void TransferSession::handleFrameNack(const TransferHeader& header)
+{
+    QString filePath = m_repairPaths.value(header.transferId + '/' + header.relativePath);
+    if (header.transferId == m_sendTransferId && header.relativePath == m_sendRelativePath) {
+        if (m_sendFile) {
+            filePath = m_sendFile->fileName();
+        } else if (m_sendStream) {
+            filePath = m_sendStream->filePath();
+        }
+    }
+    
+    // Read again from disk; an empty repair tells the receiver to give up
+    QByteArray data;
+    QFile file(filePath);
+    if (!filePath.isEmpty() && header.length > 0 && header.length <= MAX_CHUNK_SIZE &&
+        file.open(QIODevice::ReadOnly) && file.seek(header.offset)) {
+        data = file.read(header.length);
+    }
+    if (data.size() != header.length) {
+        data.clear();
+    }
+    
+    TransferHeader repair;
+    repair.type = TransferType::FRAME_REPAIR;
+    repair.transferId = header.transferId;
+    repair.relativePath = header.relativePath;
+    repair.offset = header.offset;
+    repair.length = data.size();
+    sendHeader(repair);
+    if (!data.isEmpty()) {
+        writeMessage(data, false);
+    }
+}
+
+void TransferSession::handleFrameRepair(const TransferHeader& header)
+{
+    const bool ours = m_currentFile && header.transferId == m_currentTransferId &&
+                      header.relativePath == m_currentRelativePath &&
+                      m_missingRanges.contains(header.offset);
+    
+    if (ours && header.length <= 0) {
+        abortReceive(tr("%1 was damaged in transit and could not be repaired")
+                         .arg(m_currentRelativePath));
+        return;
+    }
+    
+    // The data frame that follows is read off even when it is of no use
+    m_repairOffset = ours ? header.offset : -1;
+    m_repairRemaining = qMax<qint64>(0, header.length);
+}
+
+void TransferSession::appendRepairData(const QByteArray& data, bool intact)
+{
+    // A repair is always a single frame
+    m_repairRemaining = 0;
+    if (m_repairOffset < 0 || !m_currentFile || !m_missingRanges.contains(m_repairOffset)) return;
+    
+    const qint64 length = m_missingRanges.value(m_repairOffset);
+    if (!intact || data.size() != length) {
+        requestRepair(m_repairOffset, length);
+        return;
+    }
+    
+    const qint64 end = m_currentFile->pos();
+    m_currentFile->seek(m_repairOffset);
+    m_currentFile->write(data);
+    m_currentFile->seek(end);
+    m_missingRanges.remove(m_repairOffset);
+    
+    // The held FILE_COMPLETE goes through, then everything set aside
+    if (m_repairHeld && m_missingRanges.isEmpty()) {
+        m_repairHeld = false;
+        handleFileComplete(m_pendingComplete);
+        m_buffer.prepend(m_deferred);
+        m_deferred.clear();
+    }
+}
+
+bool TransferSession::passesRepairHold(quint8 messageType, const QByteArray& message) const
+{
+    if (messageType != FrameType::HEADER) return m_repairRemaining > 0;
+    
+    const QString type = TransferHeader::fromJson(message).type;
+    return type == TransferType::FRAME_REPAIR || type == TransferType::TRANSFER_CANCEL;
+}
+
+void TransferSession::clearRepairs()
+{
+    m_missingRanges.clear();
+    m_repairRequests = 0;
+    m_repairOffset = -1;
+    
+    if (m_repairHeld) {
+        m_repairHeld = false;
+        m_buffer.prepend(m_deferred);
+        m_deferred.clear();
+    }
+}
+
+void TransferSession::handleHoleMap(const TransferHeader& header)
+{
+    if (!m_currentFile || header.transferId != m_currentTransferId ||
+        header.relativePath != m_currentRelativePath) {
+        return;
+    }
+    
+    // Holes are skipped with seeks on the buffered file
+    endDirectWrite();
+    m_currentSparse = true;
+    m_currentExtents.clear();
+    m_currentExtentIndex = 0;
+    for (const QJsonValue& value : header.extents) {
+        const QJsonArray pair = value.toArray();
+        FileExtent extent;
+        extent.offset = pair.at(0).toVariant().toLongLong();
+        extent.length = pair.at(1).toVariant().toLongLong();
+        m_currentExtents.append(extent);
+    }
+    
+    // Ranges we skip stay unallocated
+    if (m_currentFile->isOpen()) {
+        markSparse(m_currentFile);
+    }
+}
+
+void TransferSession::skipHoles()
+{
+    while (m_currentExtentIndex < m_currentExtents.size() &&
+           m_currentExtents[m_currentExtentIndex].end() <= m_currentBytesReceived) {
+        ++m_currentExtentIndex;
+    }
+    if (m_currentExtentIndex == m_currentExtents.size()) return;
+    
+    const qint64 offset = m_currentExtents[m_currentExtentIndex].offset;
+    if (m_currentBytesReceived < offset) {
+        m_currentBytesReceived = offset;
+        m_currentFile->seek(offset);
+    }
+}
+
+bool TransferSession::applyLinkProfile()
+{
+    if (m_peerId.isEmpty() || !m_linkInterface.isEmpty()) return m_link.isValid();
+    if (!m_socket || m_socket->state() != QAbstractSocket::ConnectedState) return false;
+    
+    // Frames and buffers sized for the link from the first byte
+    m_linkInterface = LinkProfiles::interfaceOf(m_socket);
+    m_link = LinkProfiles::load(m_peerId, m_linkInterface);
+    if (!m_link.isValid()) return false;
+    
+    m_chunkSizer.seed(m_link.sendRate, m_link.rtt);
+    m_socketTuner.tuneSend(m_link.sendRate, m_link.rtt);
+    m_socketTuner.seedReceive(m_link.receiveRate, m_link.rtt);
+    emit linkMeasured();
+    return true;
+}
+
+void TransferSession::rememberLink()
+{
+    if (m_linkInterface.isEmpty()) return;
+    
+    const ChunkSizer::Stats stats = m_chunkSizer.stats();
+    LinkProfiles::Profile profile;
+    profile.sendRate = stats.throughput;
+    profile.receiveRate = m_socketTuner.receiveRate();
+    profile.rtt = stats.rtt;
+    LinkProfiles::save(m_peerId, m_linkInterface, profile);
+    m_linkInterface.clear();
+}
+
+void TransferSession::startLinkProbe()
+{
+    if (!m_swarmContent.isEmpty() || m_linkInterface.isEmpty()) return;
+    if (!QSettings().value("transfer/linkProbe", true).toBool()) return;
+    if (!LinkProfiles::claimProbe(m_peerId, m_linkInterface)) return;
+    
+    m_probeClaimed = true;
+    m_probeState = ProbeState::Pinging;
+    m_probeTimer.start();
+    QTimer::singleShot(LINK_PROBE_TIMEOUT, this, [this]() {
+        if (probing()) finishProbe();
+    });
+    
+    TransferHeader header;
+    header.type = TransferType::PING;
+    sendHeader(header);
+}
+
+void TransferSession::handlePong()
+{
+    if (m_probeState != ProbeState::Pinging) return;
+    
+    m_probeRtt = static_cast<int>(m_probeTimer.nsecsElapsed() / 1000);
+    m_probeState = ProbeState::Running;
+    startProbeBurst();
+}
+
+void TransferSession::startProbeBurst()
+{
+    m_probeSent = true;
+    m_probeSending = true;
+    m_probeTimer.start();
+    sendProbeFrames();
+}
+
+void TransferSession::sendProbeFrames()
+{
+    if (!m_probeSending || !m_socket || m_socket->state() != QAbstractSocket::ConnectedState) return;
+    
+    static const QByteArray filler(static_cast<int>(CHUNK_SIZE), '\0');
+    char header[5];
+    qToBigEndian<qint32>(1 + filler.size(), header);
+    header[4] = static_cast<char>(FrameType::PROBE);
+    
+    // Up to the socket's pending limit at a time: onBytesWritten carries on
+    // once it drains, and a kernel that takes it all gets a queued call
+    qint64 written = 0;
+    while (m_probeTimer.elapsed() < LINK_PROBE_TIME) {
+        if (m_socket->bytesToWrite() > m_chunkSizer.pendingLimit()) return;
+        if (written > m_chunkSizer.pendingLimit()) {
+            QTimer::singleShot(0, this, &TransferSession::sendProbeFrames);
+            return;
+        }
+        m_lastActivity.restart();
+        countSent(m_frameWriter.write(header, sizeof(header), filler));
+        written += sizeof(header) + filler.size();
+    }
+    
+    // Whatever is still queued arrives ahead of the marker and is timed too
+    m_probeSending = false;
+    TransferHeader end;
+    end.type = TransferType::LINK_PROBE;
+    sendHeader(end);
+}
+
+void TransferSession::countProbeFrame(int size)
+{
+    if (m_isIncoming && !m_accepted) return;
+    if (m_probeState == ProbeState::Done) return;
+    
+    if (m_probeState == ProbeState::Idle) {
+        m_probeState = ProbeState::Running;
+        QTimer::singleShot(LINK_PROBE_TIMEOUT, this, [this]() {
+            if (probing()) finishProbe();
+        });
+    }
+    
+    // The first frame only starts the clock
+    if (!m_probeReceiveTimer.isValid()) {
+        m_probeReceiveTimer.start();
+        return;
+    }
+    m_probeReceived += size;
+}
+
+void TransferSession::handleLinkProbe()
+{
+    if (m_probeState != ProbeState::Running || !m_probeReceiveTimer.isValid()) return;
+    
+    const qint64 elapsed = m_probeReceiveTimer.nsecsElapsed() / 1000;
+    m_probeReceiveRate = elapsed > 0 ? m_probeReceived * 1000000 / elapsed : 0;
+    
+    TransferHeader result;
+    result.type = TransferType::LINK_PROBE_RESULT;
+    result.rate = m_probeReceiveRate;
+    sendHeader(result);
+    
+    // The responder answers with its own burst; the initiator is done
+    if (!m_probeSent) {
+        startProbeBurst();
+    } else if (m_probeSendRate >= 0) {
+        finishProbe();
+    }
+}
+
+void TransferSession::handleLinkProbeResult(const TransferHeader& header)
+{
+    if (m_probeState != ProbeState::Running) return;
+    
+    m_probeSendRate = header.rate;
+    if (m_probeReceiveRate >= 0) {
+        finishProbe();
+    }
+}
+
+void TransferSession::finishProbe()
+{
+    endProbe();
+    
+    if (m_probeRtt < 0 && m_socket) {
+        m_probeRtt = SocketTuner::roundTripTime(m_socket->socketDescriptor());
+    }
+    LinkProfiles::Profile profile;
+    profile.sendRate = qMax<qint64>(0, m_probeSendRate);
+    profile.receiveRate = qMax<qint64>(0, m_probeReceiveRate);
+    profile.rtt = m_probeRtt;
+    
+    if (profile.isValid()) {
+        m_link = profile;
+        m_chunkSizer.seed(profile.sendRate, profile.rtt);
+        m_socketTuner.tuneSend(profile.sendRate, profile.rtt);
+        m_socketTuner.seedReceive(profile.receiveRate, profile.rtt);
+        
+        // Saved now, so later sessions to the peer skip the probe
+        LinkProfiles::save(m_peerId, m_linkInterface, profile);
+        emit linkMeasured();
+    }
+    
+    // Files held back by the probe
+    sendNextChunk();
+}
+
+void TransferSession::endProbe()
+{
+    if (!probing()) return;
+    
+    m_probeState = ProbeState::Done;
+    m_probeSending = false;
+    if (m_probeClaimed) {
+        m_probeClaimed = false;
+        LinkProfiles::releaseProbe(m_peerId, m_linkInterface);
+    }
+}
+
+bool TransferSession::probing() const
+{
+    return m_probeState == ProbeState::Pinging || m_probeState == ProbeState::Running;
+}
+
+void TransferSession::onDisconnected()
+{
+    m_pieceQueue.clear();
+    endProbe();
+    rememberLink();
+    emit disconnected();
+    
+    // Shared streams must not wait on a reader that is gone
+    abortSending();
 }
 
 void TransferSession::onSocketError(QAbstractSocket::SocketError socketError)
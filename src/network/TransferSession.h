@@ -3,12 +3,40 @@
 
 #include <QObject>
 #include <QTcpSocket>
+#include <QCryptographicHash>
 #include <QFile>
 #include <QDataStream>
+#include <QQueue>
+#include <QMap>
+#include <QElapsedTimer>
+#include <QPointer>
+#include <QPair>
+#include <QSet>
 #include "Protocol.h"
+#include "SharedChunkStream.h"
+#include "FrameWriter.h"
+#include "ChunkSizer.h"
+#include "SocketTuner.h"
+#include "LinkProfiles.h"
+#include "core/DirectoryScanner.h"
+#include "core/DeltaSync.h"
+#include "core/StreamHash.h"
+#include "core/SparseFile.h"
+#include "core/PageCacheWindow.h"
+#include "core/DirectWriter.h"
+#include "core/UringReader.h"
 
 namespace Witra {
 
+// Mirrored files are written beside the old copy and swapped in when complete
+constexpr const char* MIRROR_PART_SUFFIX = ".witra-part";
+
+class TransferJournal;
+struct JournalFile;
+class PieceStore;
+class ContentIndex;
+class HashCache;
+
 class TransferSession : public QObject {
     Q_OBJECT
     
@@ -34,24 +62,63 @@ public:
     QHostAddress peerAddress() const;
     State state() const { return m_state; }
     bool isIncoming() const { return m_isIncoming; }
+    QString token() const { return m_token; } // reconnect token the peer sent us
+    QString poolSecret() const { return m_poolSecret; } // presented in a request, issued in an accept
+    QString swarmContent() const { return m_swarmContent; } // set on piece-only connections
     
     // Setters
-    void setPeerId(const QString& id) { m_peerId = id; }
+    void setPeerId(const QString& id); // also picks the peer's socket tuning
     void setPeerName(const QString& name) { m_peerName = name; }
     void setIsIncoming(bool incoming) { m_isIncoming = incoming; }
     void setDownloadPath(const QString& path) { m_downloadPath = path; }
+    void setJournal(TransferJournal* journal) { m_journal = journal; }
+    void setPieceStore(PieceStore* store) { m_pieceStore = store; }
+    void setContentIndex(ContentIndex* index) { m_contentIndex = index; }
+    void setHashCache(HashCache* cache) { m_hashCache = cache; }
+    void setSwarmContent(const QString& contentId) { m_swarmContent = contentId; }
     
     // Connection requests
-    void sendConnectionRequest(const QString& senderName, const QString& senderId);
-    void sendConnectionAccept();
+    void sendConnectionRequest(const QString& senderName, const QString& senderId,
+                               const QString& reconnectToken = QString(),
+                               const QString& poolSecret = QString());
+    void sendConnectionAccept(const QString& issuedToken = QString(),
+                              const QString& poolSecret = QString());
     void sendConnectionReject();
     
     // File transfer
     void sendFile(const QString& filePath, const QString& transferId, 
                   const QString& relativePath = QString(), 
-                  qint64 totalFiles = 1, qint64 currentFile = 1);
-    void sendFolder(const QString& folderPath, const QString& transferId);
-    void cancelTransfer();
+                  qint64 totalFiles = 1, qint64 currentFile = 1,
+                  bool resume = false);
+    // Files go out while the folder is still being scanned, in scan order;
+    // a resumed folder skips the relative paths it already sent
+    void sendFolder(const QString& folderPath, const QString& transferId,
+                    const QSet<QString>& sentFiles = QSet<QString>(), bool resume = false);
+    // Only files the receiver lacks or holds a different version of are sent
+    void mirrorFolder(const QString& folderPath, const QString& transferId,
+                      bool propagateDeletes, bool resume = false);
+    // Sends a file whose chunks are read once and shared with other sessions
+    void sendShared(SharedChunkStream* stream, const QString& transferId);
+    // Stops one transfer; others sharing the session carry on
+    void cancelTransfer(const QString& transferId);
+    bool isSending() const { return m_sendFile || m_sendStream || !m_sendQueue.isEmpty(); }
+    bool isBusy() const { return isSending() || m_currentFile; }
+    bool isAccepted() const { return m_accepted; }
+    int queuedFiles() const { return m_sendQueue.size(); }
+    qint64 idleTime() const { return m_lastActivity.elapsed(); }
+    // Frame size in use, and the link measurements behind it
+    ChunkSizer::Stats sendStats() const { return m_chunkSizer.stats(); }
+    LinkProfiles::Profile linkProfile() const { return m_link; } // learned or probed
+    bool handlesTransfer(const QString& transferId) const;
+    
+    // Ask the sending side to pick up a journaled transfer again
+    void requestResume(const QString& transferId);
+    
+    // Swarm pieces
+    void sendSwarmManifest(const QString& transferId, const QJsonObject& manifest);
+    void advertisePieces(const QString& contentId, const QByteArray& bitfield);
+    void announcePiece(const QString& contentId, int index);
+    void requestPieces(const QString& contentId, const QList<int>& indices);
     
     // Socket
     QTcpSocket* socket() const { return m_socket; }
@@ -65,42 +132,161 @@ signals:
                         qint64 totalSize, qint64 totalFiles);
     void transferProgress(const QString& transferId, qint64 bytesReceived, qint64 totalBytes);
     void fileReceived(const QString& transferId, const QString& filePath);
+    // Each received file, and whether its content was checked against the sender's
+    void fileChecked(const QString& transferId, bool verified);
     void transferCompleted(const QString& transferId);
     void transferFailed(const QString& transferId, const QString& error);
+    void resumeRequested(const QString& transferId);
+    void folderScanProgress(const QString& transferId, qint64 totalFiles, qint64 totalSize,
+                            bool complete);
+    void folderManifestReceived(const QString& transferId, const QString& folderName,
+                                qint64 totalFiles, qint64 totalSize, bool complete);
+    void swarmOffered(const QString& transferId, const QJsonObject& manifest);
+    void piecesAdvertised(const QString& contentId, const QByteArray& bitfield,
+                          const QList<int>& added);
+    void pieceReceived(const QString& contentId, int index, const QByteArray& data);
     void disconnected();
     void error(const QString& errorMessage);
+    void linkMeasured(); // linkProfile() has numbers for the peer card
     
 private slots:
     void onReadyRead();
     void onDisconnected();
     void onSocketError(QAbstractSocket::SocketError socketError);
     void sendNextChunk();
+    void onBytesWritten(qint64 bytes);
+    void applyTuning();
     
 private:
+    struct OutgoingFile;
+    
+    void processBuffer();
     void processMessage(const QByteArray& message);
+    QByteArray readSendChunk(qint64 length);
     void handleConnectionRequest(const TransferHeader& header);
+    bool applyLinkProfile();
+    void rememberLink();
+    void startLinkProbe();
+    void handlePong();
+    void startProbeBurst();
+    void sendProbeFrames();
+    void countProbeFrame(int size);
+    void handleLinkProbe();
+    void handleLinkProbeResult(const TransferHeader& header);
+    void finishProbe();
+    void endProbe();
+    bool probing() const;
     void handleConnectionAccept(const TransferHeader& header);
     void handleConnectionReject(const TransferHeader& header);
     void handleFileHeader(const TransferHeader& header);
-    void handleFileData(const QByteArray& data);
+    void handleFileData(const QByteArray& data, bool intact = true);
     void handleFileComplete(const TransferHeader& header);
+    void handleFolderManifest(const TransferHeader& header);
+    void handleMirrorWant(const TransferHeader& header);
+    void handleDeltaSignature(const TransferHeader& header);
     void handleTransferCancel(const TransferHeader& header);
+    void handleTransferAck(const TransferHeader& header);
+    void handleTransferResume(const TransferHeader& header);
+    void handlePieceHave(const TransferHeader& header);
+    void handlePieceRequest(const TransferHeader& header);
+    void handlePieceData(const TransferHeader& header);
+    void appendPieceData(const QByteArray& data);
+    void sendQueuedPieces();
+    
+    // Frame checks: a data frame that fails its CRC is asked for again by
+    // range, and the file completes once every such range is back
+    void handleFrameNack(const TransferHeader& header);
+    void handleFrameRepair(const TransferHeader& header);
+    void appendRepairData(const QByteArray& data, bool intact);
+    void requestRepair(qint64 offset, qint64 length);
+    bool passesRepairHold(quint8 messageType, const QByteArray& message) const;
+    void clearRepairs();
+    
+    // Sparse files: only data extents are sent, after a HOLE_MAP listing them
+    void handleHoleMap(const TransferHeader& header);
+    void skipHoles();
+    
+    // Delta sends: the receiver signs its copy, the sender plans against it
+    void startDeltaReceive();
+    void onDeltaSigned(const QString& transferId, const QString& relativePath,
+                       const DeltaSignature& signature);
+    void onDeltaPlanned(const QString& transferId, qint64 fileIndex, const DeltaPlan& plan);
+    QByteArray nextDeltaChunk(qint64& covered);
+    bool applyDelta(const QByteArray& data);
+    void closeDeltaBase();
+    
+    // Streaming verification: the sender hashes what it reads, the
+    // receiver what it writes, and the file stands only if they agree
+    void onFileVerified(const QByteArray& digest, const QByteArray& contentHash);
+    void finishReceivedFile(bool verified);
+    
+    // Dedupe: large files are hashed before their header goes out, and a
+    // receiver already holding the content copies it locally
+    bool needsHash(const OutgoingFile& file) const;
+    void hashQueued(OutgoingFile& file);
+    void onFileHashed(const QString& filePath, const QString& transferId, const QByteArray& key,
+                      const QByteArray& hash);
+    QString findDuplicate(const TransferHeader& header);
+    void startLocalCopy(const QString& sourcePath);
+    void onLocalCopied(const QString& transferId, const QString& relativePath, bool copied);
+    
+    void startNextFile();
+    void queueFolder(const QString& folderPath, const QString& transferId, const QSet<QString>& sentFiles,
+                     bool resume, bool mirror, bool propagateDeletes);
+    bool expandFolder();
+    void announceFiles(OutgoingFile& folder);
+    QString downloadDir() const;
+    QString localPath(const QString& relativePath) const; // empty unless inside downloadDir()
+    void refuseTransfer(const QString& transferId, const QString& error);
+    QString replaceMirroredFile(const QString& partPath);
+    void removeStaleFiles(const QString& folderName);
+    void releaseQueued(const OutgoingFile& file);
+    void finishSendFile();
+    void abortSending();
+    void stopSendingFile();
+    void discardReceivedFile();
+    bool isSendingFile() const;
+    void releaseStream(SharedChunkStream* stream);
+    void dropQueuedFiles(const QString& transferId);
+    bool openResumedFile(const JournalFile& partial);
+    void checkpointReceive();
+    void endDirectWrite();
+    void abortReceive(const QString& error);
     
     void sendHeader(const TransferHeader& header);
     void writeMessage(const QByteArray& data, bool isHeader = true);
+    void countSent(qint64 bytes);
     
     QTcpSocket* m_socket;
+    FrameWriter m_frameWriter;
     QString m_sessionId;
     QString m_peerId;
     QString m_peerName;
     bool m_isIncoming;
     State m_state;
+    bool m_accepted; // handshake done; queued files may go out
+    QString m_token;
+    QString m_poolSecret;
+    QElapsedTimer m_lastActivity;
     QString m_downloadPath;
+    TransferJournal* m_journal;
+    PieceStore* m_pieceStore;
+    ContentIndex* m_contentIndex;
+    HashCache* m_hashCache;
+    QString m_swarmContent;
+    QSet<QString> m_servedContent; // swarms this peer was told about
+    
+    // Pieces asked for and not sent yet, as content id and index
+    QQueue<QPair<QString, int>> m_pieceQueue;
     
     // Message parsing
     QByteArray m_buffer;
     qint32 m_expectedSize;
     bool m_expectingHeader;
+    bool m_inputHeld; // waiting on a file's digest; later messages stay buffered
+    bool m_frameChecks;     // we ask for data frames with a CRC32C
+    bool m_peerFrameChecks; // the peer asked for them
+    bool m_peerHoleMaps;    // the peer takes sparse files without their holes
     
     // Current receiving file
     QString m_currentTransferId;
@@ -111,12 +297,157 @@ private:
     qint64 m_currentBytesReceived;
     qint64 m_totalFiles;
     qint64 m_currentFileIndex;
+    qint64 m_receiveTransferBase; // bytes of earlier files in the same transfer
+    QElapsedTimer m_checkpointTimer;
+    PageCacheWindow m_receiveCache;
+    DirectWriter m_directWriter; // opt-in; bypasses the cache for plain sequential writes
+    
+    // Folder being announced to us by FOLDER_MANIFEST pages
+    QString m_manifestTransferId;
+    QSet<QString> m_preparedDirs;
+    QString m_refusedTransferId; // cancelled for lack of space; its files are ignored
+    
+    // Mirror receive: what the manifest pages asked for, and every path
+    // listed when stale files are to be removed
+    bool m_mirrorDeletes;
+    qint64 m_mirrorWantedFiles;
+    qint64 m_mirrorWantedBytes;
+    QSet<QString> m_mirrorPaths;
+    QString m_currentMirrorPath; // final path; data goes to a part file beside it
+    qint64 m_currentModified;
+    QByteArray m_currentChecksum; // content hash the sender offered
+    QByteArray m_currentContentHash; // content hash taken here; only this is indexed
+    bool m_currentDeltaOffered;
+    QHash<QByteArray, QString> m_receivedPaths; // content hash taken here to where it landed, this transfer
+    
+    // Delta receive: the part file is rebuilt from blocks of the old copy
+    // and literal data, and hashed as it is written
+    bool m_deltaReceive;
+    QFile* m_deltaBase;
+    qint64 m_deltaBlockSize;
+    qint64 m_deltaBaseSize;
+    QByteArray m_deltaBuffer; // op records split across data frames
+    QCryptographicHash m_deltaHash;
+    
+    // Hash of the file being received, worked out off the GUI thread, and
+    // the sender's digest it must match
+    StreamVerifier* m_verifier;
+    QByteArray m_expectedDigest;
+    
+    // Damaged ranges of the file being received, offset to length. Its
+    // FILE_COMPLETE waits for them, with every later message but repairs
+    // set aside in m_deferred.
+    QMap<qint64, qint64> m_missingRanges;
+    int m_repairRequests;
+    qint64 m_repairOffset;
+    qint64 m_repairRemaining;
+    bool m_repairHeld;
+    TransferHeader m_pendingComplete;
+    QByteArray m_deferred;
+    
+    // Data extents of a sparse file being received; frames fill them in
+    // order and the holes between are skipped
+    bool m_currentSparse;
+    QList<FileExtent> m_currentExtents;
+    int m_currentExtentIndex;
+    
+    // Piece being received; its data frames follow the PIECE_DATA header
+    QString m_pieceContentId;
+    int m_pieceIndex;
+    qint64 m_pieceRemaining;
+    QByteArray m_pieceBuffer;
+    
+    // Files waiting to be sent, in order. A folder still being scanned sits
+    // in the queue as one entry and expands a file at a time in its place.
+    struct OutgoingFile {
+        QString filePath;
+        QString transferId;
+        QString relativePath;
+        qint64 totalFiles;
+        qint64 fileIndex;
+        bool resume;
+        QPointer<SharedChunkStream> stream;
+        QPointer<DirectoryScanner> scanner;
+        QSet<QString> sentFiles; // relative paths sent before an interruption
+        QList<ScanEntry> announced; // listed in the manifest, not yet sent
+        bool manifestStarted = false;
+        bool manifestDone = false;
+        
+        // Mirror: pages wait for the receiver to say which entries it wants
+        bool mirror = false;
+        bool mirrorDeletes = false;
+        qint64 modified = 0;
+        QList<ScanEntry> awaiting;
+        QQueue<int> pageSizes;
+        qint64 wantedFiles = 0;
+        qint64 wantedBytes = 0;
+        
+        // Content hash, worked out on the thread pool ahead of the header
+        QByteArray hash;
+        bool hashing = false;
+        bool hashed = false;
+    };
+    QQueue<OutgoingFile> m_sendQueue;
     
     // Current sending file
     QFile* m_sendFile;
+    QPointer<SharedChunkStream> m_sendStream;
     QString m_sendTransferId;
+    QString m_sendRelativePath;
     qint64 m_sendTotalSize;
     qint64 m_sendBytesSent;
+    qint64 m_sendTransferBase; // bytes of earlier files in the same transfer
+    qint64 m_sendFileIndex;
+    qint64 m_sendTotalFiles;
+    PageCacheWindow m_sendCache;
+    UringReader* m_sendReader; // io_uring read-ahead, where built in
+    bool m_awaitingResumeAck;
+    bool m_waitingForWrite; // socket buffer full; resume on bytesWritten
+    ChunkSizer m_chunkSizer;
+    SocketTuner m_socketTuner;
+    QString m_linkInterface; // local interface the link profile is kept under
+    LinkProfiles::Profile m_link;
+    
+    // Link probe after the accept: a PING for the round trip, then a timed
+    // burst of PROBE frames each way, the initiator's first
+    enum class ProbeState { Idle, Pinging, Running, Done };
+    ProbeState m_probeState;
+    bool m_probeClaimed;     // we hold the link's probe claim; the responder never does
+    bool m_probeSent;        // our burst has started
+    bool m_probeSending;     // and is still going
+    QElapsedTimer m_probeTimer;
+    QElapsedTimer m_probeReceiveTimer; // from the peer's first PROBE frame
+    qint64 m_probeReceived;
+    qint64 m_probeSendRate;    // -1 until measured
+    qint64 m_probeReceiveRate;
+    int m_probeRtt;
+    
+    // Delta send: waiting for the receiver's signature and then our plan,
+    // and how far through the plan's ops the data frames have got
+    bool m_awaitingDelta;
+    bool m_sendDelta;
+    QList<DeltaOp> m_deltaOps;
+    int m_deltaOpIndex;
+    qint64 m_deltaOpDone;
+    QByteArray m_deltaChecksum;
+    
+    // Hash of every byte read from the start of the file; off once the
+    // file is resumed part way or sent as a delta
+    Xxh64 m_sendHash;
+    bool m_sendHashing;
+    
+    // Data extents of a sparse file being sent; no frame crosses one's end
+    bool m_sendSparse;
+    QList<FileExtent> m_sendExtents;
+    int m_sendExtentIndex;
+    
+    // Content already sent in this transfer, by hash
+    QHash<QByteArray, QString> m_sentHashes;
+    
+    // Recently finished files by transfer and relative path, so frames the
+    // receiver found damaged can still be read again and repaired
+    QHash<QString, QString> m_repairPaths;
+    QQueue<QString> m_repairOrder;
 };
 
 } // namespace Witra
@@ -11,6 +11,7 @@ namespace Witra {
 ConnectionDialog::ConnectionDialog(const QString& senderName, QWidget* parent)
     : QDialog(parent, Qt::FramelessWindowHint | Qt::WindowStaysOnTopHint)
     , m_senderName(senderName)
+    , m_trustCheckBox(nullptr)
 {
     setAttribute(Qt::WA_TranslucentBackground);
     setModal(false);
@@ -40,7 +41,7 @@ ConnectionDialog::ConnectionDialog(const QString& senderName, QWidget* parent)
 
 void ConnectionDialog::setupUi()
 {
-    setFixedSize(340, 160);
+    setFixedSize(340, 190);
     
     QVBoxLayout* mainLayout = new QVBoxLayout(this);
     mainLayout->setContentsMargins(0, 0, 0, 0);
@@ -64,6 +65,10 @@ void ConnectionDialog::setupUi()
     messageLabel->setObjectName("dialogMessage");
     messageLabel->setWordWrap(true);
     
+    // Trust
+    m_trustCheckBox = new QCheckBox("Trust this device and reconnect without asking");
+    m_trustCheckBox->setObjectName("trustCheckBox");
+    
     // Buttons
     QHBoxLayout* buttonLayout = new QHBoxLayout();
     buttonLayout->setSpacing(12);
@@ -87,6 +92,7 @@ void ConnectionDialog::setupUi()
     
     containerLayout->addWidget(titleLabel);
     containerLayout->addWidget(messageLabel);
+    containerLayout->addWidget(m_trustCheckBox);
     containerLayout->addStretch();
     containerLayout->addLayout(buttonLayout);
     
@@ -120,6 +126,12 @@ void ConnectionDialog::applyStyles()
             color: #00D9FF;
         }
         
+        #trustCheckBox {
+            font-family: 'Segoe UI', sans-serif;
+            font-size: 12px;
+            color: #8B949E;
+        }
+        
         #declineButton {
             background-color: transparent;
             border: 1px solid #30363D;
@@ -4,6 +4,7 @@
 #include <QDialog>
 #include <QLabel>
 #include <QPushButton>
+#include <QCheckBox>
 
 namespace Witra {
 
@@ -13,6 +14,9 @@ class ConnectionDialog : public QDialog {
 public:
     explicit ConnectionDialog(const QString& senderName, QWidget* parent = nullptr);
     
+    // Accepted devices may reconnect later without asking
+    bool trustRequested() const { return m_trustCheckBox->isChecked(); }
+    
 signals:
     void accepted();
     void rejected();
@@ -22,6 +26,7 @@ private:
     void applyStyles();
     
     QString m_senderName;
+    QCheckBox* m_trustCheckBox;
 };
 
 } // namespace Witra
@@ -16,6 +16,8 @@
 #include <QApplication>
 #include <QSettings>
 #include <QScreen>
+#include <QFileInfo>
+#include <QLocale>
 
 namespace Witra {
 
@@ -186,6 +188,17 @@ void MainWindow::setupUi()
         }
         
         statusLabel->setText(status);
+        
+        // Connection reuse, for diagnosing slow transfer starts
+        SessionPool::Stats pool = m_transferManager->sessionPool()->stats();
+        QString poolTip = QString("%1 open connection%2 • %3% reused")
+            .arg(pool.established)
+            .arg(pool.established == 1 ? "" : "s")
+            .arg(qRound(pool.hitRate() * 100.0));
+        if (pool.largestChunk > 0) {
+            poolTip += QString(" • frames up to %1").arg(QLocale().formattedDataSize(pool.largestChunk));
+        }
+        statusLabel->setToolTip(poolTip);
     };
     
     QTimer* statusTimer = new QTimer(this);
@@ -347,8 +360,8 @@ void MainWindow::onConnectionRequestReceived(TransferSession* session,
 {
     ConnectionDialog* dialog = new ConnectionDialog(senderName, this);
     
-    connect(dialog, &ConnectionDialog::accepted, this, [this, session]() {
-        m_transferManager->acceptConnectionRequest(session);
+    connect(dialog, &ConnectionDialog::accepted, this, [this, session, dialog]() {
+        m_transferManager->acceptConnectionRequest(session, dialog->trustRequested());
     });
     
     connect(dialog, &ConnectionDialog::rejected, this, [this, session]() {
@@ -404,6 +417,49 @@ void MainWindow::dropEvent(QDropEvent* event)
         }
         
         if (!paths.isEmpty()) {
+            QList<Peer*> connected;
+            for (Peer* peer : m_peerManager->peers()) {
+                if (peer->isConnected()) {
+                    connected.append(peer);
+                }
+            }
+            
+            // Several devices connected: offer to send to all of them at once
+            if (connected.size() > 1) {
+                QMessageBox box(QMessageBox::Question, "Send to All",
+                    QString("Send to all %1 connected devices?").arg(connected.size()),
+                    QMessageBox::NoButton, this);
+                QPushButton* allButton = box.addButton("Send to All", QMessageBox::AcceptRole);
+                QPushButton* swarmButton = box.addButton("Swarm to All", QMessageBox::AcceptRole);
+                swarmButton->setToolTip("Devices also pass pieces on to each other; "
+                                        "fastest for large files and many devices");
+                box.addButton("Choose Device", QMessageBox::RejectRole);
+                box.exec();
+                
+                if (box.clickedButton() == allButton) {
+                    m_transferManager->sendFilesToPeers(connected, paths);
+                    showTransferPage();
+                    return;
+                }
+                
+                if (box.clickedButton() == swarmButton) {
+                    // Folders are not split into pieces; they go out as a fan-out
+                    QStringList folders;
+                    for (const QString& path : paths) {
+                        if (QFileInfo(path).isDir()) {
+                            folders.append(path);
+                        } else {
+                            m_transferManager->sendSwarm(connected, path);
+                        }
+                    }
+                    if (!folders.isEmpty()) {
+                        m_transferManager->sendFilesToPeers(connected, folders);
+                    }
+                    showTransferPage();
+                    return;
+                }
+            }
+            
             // Switch to lobby to select a peer
             showLobbyPage();
             m_lobbyPage->setFilesToSend(paths);
@@ -3,6 +3,7 @@
 #include <QHBoxLayout>
 #include <QVBoxLayout>
 #include <QFileDialog>
+#include <QLocale>
 #include <QStyle>
 #include <QTimer>
 #include <QMessageBox>
@@ -22,6 +23,7 @@ PeerWidget::PeerWidget(Peer* peer, TransferManager* transferManager, QWidget* pa
     , m_rejectButton(nullptr)
     , m_sendFilesButton(nullptr)
     , m_sendFolderButton(nullptr)
+    , m_mirrorFolderButton(nullptr)
     , m_disconnectButton(nullptr)
     , m_actionContainer(nullptr)
     , m_disconnectUpdateTimer(nullptr)
@@ -31,6 +33,7 @@ PeerWidget::PeerWidget(Peer* peer, TransferManager* transferManager, QWidget* pa
     updateDisplay();
     
     connect(m_peer, &Peer::stateChanged, this, &PeerWidget::updateDisplay);
+    connect(m_peer, &Peer::expectedRateChanged, this, &PeerWidget::updateDisplay);
     
     // Timer to update disconnect button state based on active transfers
     m_disconnectUpdateTimer = new QTimer(this);
@@ -114,6 +117,12 @@ void PeerWidget::setupUi()
     connect(m_sendFolderButton, &QPushButton::clicked, this, &PeerWidget::onSendFolderClicked);
     actionLayout->addWidget(m_sendFolderButton);
     
+    m_mirrorFolderButton = new QPushButton("Mirror Folder");
+    m_mirrorFolderButton->setObjectName("sendButton");
+    m_mirrorFolderButton->setToolTip(tr("Send only what changed since the last mirror"));
+    connect(m_mirrorFolderButton, &QPushButton::clicked, this, &PeerWidget::onMirrorFolderClicked);
+    actionLayout->addWidget(m_mirrorFolderButton);
+    
     // Disconnect button (when connected and no active transfers)
     m_disconnectButton = new QPushButton("Disconnect");
     m_disconnectButton->setObjectName("disconnectButton");
@@ -267,8 +276,12 @@ void PeerWidget::updateDisplay()
     m_nameLabel->setText(m_peer->displayName());
     m_deviceLabel->setText(m_peer->deviceName());
     
-    // Status
-    m_statusLabel->setText(m_peer->stateString());
+    // Status, with the throughput the link was measured at once connected
+    QString status = m_peer->stateString();
+    if (m_peer->isConnected() && m_peer->expectedRate() > 0) {
+        status += tr(" • about %1/s").arg(QLocale().formattedDataSize(m_peer->expectedRate()));
+    }
+    m_statusLabel->setText(status);
     
     // Update status color based on state
     QString statusColor = "#8B949E";
@@ -296,6 +309,7 @@ void PeerWidget::updateDisplay()
     m_rejectButton->setVisible(state == Peer::ConnectionState::RequestReceived);
     m_sendFilesButton->setVisible(state == Peer::ConnectionState::Connected);
     m_sendFolderButton->setVisible(state == Peer::ConnectionState::Connected);
+    m_mirrorFolderButton->setVisible(state == Peer::ConnectionState::Connected);
     m_disconnectButton->setVisible(state == Peer::ConnectionState::Connected);
     
     // Update disconnect button state
@@ -385,6 +399,26 @@ void PeerWidget::onSendFolderClicked()
     }
 }
 
+void PeerWidget::onMirrorFolderClicked()
+{
+    QString folder = QFileDialog::getExistingDirectory(
+        this, tr("Select Folder to Mirror"),
+        QDir::homePath()
+    );
+    
+    if (folder.isEmpty()) return;
+    
+    QMessageBox::StandardButton answer = QMessageBox::question(
+        this, tr("Mirror Folder"),
+        tr("Also delete files on %1 that no longer exist in this folder?")
+            .arg(m_peer->displayName()),
+        QMessageBox::Yes | QMessageBox::No | QMessageBox::Cancel, QMessageBox::No);
+    
+    if (answer == QMessageBox::Cancel) return;
+    
+    m_transferManager->mirrorFolder(m_peer, folder, answer == QMessageBox::Yes);
+}
+
 void PeerWidget::onDisconnectClicked()
 {
     if (m_transferManager->hasActiveTransfersWithPeer(m_peer->id())) {
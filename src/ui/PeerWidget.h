@@ -25,6 +25,7 @@ private slots:
     void onRejectClicked();
     void onSendFilesClicked();
     void onSendFolderClicked();
+    void onMirrorFolderClicked();
     void onDisconnectClicked();
     void updateDisconnectButton();
     
@@ -47,6 +48,7 @@ private:
     QPushButton* m_rejectButton;
     QPushButton* m_sendFilesButton;
     QPushButton* m_sendFolderButton;
+    QPushButton* m_mirrorFolderButton;
     QPushButton* m_disconnectButton;
     
     QWidget* m_actionContainer;
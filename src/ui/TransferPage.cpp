@@ -4,15 +4,38 @@
 #include <QScrollArea>
 #include <QPushButton>
 #include <QHBoxLayout>
+#include <QLocale>
 
 namespace Witra {
 
+namespace {
+
+// Archived transfers read per "Show Older Transfers" click
+constexpr int ARCHIVE_PAGE_SIZE = 20;
+
+QString recordStatus(TransferItem::Status status)
+{
+    switch (status) {
+        case TransferItem::Status::Completed: return "Completed";
+        case TransferItem::Status::Failed: return "Failed";
+        case TransferItem::Status::Cancelled: return "Cancelled";
+        default: return "Unfinished";
+    }
+}
+
+} // namespace
+
 TransferPage::TransferPage(TransferManager* transferManager, QWidget* parent)
     : QWidget(parent)
     , m_transferManager(transferManager)
     , m_transfersContainer(nullptr)
     , m_transfersLayout(nullptr)
     , m_emptyLabel(nullptr)
+    , m_olderSection(nullptr)
+    , m_olderTitle(nullptr)
+    , m_olderLayout(nullptr)
+    , m_olderButton(nullptr)
+    , m_olderOffset(0)
 {
     setupUi();
     applyStyles();
@@ -143,6 +166,29 @@ void TransferPage::setupUi()
     m_emptyLabel->setAlignment(Qt::AlignCenter);
     m_transfersLayout->insertWidget(0, m_emptyLabel);
     
+    // Older transfers, below the live ones; nothing is read until asked for
+    m_olderSection = new QWidget();
+    QVBoxLayout* olderSectionLayout = new QVBoxLayout(m_olderSection);
+    olderSectionLayout->setContentsMargins(0, 12, 0, 0);
+    olderSectionLayout->setSpacing(8);
+    
+    m_olderTitle = new QLabel("Older Transfers");
+    m_olderTitle->setObjectName("olderTitle");
+    m_olderTitle->setVisible(false);
+    olderSectionLayout->addWidget(m_olderTitle);
+    
+    m_olderLayout = new QVBoxLayout();
+    m_olderLayout->setSpacing(8);
+    olderSectionLayout->addLayout(m_olderLayout);
+    
+    m_olderButton = new QPushButton("Show Older Transfers");
+    m_olderButton->setObjectName("olderButton");
+    m_olderButton->setVisible(!m_transferManager->archivedTransfers(0, 1).isEmpty());
+    connect(m_olderButton, &QPushButton::clicked, this, &TransferPage::loadOlderTransfers);
+    olderSectionLayout->addWidget(m_olderButton, 0, Qt::AlignHCenter);
+    
+    m_transfersLayout->insertWidget(m_transfersLayout->count() - 1, m_olderSection);
+    
     scrollArea->setWidget(m_transfersContainer);
     mainLayout->addWidget(scrollArea, 1);
 }
@@ -171,6 +217,47 @@ void TransferPage::applyStyles()
             color: #8B949E;
         }
         
+        #olderButton {
+            background-color: transparent;
+            border: 1px solid #30363D;
+            border-radius: 8px;
+            padding: 8px 16px;
+            font-family: 'Segoe UI', sans-serif;
+            font-size: 13px;
+            color: #8B949E;
+        }
+        
+        #olderButton:hover {
+            background-color: #21262D;
+            border-color: #484F58;
+            color: #F0F6FC;
+        }
+        
+        #olderTitle {
+            font-family: 'Segoe UI', sans-serif;
+            font-size: 14px;
+            font-weight: 600;
+            color: #8B949E;
+        }
+        
+        #archivedRow {
+            background-color: #161B22;
+            border: 1px solid #21262D;
+            border-radius: 8px;
+        }
+        
+        #archivedName {
+            font-family: 'Segoe UI', sans-serif;
+            font-size: 13px;
+            color: #C9D1D9;
+        }
+        
+        #archivedMeta {
+            font-family: 'Segoe UI', sans-serif;
+            font-size: 12px;
+            color: #6E7681;
+        }
+        
         #clearButton:hover {
             background-color: #21262D;
             border-color: #484F58;
@@ -239,6 +326,18 @@ void TransferPage::onTransferRemoved(const QString& transferId)
         widget->deleteLater();
     }
     
+    // Finished transfers leave the list for the archive; once older ones
+    // are showing, the newest record joins them at the top
+    if (m_olderTitle->isHidden()) {
+        m_olderButton->setVisible(true);
+    } else {
+        const QList<TransferRecord> newest = m_transferManager->archivedTransfers(0, 1);
+        if (!newest.isEmpty() && !m_olderIds.contains(newest.first().id)) {
+            m_olderIds.insert(newest.first().id);
+            m_olderLayout->insertWidget(0, createArchivedRow(newest.first()));
+            ++m_olderOffset;
+        }
+    }
     m_emptyLabel->setVisible(m_transferWidgets.isEmpty());
 }
 
@@ -251,22 +350,57 @@ void TransferPage::updateTransferList()
     m_emptyLabel->setVisible(m_transferWidgets.isEmpty());
 }
 
-void TransferPage::clearCompleted()
+void TransferPage::loadOlderTransfers()
 {
-    QStringList toRemove;
-    
-    for (auto it = m_transferWidgets.begin(); it != m_transferWidgets.end(); ++it) {
-        TransferItem* item = m_transferManager->transfer(it.key());
-        if (item && (item->status() == TransferItem::Status::Completed ||
-                     item->status() == TransferItem::Status::Failed ||
-                     item->status() == TransferItem::Status::Cancelled)) {
-            toRemove.append(it.key());
-        }
+    // Newest first; anything already shown is skipped
+    const QList<TransferRecord> records =
+        m_transferManager->archivedTransfers(m_olderOffset, ARCHIVE_PAGE_SIZE);
+    m_olderOffset += records.size();
+    
+    for (const TransferRecord& record : records) {
+        if (m_olderIds.contains(record.id)) continue;
+        m_olderIds.insert(record.id);
+        m_olderLayout->addWidget(createArchivedRow(record));
     }
     
-    for (const QString& id : toRemove) {
-        onTransferRemoved(id);
+    m_olderTitle->setVisible(!m_olderIds.isEmpty());
+    m_olderButton->setVisible(records.size() == ARCHIVE_PAGE_SIZE);
+}
+
+QWidget* TransferPage::createArchivedRow(const TransferRecord& record) const
+{
+    QWidget* row = new QWidget();
+    row->setObjectName("archivedRow");
+    
+    QVBoxLayout* layout = new QVBoxLayout(row);
+    layout->setContentsMargins(16, 10, 16, 10);
+    layout->setSpacing(2);
+    
+    QLabel* name = new QLabel(record.fileName);
+    name->setObjectName("archivedName");
+    
+    QLocale locale;
+    const QString direction = record.direction == TransferItem::Direction::Incoming ? "from" : "to";
+    QLabel* meta = new QLabel(QString("%1 • %2 • %3 %4 • %5")
+        .arg(recordStatus(record.status))
+        .arg(locale.formattedDataSize(record.totalSize))
+        .arg(direction)
+        .arg(record.peerName)
+        .arg(locale.toString(record.finishTime.toLocalTime(), QLocale::ShortFormat)));
+    meta->setObjectName("archivedMeta");
+    if (!record.errorMessage.isEmpty()) {
+        meta->setToolTip(record.errorMessage);
     }
+    
+    layout->addWidget(name);
+    layout->addWidget(meta);
+    return row;
+}
+
+void TransferPage::clearCompleted()
+{
+    // Finished items are archived; widgets go away via transferRemoved
+    m_transferManager->clearFinished();
 }
 
 } // namespace Witra
@@ -4,6 +4,8 @@
 #include <QWidget>
 #include <QVBoxLayout>
 #include <QLabel>
+#include <QPushButton>
+#include <QSet>
 #include "core/TransferManager.h"
 
 namespace Witra {
@@ -22,10 +24,12 @@ private slots:
     void onTransferRemoved(const QString& transferId);
     void updateTransferList();
     void clearCompleted();
+    void loadOlderTransfers();
     
 private:
     void setupUi();
     void applyStyles();
+    QWidget* createArchivedRow(const TransferRecord& record) const;
     
     TransferManager* m_transferManager;
     
@@ -34,6 +38,14 @@ private:
     QLabel* m_emptyLabel;
     
     QMap<QString, TransferWidget*> m_transferWidgets;
+    
+    // Archived transfers, read a page at a time from the archive on request
+    QWidget* m_olderSection;
+    QLabel* m_olderTitle;
+    QVBoxLayout* m_olderLayout;
+    QPushButton* m_olderButton;
+    int m_olderOffset;
+    QSet<QString> m_olderIds;
 };
 
 } // namespace Witra
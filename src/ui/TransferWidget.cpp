@@ -214,6 +214,30 @@ void TransferWidget::updateDisplay()
                         ? "from" : "to";
     m_peerLabel->setText(QString("%1 %2").arg(direction).arg(m_transfer->peerName()));
     
+    // Fan-out sends list every target with its own progress
+    if (m_transfer->isFanOut()) {
+        const QList<TransferItem::Target> targets = m_transfer->targets();
+        m_peerLabel->setText(QString("to %1 devices (%2 done)")
+                             .arg(targets.size())
+                             .arg(m_transfer->finishedTargets()));
+        
+        QStringList lines;
+        for (const TransferItem::Target& target : targets) {
+            QString state;
+            if (target.status == TransferItem::Status::InProgress) {
+                state = formatSize(target.transferredSize);
+            } else if (target.status == TransferItem::Status::Failed) {
+                state = QString("Failed: %1").arg(target.errorMessage);
+            } else if (target.status == TransferItem::Status::Completed) {
+                state = "Completed";
+            } else {
+                state = "Cancelled";
+            }
+            lines.append(QString("%1 — %2").arg(target.peerName, state));
+        }
+        m_peerLabel->setToolTip(lines.join('\n'));
+    }
+    
     // Size
     qint64 transferred = m_transfer->transferredSize();
     qint64 total = m_transfer->totalSize();